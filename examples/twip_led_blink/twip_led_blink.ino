@@ -31,6 +31,9 @@
  *	- opcode 2 will turn off the LED
  *	- opcode 3 will reverse the current state of the LED
  *
+ * Every opcode has its own handler attached in setup(), twip.dispatch() calls them from loop() with
+ * the packet still inside the rx buffer. strict() drops any other opcode as soon as it arrives.
+ *
  */
 
 #include <Arduino.h>
@@ -43,6 +46,32 @@ twiprotocol twip = twiprotocol( TWI_ADDRESS );
 
 #define TWI_OTHER_ADDRESS 2
 
+void led_print( twipview* v ) {
+	Serial.print( "sender: " );
+	Serial.print( v->sender );
+
+	Serial.print( ", opcode: " );
+	Serial.print( v->opcode );
+
+	Serial.print( ", size: " );
+	Serial.println( v->size );
+}
+
+void led_on( twipview* v ) {
+	led_print( v );
+	if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, HIGH ); }
+}
+
+void led_off( twipview* v ) {
+	led_print( v );
+	if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, LOW ); }
+}
+
+void led_toggle( twipview* v ) {
+	led_print( v );
+	if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, ! digitalRead(LED_HEARTBEAT) ); }
+}
+
 void setup( void ) {
 	unsigned long seed = 0, count = 32;
 	while( count-- ) { seed = (seed<<1) | (analogRead(0)&1); }
@@ -52,6 +81,11 @@ void setup( void ) {
 	Serial.println( "uC running" );
 	
 	if( LED_HEARTBEAT ) { pinMode( LED_HEARTBEAT, OUTPUT ); }
+
+	twip.attach( 1, led_on );
+	twip.attach( 2, led_off );
+	twip.attach( 3, led_toggle );
+	twip.strict();
 }
 
 void loop( void ) {
@@ -76,40 +110,6 @@ void loop( void ) {
 			default: break;
 		}
 
-		while( twip.available() ) {
-			twippacket pkt = twip.receive();
-
-			if( pkt.complete ) {
-				Serial.print( "sender: " );
-				Serial.print( pkt.sender );
-
-				Serial.print( ", opcode: " );
-				Serial.print( pkt.opcode );
-
-				Serial.print( ", size: " );
-				Serial.println( pkt.size );
-				
-				switch( pkt.opcode ) {
-					case 1:
-						if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, HIGH ); }
-						break;
-						
-					case 2:
-						if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, LOW ); }
-						break;
-						
-					case 3:
-						if( LED_HEARTBEAT ) { digitalWrite( LED_HEARTBEAT, ! digitalRead(LED_HEARTBEAT) ); }
-						break;
-						
-					default: break;
-				}
-
-				free( pkt.payload );
-				#if __AVR_LIBC_VERSION__ < 20110216UL && defined __fix28135_h____
-				fix28135_malloc_bug();
-				#endif
-			}
-		}
+		twip.dispatch();
 	}
 }
\ No newline at end of file
@@ -0,0 +1,1620 @@
+/*
+ * benchmark.cpp - TWI Protocol library host benchmark
+ * Copyright (c) 2012 João Brázio <joao@brazio.org>, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * HOW TO USE THIS BENCHMARK
+ *
+ * Build and run it on the host with "make run" from this directory. Every result is printed as one
+ * JSON object per line so two runs can be diffed or loaded by any script. Bus figures (pkt_per_s,
+ * goodput_Bps, latency_us) come from the simulated bus virtual clock and are deterministic, CPU
+ * figures (*_ns) are wall clock nanoseconds measured on the host and include the simulator cost.
+ *
+ *	./benchmark [-n packets per run] [-t trace dump]
+ *
+ * Built with "make CRC=1" fragments carry a payload CRC, the corrupt run counts packets delivered with a
+ * flipped bit (undetected) and the crc run compares the CRC implementations with the header only sum.
+ *
+ * Built with "make TRACE=64" every event of the stats run is appended to the trace dump, convert it
+ * with extras/trace2pcap. send_ns of both builds tells the cost of tracing.
+ *
+ * Built with "make FLOW=0" send() doesn't read the receiver's credits, the flow run then shows the
+ * frames a slow receiver drops (rx_full) and the bus time they wasted.
+ *
+ * The compress run sends the same payloads plain and compressed, pack_ns and unpack_ns are the
+ * utility/lz8.c cost alone, to be weighed against the bus_us_per_pkt saved. Building with "make FLOW=0"
+ * turns compression off, the receiver's formats are never read.
+ *
+ * The spsc run hammers a circular buffer from a producer and a consumer thread, the same way the TWI
+ * interrupt and loop() share rx_buffer, and counts torn records: anything but 0 is a bug.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "twip.h"
+#include "utility/crc16.h"
+#include "utility/lz8.h"
+
+extern "C" {
+	#include "utility/twi.h"
+};
+
+#define BENCH_MAX_NODES 8
+#define BENCH_MAX_FRAMES 64
+
+// Fragment replay order of the interleave run
+#define BENCH_IN_ORDER	0
+#define BENCH_REVERSE	1	// Last fragment first
+#define BENCH_LOSSY		2	// Second fragment of every other packet is lost
+
+static const uint8_t bench_sizes[] = { 0, 1, 25, 26, 100, 254 };
+static const uint8_t bench_nodes[] = { 2, 4, 8 };
+
+static twiprotocol* nodes[BENCH_MAX_NODES];
+static uint8_t node_count = 0;
+
+// Frames captured from the bus monitor, replayed to time rx_add() alone
+static uint8_t frames[BENCH_MAX_FRAMES][TWI_BUFFER_LENGTH];
+static uint8_t frames_len[BENCH_MAX_FRAMES];
+static uint8_t frames_count = 0;
+
+// Trace dump written by the stats run
+static FILE* trace_out = NULL;
+
+// Set by a run whose results break a guarantee of the library, main() then fails
+static uint8_t bench_failed = false;
+
+/*
+ * Function: now_ns
+ *    Input: No input.
+ *   Output: Host monotonic clock in nanoseconds.
+ *
+ */
+static uint64_t now_ns( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Function: capture
+ *    Input: Destination address, frame data and length as seen on the bus.
+ *   Output: No output.
+ *
+ * Description: Bus monitor keeping a copy of the frames written while capturing is enabled.
+ *
+ */
+static void capture( uint8_t address, const uint8_t* data, uint8_t length ) {
+	(void) address;
+	if( frames_count >= BENCH_MAX_FRAMES ) { return; }
+	memcpy( frames[frames_count], data, length );
+	frames_len[frames_count++] = length;
+}
+
+/*
+ * Function: bus_setup
+ *    Input: uint8_t count is the number of nodes to attach to a fresh bus.
+ *   Output: No output.
+ *
+ * Description: Node i answers to TWI address i +1.
+ *
+ */
+static void bus_setup( uint8_t count ) {
+	for( uint8_t i = 0; i < node_count; i++ ) { delete nodes[i]; }
+
+	twi_host_reset();
+	for( uint8_t i = 0; i < count; i++ ) {
+		twi_host_select( i );
+		nodes[i] = new twiprotocol( i +1 );
+	}
+	node_count = count;
+}
+
+/*
+ * Function: intact
+ *    Input: Payload span and the index of its first byte within the packet.
+ *   Output: Boolean representing: 1 - Every byte holds its own index, 0 - Corrupted payload.
+ *
+ */
+static uint8_t intact( const uint8_t* data, uint8_t length, uint8_t offset = 0 ) {
+	for( uint8_t i = 0; i < length; i++ ) {
+		if( data[i] != (uint8_t) (offset + i) ) { return false; }
+	}
+	return true;
+}
+
+/*
+ * Function: drain
+ *    Input: uint8_t node to receive from, uint8_t size is the expected payload size,
+ *           uint8_t zero_copy selects view()/release() instead of receive().
+ *   Output: Number of complete and intact packets with the expected size.
+ *
+ */
+static uint32_t drain( uint8_t node, uint8_t size, uint8_t zero_copy = false ) {
+	uint32_t ret = 0;
+	twipview v;
+
+	twi_host_select( node );
+	while( nodes[node]->available() ) {
+		if( zero_copy && nodes[node]->view( &v ) ) {
+			if( v.size == size && intact( v.payload[0], v.length[0] ) &&
+				intact( v.payload[1], v.length[1], v.length[0] ) ) { ret++; }
+			nodes[node]->release( &v );
+			continue;
+		}
+
+		twippacket pkt = nodes[node]->receive();
+		if( pkt.complete && pkt.size == size && intact( pkt.payload, pkt.size ) ) { ret++; }
+		free( pkt.payload );
+	}
+
+	return ret;
+}
+
+/*
+ * Function: bench_send_receive
+ *    Input: uint8_t count is the number of nodes, size the payload size and packets the number of
+ *           packets to send.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Every node in turn sends one packet to the next node, which immediately receives it.
+ * send() CPU time includes the rx_add() run by the receiver from within the slave callback.
+ *
+ */
+static void bench_send_receive( uint8_t count, uint8_t size, uint32_t packets ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( count );
+
+	uint64_t t_send = 0, t_receive = 0;
+	uint32_t delivered = 0, errors = 0;
+	uint32_t latency_max = 0;
+	uint32_t t_start = micros();
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint8_t src = i % count;
+		uint8_t dst = (src +1) % count;
+
+		twi_host_select( src );
+		uint32_t t_sent = micros();
+		uint64_t t0 = now_ns();
+		nodes[src]->send( dst +1, 1, size, payload );
+		uint64_t t1 = now_ns();
+		uint32_t t_got = drain( dst, size );
+		uint64_t t2 = now_ns();
+
+		if( t_got ) { delivered += t_got; }
+		else { errors++; }
+
+		if( micros() - t_sent > latency_max ) { latency_max = micros() - t_sent; }
+		t_send += t1 - t0;
+		t_receive += t2 - t1;
+	}
+
+	uint32_t t_bus = micros() - t_start;
+	struct twi_host_stats stats;
+	twi_host_getStats( &stats );
+
+	double seconds = t_bus / 1e6;
+	printf( "{\"bench\":\"send_receive\",\"nodes\":%u,\"payload\":%u,\"packets\":%u,\"delivered\":%u,\"errors\":%u,"
+		"\"frames\":%u,\"frames_per_pkt\":%.2f,\"stops_per_pkt\":%.2f,\"bus_bytes\":%u,\"overhead\":%.3f,\"bus_us\":%u,"
+		"\"pkt_per_s\":%.1f,\"goodput_Bps\":%.1f,\"latency_us\":%.1f,\"latency_max_us\":%u,"
+		"\"send_ns\":%.0f,\"receive_ns\":%.0f}\n",
+		count, size, packets, delivered, errors,
+		stats.transactions, (double) stats.transactions / packets, (double) stats.stops / packets, stats.bytes,
+		size ? (double) stats.bytes / ((double) size * packets) : 0.0, t_bus,
+		seconds > 0 ? delivered / seconds : 0.0, seconds > 0 ? ((double) delivered * size) / seconds : 0.0,
+		(double) t_bus / packets, latency_max,
+		(double) t_send / packets, (double) t_receive / packets );
+}
+
+/*
+ * Function: bench_header
+ *    Input: uint8_t size is the payload size, packets the number of packets to send and uint8_t compact
+ *           whether the sender uses compact headers.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Blocking sends to a receiver draining after every packet. goodput_Bps is the payload
+ * delivered per second of bus time, credit reads included.
+ *
+ */
+static void bench_header( uint8_t size, uint32_t packets, uint8_t compact ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	twi_host_select( 0 );
+	nodes[0]->compact( compact );
+
+	uint32_t delivered = 0;
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		nodes[0]->send( 2, 1, size, payload );
+		delivered += drain( 1, size );
+	}
+
+	struct twi_host_stats bus;
+	twi_host_getStats( &bus );
+
+	printf( "{\"bench\":\"header\",\"compact\":%u,\"payload\":%u,\"packets\":%u,\"delivered\":%u,"
+		"\"bus_bytes_per_pkt\":%.2f,\"bus_us_per_pkt\":%.1f,\"goodput_Bps\":%.1f}\n",
+		compact, size, packets, delivered, (double) bus.bytes / packets, (double) bus.bus_us / packets,
+		bus.bus_us ? (double) delivered * size * 1e6 / bus.bus_us : 0.0 );
+}
+
+// Payloads of the compress run
+#define BENCH_BLANK		0	// Zeroed configuration blob
+#define BENCH_TEXT		1	// Text configuration, keys repeat
+#define BENCH_LOG		2	// Sensor log, records of slowly changing 16 bit readings
+#define BENCH_RANDOM	3	// Already compressed or encrypted data
+
+static const char* bench_kinds[] = { "blank", "text", "log", "random" };
+
+/*
+ * Function: bench_payload
+ *    Input: uint8_t kind is one of BENCH_BLANK..BENCH_RANDOM, payload receives size bytes, uint32_t seed
+ *           varies the content from one packet to the next.
+ *   Output: No output.
+ *
+ */
+static void bench_payload( uint8_t kind, uint8_t* payload, uint8_t size, uint32_t seed ) {
+	srand( seed );
+	memset( payload, 0, size );
+
+	for( uint8_t i = 0; i < size; i++ ) {
+		switch( kind ) {
+			case BENCH_TEXT: {
+				char line[24];
+				snprintf( line, sizeof(line), "ch%u.rate=%u\n", (unsigned) (i / 16) % 8, 100 + (unsigned) (seed % 4) * 50 );
+				payload[i] = line[i % 16 < strlen(line) ? i % 16 : 0];
+				break;
+			}
+			case BENCH_LOG: {
+				// [time, temperature, humidity, status] little endian
+				uint16_t t_record[4] = { (uint16_t) (seed * 100 + (i / 8) * 10), (uint16_t) (2300 + rand() % 4),
+					(uint16_t) (4500 + (i / 64)), 0 };
+				payload[i] = ((uint8_t*) t_record)[i % 8];
+				break;
+			}
+			case BENCH_RANDOM: payload[i] = rand(); break;
+		}
+	}
+}
+
+/*
+ * Function: bench_compress
+ *    Input: uint8_t kind is the payload, size its size, packets the number of packets to send and
+ *           uint8_t compress whether the sender compresses.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Blocking sends to a receiver draining after every packet, send_ns includes the
+ * receiver's rx_add() and receive_ns the expansion. ratio is the stream size over the payload size, 1
+ * when the stream would be larger; a packet is only sent compressed when it saves bytes.
+ *
+ */
+static void bench_compress( uint8_t kind, uint8_t size, uint32_t packets, uint8_t compress ) {
+	uint8_t payload[256];
+	uint8_t packed[256];
+
+	bus_setup( 2 );
+	twi_host_select( 0 );
+	nodes[0]->compress( compress );
+
+	uint64_t t_send = 0, t_receive = 0, t_pack = 0, t_unpack = 0, t_ratio = 0;
+	uint32_t delivered = 0;
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		bench_payload( kind, payload, size, i );
+
+		// The codec alone, expanded in place like a reassembly slot does
+		uint16_t t_need;
+		uint64_t t0 = now_ns();
+		uint8_t t_size = lz8_pack( payload, size, packed, sizeof(packed) -1, &t_need );
+		uint64_t t1 = now_ns();
+		lz8_unpack( packed, sizeof(packed), packed, t_size, size );
+		uint64_t t2 = now_ns();
+		t_pack += t1 - t0;
+		t_unpack += t2 - t1;
+		t_ratio += t_size ? t_size : size;
+
+		twi_host_select( 0 );
+		t0 = now_ns();
+		nodes[0]->send( 2, 1, size, payload );
+		t1 = now_ns();
+
+		twi_host_select( 1 );
+		while( nodes[1]->available() ) {
+			twippacket pkt = nodes[1]->receive();
+			if( pkt.complete && pkt.opcode == 1 && pkt.size == size && ! memcmp( pkt.payload, payload, size ) ) { delivered++; }
+			free( pkt.payload );
+		}
+		t2 = now_ns();
+
+		t_send += t1 - t0;
+		t_receive += t2 - t1;
+	}
+
+	twipstats tx, rx;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	struct twi_host_stats bus;
+	twi_host_getStats( &bus );
+
+	printf( "{\"bench\":\"compress\",\"kind\":\"%s\",\"compress\":%u,\"payload\":%u,\"packets\":%u,\"delivered\":%u,"
+		"\"packed\":%u,\"expanded\":%u,\"ratio\":%.3f,\"frames_per_pkt\":%.2f,\"bus_bytes_per_pkt\":%.1f,"
+		"\"bus_us_per_pkt\":%.1f,\"goodput_Bps\":%.1f,\"pack_ns\":%.0f,\"unpack_ns\":%.0f,\"send_ns\":%.0f,"
+		"\"receive_ns\":%.0f}\n",
+		bench_kinds[kind], compress, size, packets, delivered, tx.tx_packed, rx.rx_packed,
+		(double) t_ratio / ((double) size * packets), (double) tx.tx_fragments / packets,
+		(double) bus.bytes / packets, (double) bus.bus_us / packets,
+		bus.bus_us ? (double) delivered * size * 1e6 / bus.bus_us : 0.0,
+		(double) t_pack / packets, (double) t_unpack / packets, (double) t_send / packets,
+		(double) t_receive / packets );
+}
+
+/*
+ * Function: bench_rx_add
+ *    Input: uint8_t size is the payload size, packets the number of packets to ingest,
+ *           uint8_t zero_copy drains with view()/release() instead of receive().
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Captures the frames of one packet and replays them through put() (rx_add) with no
+ * bus involved, draining the rx buffer after every packet.
+ *
+ */
+static void bench_rx_add( uint8_t size, uint32_t packets, uint8_t zero_copy ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	frames_count = 0;
+	twi_host_setMonitor( capture );
+	twi_host_select( 0 );
+	nodes[0]->send( 2, 1, size, payload );
+	twi_host_setMonitor( NULL );
+	drain( 1, size );
+
+	uint64_t t_add = 0, t_receive = 0;
+	uint32_t delivered = 0, dropped = 0;
+
+	twi_host_select( 1 );
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint64_t t0 = now_ns();
+		uint8_t ok = true;
+		for( uint8_t j = 0; j < frames_count; j++ ) { ok &= nodes[1]->put( frames[j], frames_len[j] ); }
+		uint64_t t1 = now_ns();
+		delivered += drain( 1, size, zero_copy );
+		uint64_t t2 = now_ns();
+
+		if( ! ok ) { dropped++; }
+		t_add += t1 - t0;
+		t_receive += t2 - t1;
+	}
+
+	printf( "{\"bench\":\"%s\",\"nodes\":1,\"payload\":%u,\"packets\":%u,\"delivered\":%u,\"dropped\":%u,"
+		"\"frames_per_pkt\":%u,\"rx_add_ns\":%.0f,\"receive_ns\":%.0f}\n",
+		zero_copy ? "rx_view" : "rx_add", size, packets, delivered, dropped, frames_count,
+		(double) t_add / packets, (double) t_receive / packets );
+}
+
+/*
+ * Function: bench_corrupt
+ *    Input: uint8_t size is the payload size, packets the number of packets to ingest.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Replays the frames of two packets alternately through put() with one random bit flipped
+ * in one of them, the way noise on a long bus would. rejected packets were dropped by rx_add(),
+ * undetected ones were delivered with a corrupted payload.
+ *
+ */
+static void bench_corrupt( uint8_t size, uint32_t packets ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	frames_count = 0;
+	twi_host_setMonitor( capture );
+	twi_host_select( 0 );
+	nodes[0]->send( 2, 1, size, payload );
+	nodes[0]->send( 2, 1, size, payload );
+	twi_host_setMonitor( NULL );
+	drain( 1, size );
+
+	uint8_t per_packet = frames_count / 2;
+	uint32_t t_intact = 0, undetected = 0, rejected = 0;
+	uint8_t frame[TWI_BUFFER_LENGTH];
+	srand( 1 );
+
+	twi_host_select( 1 );
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint8_t t_first = (i & 1) * per_packet;
+		uint8_t t_frame = t_first + rand() % per_packet;
+		uint16_t t_bit = rand() % (frames_len[t_frame] * 8);
+
+		for( uint8_t j = t_first; j < t_first + per_packet; j++ ) {
+			memcpy( frame, frames[j], frames_len[j] );
+			if( j == t_frame ) { frame[t_bit / 8] ^= 1 << (t_bit % 8); }
+			nodes[1]->put( frame, frames_len[j] );
+		}
+
+		// Payload bits are only covered by a CRC, compact frames always have one
+		uint8_t t_delivered = false;
+		while( nodes[1]->available() ) {
+			twippacket pkt = nodes[1]->receive();
+			if( pkt.size == size && intact( pkt.payload, pkt.size ) ) { t_intact++; }
+			else { undetected++; }
+			t_delivered = true;
+			free( pkt.payload );
+		}
+		if( ! t_delivered ) { rejected++; }
+	}
+
+	printf( "{\"bench\":\"corrupt\",\"payload_crc\":%u,\"payload\":%u,\"packets\":%u,\"intact\":%u,"
+		"\"rejected\":%u,\"undetected\":%u}\n",
+		TWIP_PAYLOAD_CRC, size, packets, t_intact, rejected, undetected );
+}
+
+// Packets seen by the handlers of the dispatch run
+static uint32_t handled;
+
+static void bench_handler( twipview* v ) {
+	if( intact( v->payload[0], v->length[0] ) && intact( v->payload[1], v->length[1], v->length[0] ) ) { handled++; }
+}
+
+/*
+ * Function: bench_dispatch
+ *    Input: uint8_t size is the payload size, packets the number of packets to ingest and mode how the
+ *           receiver consumes them: 0 receive() and a switch on the opcode, TWIP_HANDLER_DEFERRED +1 or
+ *           TWIP_HANDLER_IRQ +1 a handler attached to the opcode, 3 strict() without any handler.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Replays the captured frames of one packet through put() like the rx_add run. handle_ns
+ * is the time spent in receive() or dispatch() afterwards, rx_add_ns includes interrupt handlers.
+ *
+ */
+static void bench_dispatch( uint8_t size, uint32_t packets, uint8_t mode ) {
+	static const char* names[] = { "switch", "deferred", "irq", "strict" };
+
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	frames_count = 0;
+	twi_host_setMonitor( capture );
+	twi_host_select( 0 );
+	nodes[0]->send( 2, 1, size, payload );
+	twi_host_setMonitor( NULL );
+	drain( 1, size );
+
+	twi_host_select( 1 );
+	if( mode == 1 || mode == 2 ) { nodes[1]->attach( 1, bench_handler, mode -1 ); }
+	if( mode == 3 ) { nodes[1]->strict(); }
+
+	uint64_t t_add = 0, t_handle = 0;
+	handled = 0;
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint64_t t0 = now_ns();
+		for( uint8_t j = 0; j < frames_count; j++ ) { nodes[1]->put( frames[j], frames_len[j] ); }
+		uint64_t t1 = now_ns();
+		if( mode == 0 ) {
+			while( nodes[1]->available() ) {
+				twippacket pkt = nodes[1]->receive();
+				switch( pkt.opcode ) {
+					case 1: if( intact( pkt.payload, pkt.size ) ) { handled++; } break;
+					default: break;
+				}
+				free( pkt.payload );
+			}
+		} else { nodes[1]->dispatch(); }
+		uint64_t t2 = now_ns();
+
+		t_add += t1 - t0;
+		t_handle += t2 - t1;
+	}
+
+	twipstats rx;
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"dispatch\",\"mode\":\"%s\",\"payload\":%u,\"packets\":%u,\"handled\":%u,\"dispatched\":%u,"
+		"\"unknown\":%u,\"rx_high_water\":%u,\"rx_add_ns\":%.0f,\"handle_ns\":%.0f,\"total_ns\":%.0f}\n",
+		names[mode], size, packets, handled, rx.rx_dispatched, rx.rx_unknown, rx.rx_high_water,
+		(double) t_add / packets, (double) t_handle / packets, (double) (t_add + t_handle) / packets );
+}
+
+/*
+ * Function: bench_filter
+ *    Input: uint8_t size is the payload size, packets the number of packets to ingest and mode how the
+ *           receiver ignores them: 0 receive() and discard, 1 filter_sender(), 2 filter_opcode().
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Replays the frames of one packet from a peer the receiver has no use for through put().
+ * discard_ns is the time receive() takes to get rid of it when it is not filtered.
+ *
+ */
+static void bench_filter( uint8_t size, uint32_t packets, uint8_t mode ) {
+	static const char* names[] = { "none", "sender", "opcode" };
+
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	frames_count = 0;
+	twi_host_setMonitor( capture );
+	twi_host_select( 0 );
+	nodes[0]->send( 2, 9, size, payload );
+	twi_host_setMonitor( NULL );
+	drain( 1, size );
+
+	twi_host_select( 1 );
+	if( mode == 1 ) { nodes[1]->filter_sender( 1, false ); }
+	if( mode == 2 ) { nodes[1]->filter_opcode( 9, false ); }
+
+	twipstats rx;
+	nodes[1]->stats( &rx, true );
+	uint64_t t_add = 0, t_discard = 0;
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint64_t t0 = now_ns();
+		for( uint8_t j = 0; j < frames_count; j++ ) { nodes[1]->put( frames[j], frames_len[j] ); }
+		uint64_t t1 = now_ns();
+		while( nodes[1]->available() ) { free( nodes[1]->receive().payload ); }
+		uint64_t t2 = now_ns();
+
+		t_add += t1 - t0;
+		t_discard += t2 - t1;
+	}
+
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"filter\",\"mode\":\"%s\",\"payload\":%u,\"packets\":%u,\"rx_packets\":%u,"
+		"\"denied_sender\":%u,\"denied_opcode\":%u,\"rx_high_water\":%u,\"rx_add_ns\":%.0f,\"discard_ns\":%.0f,"
+		"\"total_ns\":%.0f}\n",
+		names[mode], size, packets, rx.rx_packets, rx.rx_denied_sender, rx.rx_denied_opcode, rx.rx_high_water,
+		(double) t_add / packets, (double) t_discard / packets, (double) (t_add + t_discard) / packets );
+}
+
+/*
+ * Function: bench_crc
+ *    Input: uint16_t length is the number of bytes covered, runs the number of computations.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: CPU cost of the header only sum, of the bytewise table CRC the AVR uses and of the
+ * slicing by 8 CRC the host uses. The sum always covers five header bytes whatever length is.
+ *
+ */
+static void bench_crc( uint16_t length, uint32_t runs ) {
+	uint8_t data[256];
+	for( uint16_t i = 0; i < sizeof(data); i++ ) { data[i] = i * 7; }
+
+	volatile uint16_t sink = 0;
+
+	uint64_t t0 = now_ns();
+	for( uint32_t i = 0; i < runs; i++ ) {
+		data[0] = i;
+		sink = sink + (uint16_t) ~( ((data[0] << 8) + data[2]) + (((data[1] + data[6]) << 8) + data[3] ));
+	}
+	uint64_t t1 = now_ns();
+	for( uint32_t i = 0; i < runs; i++ ) {
+		data[0] = i;
+		sink = sink + crc16_update_table( CRC16_INIT, data, length );
+	}
+	uint64_t t2 = now_ns();
+	for( uint32_t i = 0; i < runs; i++ ) {
+		data[0] = i;
+		sink = sink + crc16_update( CRC16_INIT, data, length );
+	}
+	uint64_t t3 = now_ns();
+
+	printf( "{\"bench\":\"crc\",\"bytes\":%u,\"runs\":%u,\"header_sum_ns\":%.1f,\"crc_table_ns\":%.1f,"
+		"\"crc_slice8_ns\":%.1f,\"slice8_MBps\":%.1f}\n",
+		length, runs, (double) (t1 - t0) / runs, (double) (t2 - t1) / runs, (double) (t3 - t2) / runs,
+		t3 > t2 ? (double) length * runs * 1000.0 / (t3 - t2) : 0.0 );
+}
+
+/*
+ * Function: bench_interleave
+ *    Input: uint8_t senders is the number of concurrent senders, size the payload size, packets
+ *           the number of packets to ingest per sender and order one of BENCH_IN_ORDER, BENCH_REVERSE
+ *           or BENCH_LOSSY.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Captures two packets from every sender and replays their fragments round-robin into the
+ * same receiver, the way fragments of concurrent masters interleave on a busy bus. Both packets are
+ * replayed alternately so consecutive packets of a sender never share the id.
+ *
+ */
+static void bench_interleave( uint8_t senders, uint8_t size, uint32_t packets, uint8_t order = BENCH_IN_ORDER ) {
+	static const char* names[] = { "interleave", "reorder", "lossy" };
+
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	uint8_t first[BENCH_MAX_NODES +1];
+
+	bus_setup( senders +1 );
+	frames_count = 0;
+	twi_host_setMonitor( capture );
+	for( uint8_t i = 0; i < senders; i++ ) {
+		first[i] = frames_count;
+		twi_host_select( i +1 );
+		nodes[i +1]->send( 1, 1, size, payload );
+		nodes[i +1]->send( 1, 1, size, payload );
+	}
+	first[senders] = frames_count;
+	twi_host_setMonitor( NULL );
+	drain( 0, size );
+
+	uint8_t per_packet = (first[1] - first[0]) / 2;
+	uint64_t t_add = 0, t_receive = 0;
+	uint32_t delivered = 0;
+
+	twi_host_select( 0 );
+	for( uint32_t i = 0; i < packets; i++ ) {
+		uint64_t t0 = now_ns();
+		for( uint8_t j = 0; j < per_packet; j++ ) {
+			uint8_t t_frame = ( order == BENCH_REVERSE ) ? per_packet -1 -j : j;
+			if( order == BENCH_LOSSY && (i & 1) && t_frame == 1 ) { continue; }
+
+			t_frame += (i & 1) * per_packet;
+			for( uint8_t k = 0; k < senders; k++ ) { nodes[0]->put( frames[first[k] + t_frame], frames_len[first[k] + t_frame] ); }
+		}
+		uint64_t t1 = now_ns();
+		delivered += drain( 0, size );
+		uint64_t t2 = now_ns();
+
+		t_add += t1 - t0;
+		t_receive += t2 - t1;
+	}
+
+	printf( "{\"bench\":\"%s\",\"senders\":%u,\"slots\":%u,\"payload\":%u,\"packets\":%u,\"delivered\":%u,"
+		"\"frames_per_pkt\":%u,\"rx_add_ns\":%.0f,\"receive_ns\":%.0f}\n",
+		names[order], senders, TWIP_REASM_SLOTS, size, packets * senders, delivered, per_packet,
+		(double) t_add / (packets * senders), (double) t_receive / (packets * senders) );
+}
+
+/*
+ * Function: bench_arbitration
+ *    Input: uint8_t size is the payload size, packets the number of packets to send and arb_permille
+ *           the probability of losing the arbitration on every START.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Blocking sends on a bus where other masters win the arbitration now and then, lost
+ * arbitrations are retried by twi_writeMasterBuffer() after a random backoff.
+ *
+ */
+static void bench_arbitration( uint8_t size, uint32_t packets, uint16_t arb_permille ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	twi_host_setFaults( arb_permille, 0, 1 );
+
+	uint32_t delivered = 0, errors = 0;
+	uint32_t t_start = micros();
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		if( ! nodes[0]->send( 2, 1, size, payload ) ) { errors++; }
+		delivered += drain( 1, size );
+	}
+
+	uint32_t t_bus = micros() - t_start;
+	struct twi_bus_stats bus;
+	twi_getBusStats( &bus );
+	twi_host_setFaults( 0, 0, 1 );
+
+	printf( "{\"bench\":\"arbitration\",\"payload\":%u,\"packets\":%u,\"arb_permille\":%u,\"delivered\":%u,"
+		"\"errors\":%u,\"arb_retries\":%u,\"wait_us\":%.1f,\"latency_us\":%.1f}\n",
+		size, packets, arb_permille, delivered, errors, bus.arb_retries,
+		(double) bus.wait_us / packets, (double) t_bus / packets );
+}
+
+/*
+ * Function: trace_drain
+ *    Input: uint8_t save appends the events to the trace dump.
+ *   Output: Number of events read from the trace ring.
+ *
+ */
+static uint32_t trace_drain( uint8_t save ) {
+	struct twi_trace_record record;
+	uint32_t ret = 0;
+
+	while( twi_readTrace( &record ) ) {
+		if( save && trace_out ) { fwrite( &record, sizeof(record), 1, trace_out ); }
+		ret++;
+	}
+
+	return ret;
+}
+
+/*
+ * Function: bench_stats
+ *    Input: uint8_t size is the payload size, packets the number of packets to send and nack_permille
+ *           the probability of a data byte being NACKed.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Blocking sends on a faulty bus, then the sender reads the receiver's counters remotely
+ * with a TWIP_OP_STATS request; remote_match tells they are the ones the receiver reports locally.
+ * query_us is the virtual time from the request to the reply.
+ *
+ */
+static void bench_stats( uint8_t size, uint32_t packets, uint16_t nack_permille ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	twi_host_setFaults( 0, nack_permille, 1 );
+	trace_drain( false );
+
+	uint32_t delivered = 0, traced = 0;
+	uint64_t t_send = 0;
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		uint64_t t0 = now_ns();
+		nodes[0]->send( 2, 1, size, payload );
+		t_send += now_ns() - t0;
+		delivered += drain( 1, size );
+		traced += trace_drain( true );
+	}
+	twi_host_setFaults( 0, 0, 1 );
+
+	twipstats tx, local, remote;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	memset( &remote, 0, sizeof(remote) );
+
+	// The request is answered by the receiver's next available(), its reply is still on the bus. The
+	// snapshot is taken before, queuing the reply makes poll() read the sender's credits.
+	uint32_t t_query = micros();
+	twi_host_select( 0 );
+	nodes[0]->send( 2, TWIP_OP_STATS );
+	twi_host_select( 1 );
+	nodes[1]->stats( &local );
+	nodes[1]->available();
+
+	uint8_t t_replied = false;
+	while( ! t_replied && micros() - t_query < 100000 ) {
+		twi_host_advance( 100 );
+		twi_host_select( 0 );
+		while( nodes[0]->available() ) {
+			twippacket pkt = nodes[0]->receive();
+			if( pkt.opcode == TWIP_OP_STATS && pkt.size == sizeof(remote) ) {
+				memcpy( &remote, pkt.payload, sizeof(remote) );
+				t_replied = true;
+			}
+			free( pkt.payload );
+		}
+	}
+	t_query = micros() - t_query;
+
+	printf( "{\"bench\":\"stats\",\"payload\":%u,\"packets\":%u,\"nack_permille\":%u,\"delivered\":%u,"
+		"\"tx_packets\":%u,\"tx_fragments\":%u,\"tx_nacks\":%u,\"tx_bytes\":%u,\"rx_packets\":%u,\"rx_fragments\":%u,"
+		"\"rx_incomplete\":%u,\"rx_high_water\":%u,\"remote_match\":%u,\"query_us\":%u,\"send_ns\":%.0f,\"traced\":%u}\n",
+		size, packets, nack_permille, delivered,
+		tx.tx_packets, tx.tx_fragments, tx.tx_nacks, tx.tx_bytes, local.rx_packets, local.rx_fragments,
+		local.rx_incomplete, local.rx_high_water, t_replied && ! memcmp( &local, &remote, sizeof(local) ), t_query,
+		(double) t_send / packets, traced );
+
+	if( ! t_replied || memcmp( &local, &remote, sizeof(local) ) ) {
+		fprintf( stderr, "stats: the remote query %s\n", t_replied ? "doesn't match the receiver's counters" : "timed out" );
+		bench_failed = true;
+	}
+}
+
+/*
+ * Function: bench_reliable
+ *    Input: uint8_t size is the payload size, packets the number of packets to send and nack_permille
+ *           the probability of a data byte being NACKed.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: The same packets sent with send() and with send_reliable() over the same faulty bus.
+ * delivered counts intact packets the receiver got, duplicates the retransmissions it recognised and
+ * did not queue again. pkt_per_s is virtual time and includes the ack reads and the backoffs.
+ * acked_lost counts packets send_reliable() confirmed but the receiver never got intact, any of them
+ * fails the run.
+ *
+ */
+static void bench_reliable( uint8_t size, uint32_t packets, uint16_t nack_permille ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	uint32_t delivered[2], acked[2], elapsed[2], acked_lost = 0;
+	twipstats tx, rx;
+
+	for( uint8_t reliable = 0; reliable < 2; reliable++ ) {
+		bus_setup( 2 );
+		twi_host_setFaults( 0, nack_permille, 1 );
+
+		delivered[reliable] = 0;
+		acked[reliable] = 0;
+		uint32_t t0 = micros();
+		for( uint32_t i = 0; i < packets; i++ ) {
+			twi_host_select( 0 );
+			uint8_t t_acked;
+			if( reliable ) { t_acked = nodes[0]->send_reliable( 2, 1, size, payload ); }
+			else { t_acked = nodes[0]->send( 2, 1, size, payload ); }
+			uint32_t t_delivered = drain( 1, size );
+			if( reliable && t_acked && ! t_delivered ) { acked_lost++; }
+			acked[reliable] += t_acked;
+			delivered[reliable] += t_delivered;
+		}
+		elapsed[reliable] = micros() - t0;
+		twi_host_setFaults( 0, 0, 1 );
+	}
+
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"reliable\",\"payload\":%u,\"packets\":%u,\"nack_permille\":%u,\"delivered\":%u,"
+		"\"reliable_delivered\":%u,\"reliable_acked\":%u,\"acked_lost\":%u,\"retransmits\":%u,\"duplicates\":%u,"
+		"\"pkt_per_s\":%.0f,\"reliable_pkt_per_s\":%.0f}\n",
+		size, packets, nack_permille, delivered[0], delivered[1], acked[1], acked_lost, tx.tx_retransmits,
+		rx.rx_duplicates, elapsed[0] ? packets * 1e6 / elapsed[0] : 0.0, elapsed[1] ? packets * 1e6 / elapsed[1] : 0.0 );
+
+	if( acked_lost ) {
+		fprintf( stderr, "reliable: %u packets acked but not delivered\n", acked_lost );
+		bench_failed = true;
+	}
+}
+
+/*
+ * Function: bench_restart
+ *    Input: uint8_t size is the payload size, sessions the number of times the sender starts over and
+ *           packets the number of packets it sends with send_reliable() every time.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: The sender is reset between sessions while the receiver keeps running, so its reliable
+ * ids start over at 0 and the receiver still remembers the last one of the previous session. Every
+ * packet acked must be delivered, stale_ids counts the first attempts the receiver took for duplicates.
+ *
+ */
+static void bench_restart( uint8_t size, uint32_t sessions, uint32_t packets ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	uint32_t acked = 0, delivered = 0;
+
+	for( uint32_t j = 0; j < sessions; j++ ) {
+		twi_host_select( 0 );
+		delete nodes[0];
+		nodes[0] = new twiprotocol( 1 );
+
+		for( uint32_t i = 0; i < packets; i++ ) {
+			twi_host_select( 0 );
+			acked += nodes[0]->send_reliable( 2, 1, size, payload );
+			delivered += drain( 1, size );
+		}
+	}
+
+	twipstats rx;
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"restart\",\"payload\":%u,\"sessions\":%u,\"packets\":%u,\"acked\":%u,\"delivered\":%u,"
+		"\"stale_ids\":%u}\n", size, sessions, packets, acked, delivered, rx.rx_duplicates );
+
+	if( acked != delivered ) {
+		fprintf( stderr, "restart: %u packets acked, %u delivered\n", acked, delivered );
+		bench_failed = true;
+	}
+}
+
+/*
+ * Function: bench_window
+ *    Input: uint8_t size is the payload size, packets the number of packets to send, window the fragments
+ *           sent before reading the receiver's reply (0 for the whole packet), nack_permille the
+ *           probability of a data byte being NACKed and noise_permille of a frame getting corrupted.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: send_reliable() over a lossy bus. NACKs are seen by the sender, corrupted frames only by
+ * the receiver's checksum and its reply. resent counts the fragments sent again, a whole packet retry
+ * sends every fragment. goodput is the payload of intact packets delivered per second of virtual time.
+ *
+ */
+static void bench_window( uint8_t size, uint32_t packets, uint8_t window, uint16_t nack_permille, uint16_t noise_permille ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	twi_host_select( 0 );
+	nodes[0]->window( window );
+	twi_host_setFaults( 0, nack_permille, 1 );
+	twi_host_setNoise( noise_permille );
+
+	uint32_t acked = 0, delivered = 0;
+	uint32_t t0 = micros();
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		acked += nodes[0]->send_reliable( 2, 1, size, payload );
+		delivered += drain( 1, size );
+	}
+	uint32_t elapsed = micros() - t0;
+	twi_host_setFaults( 0, 0, 1 );
+	twi_host_setNoise( 0 );
+
+	twipstats tx;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+
+	struct twi_host_stats bus;
+	twi_host_getStats( &bus );
+
+	printf( "{\"bench\":\"window\",\"payload\":%u,\"packets\":%u,\"window\":%u,\"nack_permille\":%u,"
+		"\"noise_permille\":%u,\"acked\":%u,\"delivered\":%u,\"retransmits\":%u,\"resent\":%u,\"window_reads\":%u,"
+		"\"corrupted\":%u,\"bus_bytes_per_pkt\":%.1f,\"goodput_bytes_per_s\":%.0f}\n",
+		size, packets, window, nack_permille, noise_permille, acked, delivered, tx.tx_retransmits, tx.tx_resent,
+		tx.tx_window_reads, bus.corrupted, delivered ? (double) bus.bytes / delivered : 0.0,
+		elapsed ? (double) delivered * size * 1e6 / elapsed : 0.0 );
+}
+
+static uint8_t bulk_image[8192];
+static uint8_t bulk_copy[sizeof(bulk_image)];
+static uint32_t bulk_sink_us;
+static uint32_t bulk_drained_us;
+
+static uint8_t bulk_source( uint16_t offset, uint8_t* data, uint8_t length ) {
+	memcpy( data, bulk_image + offset, length );
+	return true;
+}
+
+static uint8_t bulk_sink( twipchunk* c ) {
+	memcpy( bulk_copy + c->offset, c->data, c->length );
+	return true;
+}
+
+/*
+ * Function: bulk_idle
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: The receiver's loop(), running alongside the sender, drains rx_buffer at most once every
+ * bulk_sink_us. Bulk chunks go to bulk_sink(), the other packets start with their offset.
+ *
+ */
+static void bulk_idle( void ) {
+	if( micros() - bulk_drained_us < bulk_sink_us ) { return; }
+	bulk_drained_us = micros();
+
+	twi_host_select( 1 );
+	while( nodes[1]->available() ) {
+		twippacket pkt = nodes[1]->receive();
+		uint16_t at = (pkt.payload[0] << 8) + pkt.payload[1];
+		if( pkt.complete && pkt.size > 2 ) { memcpy( bulk_copy + at, pkt.payload +2, pkt.size -2 ); }
+		free( pkt.payload );
+	}
+}
+
+/*
+ * Function: bench_bulk
+ *    Input: uint16_t bytes is the size of the transfer, nack_permille the probability of a data byte being
+ *           NACKed and sink_us how often the receiver's loop() runs.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: The same image sent by send_bulk() and, as sketches had to before, split into
+ * TWIP_BULK_CHUNK bytes packets sent by send_reliable() with the offset in front. goodput is virtual
+ * time, from the first chunk until the sender is done, and only counts when the receiver got the whole
+ * image intact.
+ *
+ */
+static void bench_bulk( uint16_t bytes, uint16_t nack_permille, uint32_t sink_us ) {
+	uint32_t seed = 7;
+	for( uint16_t i = 0; i < sizeof(bulk_image); i++ ) {
+		seed = seed * 1103515245 + 12345;
+		bulk_image[i] = seed >> 16;
+	}
+
+	uint8_t ok[2];
+	uint32_t elapsed[2];
+	twipstats tx, rx;
+
+	for( uint8_t bulk = 0; bulk < 2; bulk++ ) {
+		bus_setup( 2 );
+		twi_host_select( 1 );
+		nodes[1]->sink( bulk_sink );
+		twi_host_setFaults( 0, nack_permille, 1 );
+		twi_host_setIdle( bulk_idle );
+		bulk_sink_us = sink_us;
+		memset( bulk_copy, 0, sizeof(bulk_copy) );
+
+		uint32_t t0 = micros();
+		bulk_drained_us = t0;
+		twi_host_select( 0 );
+		if( bulk ) { ok[bulk] = nodes[0]->send_bulk( 2, 1, bytes, bulk_source ); }
+		else {
+			uint8_t chunk[2 + TWIP_BULK_CHUNK];
+			ok[bulk] = true;
+
+			for( uint16_t offset = 0; offset < bytes && ok[bulk]; offset += TWIP_BULK_CHUNK ) {
+				uint8_t length = ( bytes - offset > TWIP_BULK_CHUNK ) ? TWIP_BULK_CHUNK : bytes - offset;
+				chunk[0] = offset >> 8;
+				chunk[1] = offset & 0xFF;
+				memcpy( chunk +2, bulk_image + offset, length );
+
+				ok[bulk] = nodes[0]->send_reliable( 2, 1, length +2, chunk );
+			}
+		}
+		elapsed[bulk] = micros() - t0;
+
+		// The last chunks may still be queued
+		bulk_sink_us = 0;
+		bulk_idle();
+		twi_host_setIdle( NULL );
+		twi_host_setFaults( 0, 0, 1 );
+		ok[bulk] = ok[bulk] && ! memcmp( bulk_copy, bulk_image, bytes );
+	}
+
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"bulk\",\"bytes\":%u,\"chunk\":%u,\"window\":%u,\"nack_permille\":%u,\"sink_us\":%u,"
+		"\"reliable_ok\":%u,\"bulk_ok\":%u,\"rewinds\":%u,\"retransmits\":%u,\"dropped\":%u,\"duplicates\":%u,"
+		"\"reliable_bytes_per_s\":%.0f,\"bulk_bytes_per_s\":%.0f}\n",
+		bytes, TWIP_BULK_CHUNK, TWIP_BULK_WINDOW, nack_permille, sink_us, ok[0], ok[1], tx.tx_bulk_rewinds,
+		tx.tx_retransmits, rx.rx_bulk_dropped, rx.rx_duplicates,
+		ok[0] && elapsed[0] ? bytes * 1e6 / elapsed[0] : 0.0, ok[1] && elapsed[1] ? bytes * 1e6 / elapsed[1] : 0.0 );
+}
+
+/*
+ * Function: bench_flow
+ *    Input: uint8_t size is the payload size, packets the number of send() calls and every how many
+ *           calls the receiver consumes one packet.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: A sender faster than its receiver. Packets refused by send() are tried again on the next
+ * call, like a sketch would. bus_bytes_per_pkt counts every byte on the bus, credit reads and dropped
+ * frames included, per packet the receiver got. The receiver can't drain while send() waits here, the
+ * credit reads of a refused packet are all overhead.
+ *
+ */
+static void bench_flow( uint8_t size, uint32_t packets, uint32_t every ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+
+	uint32_t sent = 0, delivered = 0;
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		sent += nodes[0]->send( 2, 1, size, payload );
+
+		if( i % every != every -1 ) { continue; }
+		twi_host_select( 1 );
+		if( nodes[1]->available() ) {
+			twippacket pkt = nodes[1]->receive();
+			if( pkt.complete && pkt.size == size && intact( pkt.payload, pkt.size ) ) { delivered++; }
+			free( pkt.payload );
+		}
+	}
+	delivered += drain( 1, size );
+
+	twipstats tx, rx;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	struct twi_host_stats bus;
+	twi_host_getStats( &bus );
+
+	printf( "{\"bench\":\"flow\",\"flow_control\":%u,\"payload\":%u,\"packets\":%u,\"every\":%u,\"sent\":%u,"
+		"\"delivered\":%u,\"rx_full\":%u,\"throttled\":%u,\"credit_reads\":%u,\"bus_bytes_per_pkt\":%.1f}\n",
+		TWIP_FLOW_CONTROL, size, packets, every, sent, delivered, rx.rx_full, tx.tx_throttled, tx.tx_credit_reads,
+		delivered ? (double) bus.bytes / delivered : 0.0 );
+}
+
+/*
+ * Function: bench_priority
+ *    Input: uint8_t size is the payload size of the normal traffic, commands the number of urgent
+ *           packets to send, service_us the time the receiver takes to handle a packet and uint8_t
+ *           urgent whether commands are sent as TWIP_PRIO_URGENT or as normal packets.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: A sender keeps its tx_buffer full of normal packets and queues an 8 bytes command every
+ * 5 ms, the receiver handles one packet every service_us so its rx_buffer is backlogged as well.
+ * Latencies go from send_async() to receive() and are split per class. rx_full counts the packets the
+ * receiver dropped for lack of room, tx_throttled the ones the sender held back too long and dropped.
+ *
+ */
+static void bench_priority( uint8_t size, uint32_t commands, uint32_t service_us, uint8_t urgent ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+
+	uint32_t sent[2] = { 0, 0 }, got[2] = { 0, 0 };
+	uint64_t latency[2] = { 0, 0 };
+	uint32_t latency_max[2] = { 0, 0 };
+	uint32_t t_command = micros(), t_service = micros();
+
+	while( got[1] < commands && sent[1] < commands * 2 ) {
+		uint32_t t_now = micros();
+		memcpy( payload, &t_now, sizeof(t_now) );
+
+		twi_host_select( 0 );
+		if( t_now - t_command >= 5000 ) {
+			t_command = t_now;
+			sent[1] += nodes[0]->send_async( 2, 2, 8, payload, urgent ? TWIP_PRIO_URGENT : TWIP_PRIO_NORMAL );
+		}
+		while( nodes[0]->send_async( 2, 1, size, payload ) ) { sent[0]++; }
+		nodes[0]->poll();
+
+		twi_host_select( 1 );
+		if( t_now - t_service >= service_us && nodes[1]->available() ) {
+			t_service = t_now;
+			twippacket pkt = nodes[1]->receive();
+			uint8_t t_class = ( pkt.opcode == 2 );
+			uint32_t t_sent;
+			memcpy( &t_sent, pkt.payload, sizeof(t_sent) );
+
+			got[t_class]++;
+			latency[t_class] += t_now - t_sent;
+			if( t_now - t_sent > latency_max[t_class] ) { latency_max[t_class] = t_now - t_sent; }
+			free( pkt.payload );
+		}
+
+		twi_host_advance( 100 );
+	}
+
+	twipstats tx, rx;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+	twi_host_select( 1 );
+	nodes[1]->stats( &rx );
+
+	printf( "{\"bench\":\"priority\",\"payload\":%u,\"service_us\":%u,\"urgent\":%u,\"normal_sent\":%u,"
+		"\"normal_got\":%u,\"normal_latency_us\":%.0f,\"normal_latency_max_us\":%u,\"command_sent\":%u,"
+		"\"command_got\":%u,\"command_latency_us\":%.0f,\"command_latency_max_us\":%u,\"rx_full\":%u,"
+		"\"tx_throttled\":%u}\n",
+		size, service_us, urgent, sent[0], got[0], got[0] ? (double) latency[0] / got[0] : 0.0, latency_max[0],
+		sent[1], got[1], got[1] ? (double) latency[1] / got[1] : 0.0, latency_max[1], rx.rx_full, tx.tx_throttled );
+}
+
+/*
+ * Function: bench_batch
+ *    Input: uint8_t size is the payload size (0 or at least 4), messages the number of send() calls,
+ *           gap_us the virtual time between two of them and batch_us the batch() deadline, 0 to send
+ *           every message in a frame of its own.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: A node issuing small commands to one receiver which takes them as they come, a payload
+ * of at least 4 bytes carries the send() time for the latency. msgs_per_s is the number of messages the
+ * receiver got per second of bus time.
+ *
+ */
+static void bench_batch( uint8_t size, uint32_t messages, uint32_t gap_us, uint32_t batch_us ) {
+	uint8_t payload[256];
+	memset( payload, 0, sizeof(payload) );
+
+	bus_setup( 2 );
+	twi_host_select( 0 );
+	nodes[0]->batch( batch_us );
+
+	uint32_t sent = 0, delivered = 0;
+	uint64_t latency = 0;
+	uint32_t latency_max = 0;
+
+	for( uint32_t i = 0; i <= messages; i++ ) {
+		twi_host_select( 0 );
+		if( i < messages ) {
+			uint32_t t_now = micros();
+			memcpy( payload, &t_now, sizeof(t_now) );
+			sent += nodes[0]->send( 2, 1, size, payload );
+			nodes[0]->poll();
+		} else { nodes[0]->flush(); }
+
+		twi_host_select( 1 );
+		while( nodes[1]->available() ) {
+			twippacket pkt = nodes[1]->receive();
+			if( pkt.complete && pkt.opcode == 1 && pkt.size == size ) {
+				delivered++;
+				if( size >= 4 ) {
+					uint32_t t_sent;
+					memcpy( &t_sent, pkt.payload, sizeof(t_sent) );
+					latency += micros() - t_sent;
+					if( micros() - t_sent > latency_max ) { latency_max = micros() - t_sent; }
+				}
+			}
+			free( pkt.payload );
+		}
+
+		if( gap_us ) { twi_host_advance( gap_us ); }
+	}
+
+	twipstats tx;
+	twi_host_select( 0 );
+	nodes[0]->stats( &tx );
+
+	struct twi_host_stats bus;
+	twi_host_getStats( &bus );
+
+	printf( "{\"bench\":\"batch\",\"payload\":%u,\"messages\":%u,\"gap_us\":%u,\"batch_us\":%u,\"sent\":%u,"
+		"\"delivered\":%u,\"frames\":%u,\"batched\":%u,\"bus_bytes_per_msg\":%.1f,\"bus_us_per_msg\":%.1f,"
+		"\"msgs_per_s\":%.0f,\"latency_us\":%.0f,\"latency_max_us\":%u}\n",
+		size, messages, gap_us, batch_us, sent, delivered, tx.tx_fragments, tx.tx_batched,
+		delivered ? (double) bus.bytes / delivered : 0.0, delivered ? (double) bus.bus_us / delivered : 0.0,
+		bus.bus_us ? delivered * 1e6 / bus.bus_us : 0.0,
+		delivered && size >= 4 ? (double) latency / delivered : 0.0, latency_max );
+
+	// Without flow control a receiver draining slower than the batches come is overrun
+	if( TWIP_FLOW_CONTROL && delivered != sent ) {
+		fprintf( stderr, "batch: %u of %u packets sent were delivered\n", delivered, sent );
+		bench_failed = true;
+	}
+}
+
+// Packets reported by the onsent() callback of the async run
+static uint32_t async_sent;
+static uint32_t async_failed;
+
+static void async_onsent( uint8_t addr, uint8_t opcode, uint8_t status ) {
+	(void) addr;
+	(void) opcode;
+	if( status == 0 ) { async_sent++; }
+	else { async_failed++; }
+}
+
+/*
+ * Function: bench_async
+ *    Input: uint8_t size is the payload size, packets the number of packets to send, work_us the
+ *           application work done by loop() after every packet, uint8_t async selects send_async()
+ *           instead of send().
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Every loop() iteration sends one packet and then works for work_us, simulated by
+ * moving the virtual clock. blocked_us is the virtual time spent inside send()/send_async(), with
+ * send_async() the bus transfer overlaps with the work instead.
+ *
+ */
+static void bench_async( uint8_t size, uint32_t packets, uint32_t work_us, uint8_t async ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	async_sent = async_failed = 0;
+	twi_host_select( 0 );
+	nodes[0]->onsent( async_onsent );
+
+	uint32_t delivered = 0, blocked = 0;
+	uint32_t t_start = micros();
+
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		uint32_t t0 = micros();
+		if( async ) {
+			// tx_buffer is full, wait for room while the receiver keeps draining
+			while( ! nodes[0]->send_async( 2, 1, size, payload ) ) {
+				twi_host_advance( 100 );
+				nodes[0]->poll();
+				delivered += drain( 1, size );
+				twi_host_select( 0 );
+			}
+		} else { nodes[0]->send( 2, 1, size, payload ); }
+		blocked += micros() - t0;
+
+		twi_host_advance( work_us );
+		nodes[0]->poll();
+		delivered += drain( 1, size );
+	}
+
+	twi_host_select( 0 );
+	while( nodes[0]->poll() ) {
+		twi_host_advance( 100 );
+		delivered += drain( 1, size );
+		twi_host_select( 0 );
+	}
+	uint32_t t_total = micros() - t_start;
+
+	printf( "{\"bench\":\"%s\",\"payload\":%u,\"packets\":%u,\"work_us\":%u,\"delivered\":%u,\"reported\":%u,"
+		"\"failed\":%u,\"blocked_us\":%.1f,\"loop_us\":%.1f}\n",
+		async ? "send_async" : "send_sync", size, packets, work_us, delivered, async ? async_sent : delivered,
+		async_failed, (double) blocked / packets, (double) t_total / packets );
+}
+
+/*
+ * Function: bench_busy
+ *    Input: uint8_t size is the payload size, packets the number of packets queued by send_async(), every
+ *           how many packets a device outside the simulation holds the bus and busy_us for how long.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: Holds longer than TWI_BUS_TIMEOUT_US make the next write give up before it starts, the
+ * packet is reported failed and the queue goes on. Every flush() must return and the send_reliable()
+ * which follows must get through.
+ *
+ */
+static void bench_busy( uint8_t size, uint32_t packets, uint32_t every, uint32_t busy_us ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	async_sent = async_failed = 0;
+	twi_host_select( 0 );
+	nodes[0]->onsent( async_onsent );
+
+	uint32_t delivered = 0, stalled = 0;
+	for( uint32_t i = 0; i < packets; i++ ) {
+		if( i % every == every -1 ) { twi_host_setBusy( busy_us ); }
+
+		twi_host_select( 0 );
+		nodes[0]->send_async( 2, 1, size, payload );
+
+		uint32_t t0 = micros();
+		nodes[0]->flush();
+		if( micros() - t0 > 2 * TWI_BUS_TIMEOUT_US ) { stalled++; }
+		delivered += drain( 1, size );
+	}
+
+	twi_host_select( 0 );
+	uint8_t recovered = nodes[0]->send_reliable( 2, 1, size, payload );
+	delivered += drain( 1, size );
+
+	struct twi_bus_stats bus;
+	twi_getBusStats( &bus );
+
+	printf( "{\"bench\":\"busy\",\"payload\":%u,\"packets\":%u,\"every\":%u,\"busy_us\":%u,\"delivered\":%u,"
+		"\"reported\":%u,\"failed\":%u,\"timeouts\":%u,\"stalled\":%u,\"recovered\":%u}\n",
+		size, packets, every, busy_us, delivered, async_sent, async_failed, bus.timeouts, stalled, recovered );
+}
+
+/*
+ * Function: bench_contended
+ *    Input: uint8_t size is the payload size, packets the number of packets queued by send_async(),
+ *           arb_permille the probability of losing the arbitration on every START and addressed_permille
+ *           how often the winner then reads the loser.
+ *   Output: No output, prints one JSON line.
+ *
+ * Description: A master losing the arbitration to one addressing it as a slave never sees TW_MT_ARB_LOST,
+ * the write must still be reported. Every packet has to reach onsent() and no flush() may wait for the
+ * bus timeout.
+ *
+ */
+static void bench_contended( uint8_t size, uint32_t packets, uint16_t arb_permille, uint16_t addressed_permille ) {
+	uint8_t payload[256];
+	for( uint16_t i = 0; i < sizeof(payload); i++ ) { payload[i] = i; }
+
+	bus_setup( 2 );
+	twi_host_setFaults( arb_permille, 0, 1 );
+	twi_host_setAddressed( addressed_permille );
+	async_sent = async_failed = 0;
+	twi_host_select( 0 );
+	nodes[0]->onsent( async_onsent );
+
+	uint32_t delivered = 0, stalled = 0;
+	for( uint32_t i = 0; i < packets; i++ ) {
+		twi_host_select( 0 );
+		nodes[0]->send_async( 2, 1, size, payload );
+
+		uint32_t t0 = micros();
+		nodes[0]->flush();
+		if( micros() - t0 > TWI_BUS_TIMEOUT_US ) { stalled++; }
+		delivered += drain( 1, size );
+	}
+
+	struct twi_host_stats host;
+	twi_host_getStats( &host );
+	twi_host_setFaults( 0, 0, 1 );
+	twi_host_setAddressed( 0 );
+
+	printf( "{\"bench\":\"contended\",\"payload\":%u,\"packets\":%u,\"arb_permille\":%u,\"addressed_permille\":%u,"
+		"\"delivered\":%u,\"reported\":%u,\"failed\":%u,\"arb_lost\":%u,\"addressed\":%u,\"stalled\":%u}\n",
+		size, packets, arb_permille, addressed_permille, delivered, async_sent, async_failed, host.arb_lost,
+		host.addressed, stalled );
+
+	if( async_sent + async_failed != packets || stalled ) {
+		fprintf( stderr, "contended: %u of %u packets reported, %u flush() stalled\n", async_sent + async_failed,
+			packets, stalled );
+		bench_failed = true;
+	}
+}
+
+// Shared state of the spsc run
+static cb<TWIP_RX_BUFFER_SIZE, twip_rx_index_t> spsc_buffer;
+static uint32_t spsc_records;
+
+/*
+ * Function: spsc_producer
+ *    Input: Unused thread argument.
+ *   Output: No output.
+ *
+ * Description: Writes spsc_records records of 1 to 32 bytes, each one filled with its own sequence
+ * number so the consumer can tell a record was torn or mixed with another.
+ *
+ */
+static void* spsc_producer( void* arg ) {
+	(void) arg;
+	for( uint32_t i = 0; i < spsc_records; ) {
+		uint8_t t_len = (i % 32) +1;
+		if( spsc_buffer.available() < t_len +1 ) { sched_yield(); continue; }
+
+		spsc_buffer.write( t_len );
+		for( uint8_t j = 0; j < t_len; j++ ) { spsc_buffer.write( (uint8_t) i ); }
+		spsc_buffer.commit();
+		i++;
+	}
+	return NULL;
+}
+
+/*
+ * Function: bench_spsc
+ *    Input: uint32_t records is the number of records to push through the buffer.
+ *   Output: No output, prints one JSON line.
+ *
+ */
+static void bench_spsc( uint32_t records ) {
+	pthread_t producer;
+	uint32_t torn = 0;
+	uint64_t bytes = 0;
+
+	spsc_buffer.init();
+	spsc_records = records;
+
+	uint64_t t0 = now_ns();
+	pthread_create( &producer, NULL, spsc_producer, NULL );
+
+	for( uint32_t i = 0; i < records; ) {
+		if( spsc_buffer.empty() ) { sched_yield(); continue; }
+
+		// A committed record is always complete
+		uint8_t t_len = spsc_buffer.read();
+		if( t_len != (i % 32) +1 || spsc_buffer.used() < t_len ) { torn++; }
+		for( uint8_t j = 0; j < t_len; j++ ) {
+			if( spsc_buffer.read() != (uint8_t) i ) { torn++; }
+		}
+		bytes += t_len +1;
+		i++;
+	}
+
+	pthread_join( producer, NULL );
+	uint64_t t1 = now_ns();
+
+	double seconds = (t1 - t0) / 1e9;
+	printf( "{\"bench\":\"spsc\",\"records\":%u,\"torn\":%u,\"records_per_s\":%.0f,\"bytes_per_s\":%.0f}\n",
+		records, torn, records / seconds, bytes / seconds );
+}
+
+int main( int argc, char** argv ) {
+	uint32_t packets = 2000;
+
+	for( int i = 1; i < argc; i++ ) {
+		if( ! strcmp(argv[i], "-n") && i +1 < argc ) { packets = strtoul( argv[++i], NULL, 10 ); }
+		else if( ! strcmp(argv[i], "-t") && i +1 < argc ) {
+			trace_out = fopen( argv[++i], "wb" );
+			if( ! trace_out ) { perror( argv[i] ); return 1; }
+		}
+		else { fprintf( stderr, "usage: %s [-n packets] [-t trace dump]\n", argv[0] ); return 1; }
+	}
+
+	for( uint8_t i = 0; i < sizeof(bench_nodes); i++ ) {
+		for( uint8_t j = 0; j < sizeof(bench_sizes); j++ ) {
+			bench_send_receive( bench_nodes[i], bench_sizes[j], packets );
+		}
+	}
+
+	for( uint8_t j = 0; j < sizeof(bench_sizes); j++ ) {
+		bench_rx_add( bench_sizes[j], packets, false );
+	}
+
+	for( uint8_t j = 0; j < sizeof(bench_sizes); j++ ) {
+		bench_rx_add( bench_sizes[j], packets, true );
+	}
+
+	for( uint8_t i = 0; i < sizeof(bench_nodes); i++ ) {
+		bench_interleave( bench_nodes[i] -1, 100, packets );
+	}
+
+	bench_interleave( 2, 254, packets, BENCH_REVERSE );
+	bench_interleave( 1, 100, packets, BENCH_LOSSY );
+
+	for( uint8_t j = 0; j < sizeof(bench_sizes); j++ ) {
+		bench_async( bench_sizes[j], packets, 2000, false );
+
+		// Larger packets don't fit on tx_buffer
+		if( bench_sizes[j] + 4 < TWIP_TX_BUFFER_SIZE ) { bench_async( bench_sizes[j], packets, 2000, true ); }
+	}
+
+	bench_busy( 20, packets / 10, 10, 10000 );
+	bench_busy( 20, packets / 10, 10, 40000 );
+	bench_contended( 20, packets / 10, 200, 500 );
+
+	bench_arbitration( 100, packets, 0 );
+	bench_arbitration( 100, packets, 50 );
+	bench_arbitration( 100, packets, 200 );
+
+	for( uint8_t j = 0; j < sizeof(bench_sizes); j++ ) {
+		bench_header( bench_sizes[j], packets, false );
+		bench_header( bench_sizes[j], packets, true );
+	}
+
+	for( uint8_t i = 0; i < 4; i++ ) {
+		bench_compress( i, 100, packets, false );
+		bench_compress( i, 100, packets, true );
+		bench_compress( i, 254, packets, false );
+		bench_compress( i, 254, packets, true );
+	}
+
+	for( uint8_t i = 0; i < 4; i++ ) { bench_dispatch( 16, packets, i ); }
+	for( uint8_t i = 0; i < 4; i++ ) { bench_dispatch( 100, packets, i ); }
+	for( uint8_t i = 0; i < 3; i++ ) { bench_filter( 16, packets, i ); }
+	for( uint8_t i = 0; i < 3; i++ ) { bench_filter( 100, packets, i ); }
+
+	bench_corrupt( 25, packets );
+	bench_corrupt( 100, packets );
+
+	bench_crc( TWI_BUFFER_LENGTH, packets * 100 );
+	bench_crc( 254, packets * 100 );
+
+	bench_stats( 100, packets, 0 );
+	bench_stats( 100, packets, 20 );
+
+	bench_flow( 20, packets, 1 );
+	bench_flow( 20, packets, 3 );
+	bench_flow( 100, packets, 3 );
+
+	bench_priority( 20, packets / 4, 4000, false );
+	bench_priority( 20, packets / 4, 4000, true );
+	bench_priority( 100, packets / 4, 4000, false );
+	bench_priority( 100, packets / 4, 4000, true );
+
+	for( uint8_t i = 0; i < 2; i++ ) {
+		bench_batch( i * 4, packets, 0, 0 );
+		bench_batch( i * 4, packets, 0, 1000 );
+		bench_batch( i * 4, packets, 100, 0 );
+		bench_batch( i * 4, packets, 100, 1000 );
+	}
+
+	bench_reliable( 100, packets, 0 );
+	bench_reliable( 100, packets, 20 );
+	bench_reliable( 254, packets, 20 );
+	bench_restart( 20, 100, 1 );
+	bench_restart( 100, 10, 65 );
+
+	static const uint8_t windows[] = { 1, 2, 4, 0 };
+	for( uint8_t i = 0; i < sizeof(windows); i++ ) {
+		bench_window( 254, packets / 4, windows[i], 0, 0 );
+		bench_window( 254, packets / 4, windows[i], 20, 0 );
+		bench_window( 254, packets / 4, windows[i], 0, 50 );
+		bench_window( 254, packets / 4, windows[i], 0, 200 );
+	}
+
+	bench_bulk( 4096, 0, 0 );
+	bench_bulk( 4096, 0, 5000 );
+	bench_bulk( 4096, 5, 0 );
+	bench_bulk( 4096, 20, 0 );
+	bench_bulk( 8192, 20, 1000 );
+
+	bench_spsc( packets * 500 );
+
+	if( trace_out ) { fclose( trace_out ); }
+
+	return bench_failed;
+}
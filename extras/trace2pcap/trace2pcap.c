@@ -0,0 +1,263 @@
+/*
+  trace2pcap.c - Converts TWI trace dumps into a pcap capture file
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * HOW TO USE THIS TOOL
+ *
+ * A dump is the raw sequence of 16 byte twi_trace_record structures returned by twi_readTrace(), for
+ * instance written to Serial by the sketch and saved by a terminal:
+ *
+ *	struct twi_trace_record r;
+ *	while( twi_readTrace( &r ) ) { Serial.write( (uint8_t *) &r, sizeof(r) ); }
+ *
+ * Every dump given on the command line is merged, in time order, into a single pcap file:
+ *
+ *	./trace2pcap [-o capture.pcap] [-s node:offset_us].. dump..
+ *
+ * Each node stamps its events with its own micros(), -s shifts the events of a node by offset_us
+ * (may be negative) to line up captures taken on different boards. The 32 bit clock wrap around is
+ * undone per node. Packets use LINKTYPE_USER0 and carry the record as is:
+ *
+ *	offset 0  time    uint32 little endian, micros() of the logging node
+ *	offset 4  event   1 TX, 2 RX, 3 DROP, 4 BUS, 5 LOST (TWI_TRACE_* in utility/twi.h)
+ *	offset 5  node    address of the logging node
+ *	offset 6  peer    destination of a TX, sender of an RX
+ *	offset 7  info    twi_writeTo return code, drop reason (TWIP_DROP_*) or bus condition
+ *	offset 8  length  frame length
+ *	offset 9  frame   first 7 frame bytes, the twip header: sender, flag, opcode, id, checksum, len;
+ *	                  a frame with bit 7 of the sender set has the compact header instead: sender,
+ *	                  flag, opcode, id, len, CRC-8 then the payload; RX events always log the regular one
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define TRACE_RECORD_SIZE 16
+#define TRACE_MAX_NODES 128
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_LINKTYPE_USER0 147
+
+struct trace_event {
+  uint64_t time;      // unwrapped and shifted time in microseconds
+  uint32_t order;     // position in the input, keeps the sort stable
+  uint8_t record[TRACE_RECORD_SIZE];
+};
+
+static struct trace_event* events;
+static uint32_t events_count;
+static uint32_t events_size;
+
+static int64_t node_offset[TRACE_MAX_NODES];
+
+/*
+ * Function get_le32
+ * Desc     decodes a little endian 32 bit value
+ * Input    data: first byte
+ * Output   value
+ */
+static uint32_t get_le32(const uint8_t* data)
+{
+  return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+/*
+ * Function put_le32
+ * Desc     writes a little endian 32 bit value
+ * Input    value: value to write
+ *          out: destination file
+ * Output   none
+ */
+static void put_le32(uint32_t value, FILE* out)
+{
+  uint8_t data[4] = { (uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24) };
+  fwrite(data, 1, sizeof(data), out);
+}
+
+/*
+ * Function put_le16
+ * Desc     writes a little endian 16 bit value
+ * Input    value: value to write
+ *          out: destination file
+ * Output   none
+ */
+static void put_le16(uint16_t value, FILE* out)
+{
+  uint8_t data[2] = { (uint8_t) value, (uint8_t) (value >> 8) };
+  fwrite(data, 1, sizeof(data), out);
+}
+
+/*
+ * Function load
+ * Desc     appends the records of a dump to events, undoing the clock wrap
+ *          around of every node
+ * Input    path: dump file
+ * Output   0 .. success
+ *          1 .. the file can't be read
+ */
+static int load(const char* path)
+{
+  uint8_t record[TRACE_RECORD_SIZE];
+  uint32_t last[TRACE_MAX_NODES];
+  uint64_t wraps[TRACE_MAX_NODES];
+  uint8_t seen[TRACE_MAX_NODES];
+  FILE* in = fopen(path, "rb");
+
+  if(!in){
+    perror(path);
+    return 1;
+  }
+
+  memset(seen, 0, sizeof(seen));
+  memset(wraps, 0, sizeof(wraps));
+
+  while(fread(record, 1, sizeof(record), in) == sizeof(record)){
+    uint8_t node = record[5] & (TRACE_MAX_NODES - 1);
+    uint32_t time = get_le32(record);
+    struct trace_event* e;
+
+    if(seen[node] && time < last[node]){
+      wraps[node] += 1ULL << 32;
+    }
+    seen[node] = 1;
+    last[node] = time;
+
+    if(events_count == events_size){
+      events_size = events_size ? events_size * 2 : 1024;
+      events = (struct trace_event*) realloc(events, events_size * sizeof(*events));
+      if(!events){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+
+    e = &events[events_count];
+    e->time = wraps[node] + time + node_offset[node];
+    e->order = events_count++;
+    memcpy(e->record, record, sizeof(record));
+  }
+
+  fclose(in);
+  return 0;
+}
+
+/*
+ * Function compare
+ * Desc     qsort callback, orders events by time then by input position
+ * Input    two events
+ * Output   comparison result
+ */
+static int compare(const void* a, const void* b)
+{
+  const struct trace_event* x = (const struct trace_event*) a;
+  const struct trace_event* y = (const struct trace_event*) b;
+
+  if(x->time != y->time){
+    return (x->time < y->time) ? -1 : 1;
+  }
+  return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+/*
+ * Function save
+ * Desc     writes every event as one pcap packet
+ * Input    out: destination file
+ * Output   none
+ */
+static void save(FILE* out)
+{
+  uint32_t i;
+
+  put_le32(PCAP_MAGIC, out);
+  put_le16(2, out);
+  put_le16(4, out);
+  put_le32(0, out);                 // thiszone
+  put_le32(0, out);                 // sigfigs
+  put_le32(65535, out);             // snaplen
+  put_le32(PCAP_LINKTYPE_USER0, out);
+
+  for(i = 0; i < events_count; ++i){
+    put_le32((uint32_t) (events[i].time / 1000000), out);
+    put_le32((uint32_t) (events[i].time % 1000000), out);
+    put_le32(TRACE_RECORD_SIZE, out);
+    put_le32(TRACE_RECORD_SIZE, out);
+    fwrite(events[i].record, 1, TRACE_RECORD_SIZE, out);
+  }
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr, "usage: %s [-o capture.pcap] [-s node:offset_us].. dump..\n", name);
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  const char* output = NULL;
+  FILE* out = stdout;
+  int i, inputs = 0;
+
+  // Offsets must be known before any dump is loaded
+  for(i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-s") && i + 1 < argc){
+      char* end;
+      long node = strtol(argv[++i], &end, 0);
+      if(*end != ':' || node < 0 || node >= TRACE_MAX_NODES){
+        usage(argv[0]);
+      }
+      node_offset[node] = strtoll(end + 1, NULL, 10);
+    }
+  }
+
+  for(i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-o") && i + 1 < argc){ output = argv[++i]; }
+    else if(!strcmp(argv[i], "-s") && i + 1 < argc){ ++i; }
+    else if(argv[i][0] == '-'){ usage(argv[0]); }
+    else if(load(argv[i])){ return 1; }
+    else{ inputs++; }
+  }
+
+  if(!inputs){
+    usage(argv[0]);
+  }
+
+  // A negative offset must not move an event before the epoch
+  for(i = 0; i < (int) events_count; ++i){
+    if((int64_t) events[i].time < 0){
+      events[i].time = 0;
+    }
+  }
+
+  qsort(events, events_count, sizeof(*events), compare);
+
+  if(output && !(out = fopen(output, "wb"))){
+    perror(output);
+    return 1;
+  }
+  save(out);
+  if(output){
+    fclose(out);
+  }
+
+  free(events);
+  return 0;
+}
@@ -17,14 +17,41 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef ARDUINO
 #include <Arduino.h>
+#else
+#include "utility/twi_host.h"
+#endif
 #include "utility/cb.h"
+#include "utility/crc16.h"
+#include "utility/crc8.h"
 #include "twip.h"
 
 extern "C" {
 	#include "utility/twi.h"
 };
 
+// Payload bytes carried by every fragment but the last one
+#define TWIP_FRAG_SIZE (TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE)
+
+// Bus time of a full fragment: START, address, data bytes and STOP
+#define TWIP_FRAME_US (((TWI_BUFFER_LENGTH +1) * 9UL +2) * 1000000UL / TWI_FREQ)
+
+// The fragment index is four bits wide
+typedef char twip_reasm_size_fits_index[ (TWIP_REASM_SIZE <= 16 * TWIP_FRAG_SIZE) ? 1 : -1 ];
+
+// TWIP_OP_STATS replies carry twipstats as is, the layout must be the same on every node
+typedef char twip_stats_has_no_padding[ (sizeof(twipstats) == 2 * 4 + 28 * 2) ? 1 : -1 ];
+
+// rx_service() queues them with send_async()
+typedef char twip_stats_fit_tx_buffer[ (sizeof(twipstats) + 4 < TWIP_TX_BUFFER_SIZE) ? 1 : -1 ];
+
+// A bulk chunk is reassembled in a single slot
+typedef char twip_bulk_chunk_fits_slot[ (TWIP_BULK_HEADER + TWIP_BULK_CHUNK <= TWIP_REASM_SIZE) ? 1 : -1 ];
+
+// A batch is sent as a single frame through tx_buffer
+typedef char twip_batch_fits_frame[ (TWIP_BATCH_SIZE <= TWIP_FRAG_SIZE && TWIP_BATCH_SIZE + 4 < TWIP_TX_BUFFER_SIZE) ? 1 : -1 ];
+
 /*
  * Function: class constructor
  *    Input: uint8_t addr is the TWI address that this master will use.
@@ -35,10 +62,50 @@ extern "C" {
  *
  */
 twiprotocol::twiprotocol( uint8_t addr ) {
+	this->pkt_id = 0;
+	this->rel_id = 0;
+	this->rx_ack[0] = 0;
+	this->rx_ack[1] = 0;
+	this->rx_ack[2] = TWIP_ACK_MISSING;
+	memset( this->rx_dedup, 0, sizeof(this->rx_dedup) );
+	this->rx_dedup_next = 0;
+	memset( this->tx_credit, 0, sizeof(this->tx_credit) );
+	memset( this->rx_known, 0, sizeof(this->rx_known) );
+	memset( this->rx_handlers, 0, sizeof(this->rx_handlers) );
+	this->rx_strict = false;
+	memset( this->rx_deny_sender, 0, sizeof(this->rx_deny_sender) );
+	memset( this->rx_deny_opcode, 0, sizeof(this->rx_deny_opcode) );
+	this->rx_filtering = false;
+	this->rx_dispatching = false;
+	this->tx_credit_next = 0;
+	memset( this->tx_batch, 0, sizeof(this->tx_batch) );
+	this->tx_batch_us = 0;
+	this->tx_compact = TWIP_COMPACT_HEADER;
+	this->tx_packing = TWIP_COMPRESS;
+	this->tx_window = TWIP_WINDOW;
+	this->tx_bulk_tag = 0;
+	memset( this->rx_bulk, 0, sizeof(this->rx_bulk) );
+	this->rx_bulk_next = 0;
+	this->rx_sink = NULL;
+	this->tx_busy = false;
+	this->tx_class = 0;
+	memset( this->tx_frag, 0, sizeof(this->tx_frag) );
+	this->tx_retries = 0;
+	this->tx_backoff = 0;
+	this->tx_holding = false;
+	this->tx_callback = NULL;
 	this->twi_address = addr;
-	this->rx_buffer.init( TWIP_MAX_BUFFER_SIZE );
+	memset( &this->counters, 0, sizeof(this->counters) );
+	for( uint8_t i = 0; i < TWIP_REASM_SLOTS; i++ ) { this->rx_slots[i].state = TWIP_SLOT_FREE; }
+
+	#ifndef ARDUINO
+	// On the simulated bus several instances share the process, let the callback find us.
+	twi_host_setContext( this );
+	#endif
 
 	twi_attachSlaveRxEvent( twip_onreceive );
+	twi_attachMasterTxEvent( twip_ontransmit );
+	twi_attachSlaveTxEvent( twip_onrequest );
 	twi_setAddress( addr );
 	twi_init();
 }
@@ -56,10 +123,28 @@ uint16_t twiprotocol::checksum( uint8_t sender, uint8_t flag, uint8_t opcode, ui
 	return ~( ((sender << 8) + opcode) + (((flag + len) << 8) + id ));
 }
 
+/*
+ * Function: twiprotocol::frame_checksum
+ *    Input: uint8_t* frame is a whole fragment, header and frame[6] payload bytes.
+ *   Output: uint16_t (2 bytes) checksum value expected in frame[4] and frame[5].
+ *
+ * Description: Fragments with TWIP_CRC set are protected by a CRC-16/CCITT of the header fields, the
+ * checksum itself excluded, and of the payload; the others by the header only checksum().
+ *
+ */
+uint16_t twiprotocol::frame_checksum( uint8_t* frame ) {
+	if( ! (frame[1] & TWIP_CRC) ) { return this->checksum( frame[0], frame[1], frame[2], frame[3], frame[6] ); }
+
+	uint16_t t_crc = crc16_update( CRC16_INIT, frame, 4 );
+	t_crc = crc16_update( t_crc, frame + 6, 1 );
+	return crc16_update( t_crc, frame + TWIP_HEADER_SIZE, frame[6] );
+}
+
 /*
  * Function: twiprotocol::flag_decode
- *    Input: uint8_t type can be TWIP_FLAG_NFO for the fragment information TWIP_FLAG_TTL for the TTL value,
- *           int8_t flag is raw flag byte fetched from a packet.
+ *    Input: uint8_t type can be TWIP_FLAG_NFO for the fragment information, TWIP_FLAG_IDX for the
+ *           fragment index or TWIP_FLAG_TTL for the TTL value of packets sent without TWIP_SEQ, int8_t
+ *           flag is raw flag byte fetched from a packet.
  *   Output: One byte (uint8_t) shifted to the right.
  *
  * Description: Returns the user selected part of the packet's flag byte. Please read twiprotocol::receive()
@@ -70,7 +155,8 @@ uint8_t twiprotocol::flag_decode( uint8_t type, uint8_t flag ) {
 	uint8_t ret = flag;
 	switch( type ) {
 		case TWIP_FLAG_NFO: ret <<= 6; ret >>= 6; break;
-		case TWIP_FLAG_TTL: ret >>= 4; break;
+		case TWIP_FLAG_TTL:
+		case TWIP_FLAG_IDX: ret >>= 4; break;
 	}
 	return ret;
 }
@@ -81,272 +167,2305 @@ uint8_t twiprotocol::flag_decode( uint8_t type, uint8_t flag ) {
  *           int bytes is the total size of packet's payload.
  *   Output: uint8_t (bool) 1 - Success, 0 - Failure.
  *
- * Description: A valid twip packet must be at least 7 bytes long and with a valid header checksum. If the
- * packet clears the validation then it tries to reserve enough memory on the queue to store the data.
+ * Description: A valid twip packet must be at least 7 bytes long and with a valid header checksum, or
+ * a compact frame with a valid CRC-8. If the packet clears the validation then it tries to reserve
+ * enough memory on the queue to store the data.
+ * Fragments are handed to twiprotocol::rx_reassemble() and batches to twiprotocol::rx_unbatch() instead.
  *
  */
 uint8_t twiprotocol::rx_add( uint8_t* data, int bytes ) {
-	// A valid twip packet must be at least TWIP_HEADER_SIZE (aligned on a boundary of 4) bytes long,
-	// packet's checksum must match header's checksum and enough available memory must exist on rx
-	// buffer, if any of those conditions are not true ignore packet.
-	if( bytes < ( TWIP_HEADER_SIZE + 3 ) & ~0x03 || (TWIP_HEADER_SIZE + data[6] +1) > this->rx_buffer.available() ||
-		(uint16_t) ((data[4] << 8) + data[5]) != this->checksum(data[0], data[1], data[2], data[3], data[6]) ) { return false; }
+	// Filtered senders and opcodes are shed on the raw header, before the checksum is computed. A frame
+	// whose header is corrupted is dropped either way. Reliable frames are validated first because
+	// their sender is told to give up.
+	uint8_t t_drop = ( this->rx_filtering && bytes >= TWIP_COMPACT_SIZE ) ? this->rx_filter( data ) : 0;
+
+	// The rest of the library only knows the regular header, compact frames are checked and expanded
+	uint8_t t_frame[TWIP_HEADER_SIZE + TWIP_FRAG_SIZE];
+	if( bytes >= TWIP_COMPACT_SIZE && (data[0] & TWIP_COMPACT) && ( ! t_drop || (data[3] & TWIP_ID_RELIABLE) ) ) {
+		if( ! this->rx_expand( data, bytes, t_frame ) ) {
+			this->counters.rx_checksum++;
+			twi_trace( TWI_TRACE_DROP, data[0] & ~TWIP_COMPACT, TWIP_DROP_CHECKSUM, data, bytes );
+			return false;
+		}
+		data = t_frame;
+		bytes = TWIP_HEADER_SIZE + t_frame[6];
+	}
+
+	// A valid twip packet must be at least TWIP_HEADER_SIZE bytes long and packet's checksum must match
+	// header's checksum. A frame truncated by a NACK is shorter than what its header announces, if any
+	// of those conditions are not true ignore packet.
+	if( ( ! t_drop || (data[3] & TWIP_ID_RELIABLE) ) &&
+		( bytes < TWIP_HEADER_SIZE || bytes < (TWIP_HEADER_SIZE + data[6]) ||
+		(uint16_t) ((data[4] << 8) + data[5]) != this->frame_checksum( data ) ) ) {
+		this->counters.rx_checksum++;
+		twi_trace( TWI_TRACE_DROP, data[0], TWIP_DROP_CHECKSUM, data, bytes );
+		return false;
+	}
+
+	// Dropped before they take any room, fragments included
+	if( t_drop ) {
+		switch( t_drop ) {
+			case TWIP_DROP_SENDER: this->counters.rx_denied_sender++; break;
+			case TWIP_DROP_DENIED: this->counters.rx_denied_opcode++; break;
+			default: this->counters.rx_unknown++; break;
+		}
+		this->rx_acknowledge( data, TWIP_ACK_REFUSED );
+		twi_trace( TWI_TRACE_DROP, data[0], t_drop, data, bytes );
+		return false;
+	}
+
+	if( this->flag_decode( TWIP_FLAG_NFO, data[1] ) != TWIP_NOF ) { return this->rx_reassemble( data ); }
+
+	if( data[2] == TWIP_OP_BATCH ) { return this->rx_unbatch( data ); }
+
+	return this->rx_store( data, data + TWIP_HEADER_SIZE );
+}
+
+/*
+ * Function: twiprotocol::rx_store
+ *    Input: uint8_t* header is the header of a validated single fragment packet, uint8_t* payload its
+ *           header[6] bytes long payload.
+ *   Output: uint8_t (bool) 1 - Success, 0 - Failure.
+ *
+ * Description: Queues the packet on the rx_buffer of its class or hands it to its interrupt handler.
+ * The payload doesn't have to follow the header, packets split out of a batch share the frame.
+ *
+ */
+uint8_t twiprotocol::rx_store( uint8_t* header, uint8_t* payload ) {
+	// A reliable packet sent again because its ack was lost, it is already queued
+	if( this->rx_seen( header ) ) {
+		this->counters.rx_duplicates++;
+		this->rx_acknowledge( header, TWIP_ACK_SEEN );
+		return true;
+	}
+
+	twip_rx_buffer_t* t_ring = this->rx_class( header[3] );
+
+	// Interrupt handlers get the packet straight from the TWI buffer, it never enters rx_buffer
+	twipentry* t_entry = this->rx_handler( header[2] );
+	if( t_entry && t_entry->mode == TWIP_HANDLER_IRQ ) {
+		twipview t_view;
+
+		t_view.slot		= TWIP_RX_SLOT;
+		t_view.sender	= header[0];
+		t_view.flag		= header[1];
+		t_view.opcode	= header[2];
+		t_view.id		= header[3];
+		t_view.checksum	= (header[4] << 8) + header[5];
+		t_view.size		= header[6];
+		t_view.payload[0] = payload;
+		t_view.length[0] = header[6];
+		t_view.payload[1] = NULL;
+		t_view.length[1] = 0;
+		t_view.priority	= t_ring - this->rx_buffer;
+		t_view.complete	= true;
+
+		twi_trace( TWI_TRACE_RX, header[0], 0, header, TWIP_HEADER_SIZE + header[6] );
+		this->rx_direct( t_entry, &t_view, header );
+		return true;
+	}
 
-	// Add the accounting byte
-	this->rx_buffer.write( TWIP_HEADER_SIZE + data[6] );
+	// Enough available memory must exist on rx buffer
+	if( (TWIP_HEADER_SIZE + header[6] +1) > t_ring->available() ) {
+		this->counters.rx_full++;
+		this->rx_acknowledge( header, TWIP_ACK_FULL );
+		twi_trace( TWI_TRACE_DROP, header[0], TWIP_DROP_FULL, header, TWIP_HEADER_SIZE + header[6] );
+		return false;
+	}
+
+	// Bulk chunks only enter in sequence
+	if( header[2] == TWIP_OP_BULK && ! this->rx_bulk_accept( header, payload, header[6] ) ) { return false; }
+
+	// Add the accounting byte followed by header and payload
+	t_ring->write( TWIP_HEADER_SIZE + header[6] );
+	t_ring->write( header, TWIP_HEADER_SIZE );
+	if( header[6] ) { t_ring->write( payload, header[6] ); }
+
+	// Make the whole packet visible to the consumer at once
+	t_ring->commit();
 
-	// Loop trough the payload and copy byte by byte to rx buffer
-	for( uint8_t i = 0; i < (TWIP_HEADER_SIZE + data[6]); i++ ) { this->rx_buffer.write( data[i] ); }
+	this->counters.rx_packets++;
+	this->counters.rx_bytes += header[6];
+	this->rx_delivered( header );
+	this->rx_acknowledge( header, TWIP_ACK_OK );
+	twi_trace( TWI_TRACE_RX, header[0], 0, header, TWIP_HEADER_SIZE + header[6] );
+	twip_rx_index_t t_used = TWIP_RX_BUFFER_SIZE -1 - t_ring->available();
+	if( t_used > this->counters.rx_high_water ) { this->counters.rx_high_water = t_used; }
 
 	#ifdef __INFO2____
 	Serial.print( "rx: " );
-	Serial.print( bytes );
+	Serial.print( TWIP_HEADER_SIZE + header[6] );
 	Serial.print( ", cb: " );
-	Serial.println( this->rx_buffer.available() );
+	Serial.println( t_ring->available() );
 	#endif
 
 	return true;
 }
-
 /*
- * Function: twiprotocol::send
- *    Input: Packet's basic info (header) and payload.
- *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ * Function: twiprotocol::rx_unbatch
+ *    Input: uint8_t* data is a validated TWIP_OP_BATCH frame.
+ *   Output: uint8_t (bool) 1 - Every packet was queued, 0 - At least one was dropped.
  *
- * Description: Fragments the packet if required and send it over the TWI bus, look up flag
- * meaning on the following table:
- *
- *	B00000000 - Packet not fragmented
- *	B00000001 - Fragmented packet / first fragmented packet of a set
- *	B00000011 - Last fragmented packet of a set
+ * Description: Stores every [opcode, length, payload] record of the frame as a packet of its own, with
+ * the sender, id and class of the frame. Filters apply to each packet, a record running past the end of
+ * the frame ends it.
  *
  */
-uint8_t twiprotocol::send( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload ) {
-	// Finds out the number of twip packets required to send payload.
-	// uint8_t packets is not declared as float on propose, uint8_t bytes excludes header size.
-	uint8_t packets = (bytes / (TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE)) +1;
-	if( bytes % (TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE) == 0 ) { packets--; }
-	if( packets == 0 ) { packets++; } // For packets without payload
-	uint8_t ret = false;
+uint8_t twiprotocol::rx_unbatch( uint8_t* data ) {
+	uint8_t t_header[TWIP_HEADER_SIZE];
+	uint8_t* t_record = data + TWIP_HEADER_SIZE;
+	uint8_t* t_end = t_record + data[6];
+	uint8_t ret = true;
+
+	t_header[0] = data[0];
+	t_header[1] = TWIP_NOF;
+	t_header[3] = data[3];
 
-	uint8_t t_payload_cur = 0;
+	while( t_record + 2 <= t_end && t_record + 2 + t_record[1] <= t_end ) {
+		t_header[2] = t_record[0];
+		t_header[6] = t_record[1];
+		uint16_t t_checksum = this->checksum( t_header[0], t_header[1], t_header[2], t_header[3], t_header[6] );
+		t_header[4] = t_checksum >> 8;
+		t_header[5] = t_checksum;
+
+		uint8_t t_drop = this->rx_filtering ? this->rx_filter( t_header ) : 0;
+		if( t_drop ) {
+			if( t_drop == TWIP_DROP_DENIED ) { this->counters.rx_denied_opcode++; }
+			else { this->counters.rx_unknown++; }
+			twi_trace( TWI_TRACE_DROP, t_header[0], t_drop, t_header, TWIP_HEADER_SIZE );
+			ret = false;
+		} else {
+			this->counters.rx_batched++;
+			ret &= this->rx_store( t_header, t_record +2 );
+		}
 
-	for( uint8_t i = 0; i < packets; i++ ) {
-		uint8_t t_this_pkt_len = bytes;
-		if( bytes > (TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE) ) { t_this_pkt_len = (TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE); }
-		uint8_t t_this_pkt_aligned = ( (TWIP_HEADER_SIZE + t_this_pkt_len) + 3 ) & ~0x03;
+		t_record += 2 + t_record[1];
+	}
 
-		// Allocate the required memory block for packet
-		uint8_t* packet = (uint8_t *) malloc( sizeof(uint8_t) * t_this_pkt_aligned );
+	return ret;
+}
 
-		// Populate packet's header with basic information
-		packet[0] = this->twi_address;
-		packet[1] = ( packets < 2 ) ? TWIP_NOF : TWIP_SOF;
-		packet[2] = opcode;
-		packet[3] = this->pkt_id;
-		packet[6] = t_this_pkt_len;
+/*
+ * Function: twiprotocol::rx_bulk_accept
+ *    Input: uint8_t* header is the header of a complete TWIP_OP_BULK packet about to be queued, uint8_t*
+ *           chunk its size bytes long payload.
+ *   Output: Boolean representing: 1 - Queue the chunk, 0 - Drop it, it was acknowledged.
+ *
+ * Description: Called from the interrupt once the chunk has room on rx_buffer. A chunk at offset 0 with
+ * a tag unknown for its sender starts a new transfer, in the entry of the oldest one when every entry is
+ * in use. The following chunks must come in sequence: the ones already accepted are acked as queued, a
+ * chunk past a gap is acked as missing so the sender goes back, a chunk of an unknown or aborted transfer
+ * is refused. Only accepted chunks move the transfer forward, the sink gets them from loop().
+ *
+ */
+uint8_t twiprotocol::rx_bulk_accept( uint8_t* header, uint8_t* chunk, uint8_t size ) {
+	twipbulk* t_bulk = NULL;
+	uint8_t t_status = TWIP_ACK_REFUSED;
 
-		// Last packet change flag's 2nd bit to 1 (AVR architecture is little endian)
-		if( (packets > 1 ) && (i == (packets -1)) ) { packet[1] = TWIP_EOF; }
+	for( uint8_t i = 0; i < TWIP_BULK_PEERS; i++ ) {
+		if( this->rx_bulk[i].state != TWIP_BULK_FREE && this->rx_bulk[i].sender == header[0] ) { t_bulk = &this->rx_bulk[i]; break; }
+	}
 
-		// Checksum is the last thing to be calculated
-		packet[4] = this->checksum( packet[0], packet[1], packet[2], packet[3], packet[6] ) >> 8;
-		packet[5] = this->checksum( packet[0], packet[1], packet[2], packet[3], packet[6] );
+	if( this->rx_sink && size >= TWIP_BULK_HEADER ) {
+		uint16_t t_total = (chunk[2] << 8) + chunk[3];
+		uint16_t t_offset = (chunk[4] << 8) + chunk[5];
 
-		// Copy the payload into packet
-		for( uint8_t j = TWIP_HEADER_SIZE; j < t_this_pkt_len; j++ ) {
-			packet[j] = payload[ t_payload_cur ];
-			t_payload_cur++;
+		if( (uint32_t) t_offset + size - TWIP_BULK_HEADER > t_total ) { t_status = TWIP_ACK_REFUSED; }
+		else if( t_bulk == NULL || t_bulk->tag != chunk[1] ) {
+			if( t_offset == 0 ) {
+				if( t_bulk == NULL ) {
+					t_bulk = &this->rx_bulk[this->rx_bulk_next];
+					this->rx_bulk_next = ( this->rx_bulk_next +1 ) % TWIP_BULK_PEERS;
+				}
+				t_bulk->sender = header[0];
+				t_bulk->tag = chunk[1];
+				t_bulk->total = t_total;
+				t_bulk->next = 0;
+				t_bulk->state = TWIP_BULK_RUNNING;
+				t_status = TWIP_ACK_OK;
+			}
+		}
+		else if( t_bulk->state == TWIP_BULK_ABORTED ) { t_status = TWIP_ACK_REFUSED; }
+		else if( t_offset < t_bulk->next ) {
+			// Sent again along with the rest of its window
+			this->counters.rx_duplicates++;
+			this->rx_acknowledge( header, TWIP_ACK_OK );
+			return false;
 		}
+		else { t_status = ( t_offset == t_bulk->next ) ? TWIP_ACK_OK : TWIP_ACK_MISSING; }
 
-		// NULL fill the packet aligned on boundary of four
-		for( uint8_t j = (TWIP_HEADER_SIZE + t_this_pkt_len); j < t_this_pkt_aligned; j++ ) {
-			packet[ TWIP_HEADER_SIZE + j ] = 0x00;
+		if( t_status == TWIP_ACK_OK ) {
+			t_bulk->next = t_offset + size - TWIP_BULK_HEADER;
+			return true;
 		}
+	}
 
-		// Only increase packet id if no fragmentation is required
-		if( packets < 2 ) { this->pkt_id++; }
+	this->counters.rx_bulk_dropped++;
+	this->rx_acknowledge( header, t_status );
+	twi_trace( TWI_TRACE_DROP, header[0], TWIP_DROP_BULK, header, TWIP_HEADER_SIZE );
+	return false;
+}
 
-		// Send the packet over the TWI bus and report return value
-		ret = twi_writeTo( addr, packet, t_this_pkt_aligned, true, true );
-		// TODO Take advantage of the new repeated start feature on the TWI library.
-		//(packets == i +1) ? true : false
+/*
+ * Function: twiprotocol::rx_bulk_sink
+ *    Input: twipview* v is a TWIP_OP_BULK packet accepted by rx_bulk_accept().
+ *   Output: No output.
+ *
+ * Description: Hands the chunk's bytes to the sink from loop(), in two calls when they wrap around
+ * rx_buffer. A sink returning false aborts the transfer, its chunks still queued are skipped and the
+ * following ones refused.
+ *
+ */
+void twiprotocol::rx_bulk_sink( twipview* v ) {
+	uint8_t t_header[TWIP_BULK_HEADER];
+	twipbulk* t_bulk = NULL;
+	twipchunk t_chunk;
 
-		#ifdef __INFO2____
-		switch( ret ) {
-			case 0: Serial.print( "tx: " ); Serial.println( t_this_pkt_aligned ); ret = true; break;
-			case 1: Serial.println( "Length too long for buffer" ); break;
-			case 2: Serial.println( "Address send, NACK received" ); break;
-			case 3: Serial.println( "Data send, NACK received" ); break;
-			default: Serial.println( "Other TWI error" ); break;
+	if( v->size < TWIP_BULK_HEADER || this->rx_sink == NULL ) { return; }
+
+	// The header may wrap around as well
+	for( uint8_t i = 0; i < TWIP_BULK_HEADER; i++ ) {
+		t_header[i] = ( i < v->length[0] ) ? v->payload[0][i] : v->payload[1][i - v->length[0]];
+	}
+
+	for( uint8_t i = 0; i < TWIP_BULK_PEERS; i++ ) {
+		twipbulk* b = &this->rx_bulk[i];
+		if( b->state != TWIP_BULK_FREE && b->sender == v->sender && b->tag == t_header[1] ) { t_bulk = b; break; }
+	}
+	if( t_bulk && t_bulk->state == TWIP_BULK_ABORTED ) { return; }
+
+	t_chunk.sender	= v->sender;
+	t_chunk.opcode	= t_header[0];
+	t_chunk.total	= (t_header[2] << 8) + t_header[3];
+	t_chunk.offset	= (t_header[4] << 8) + t_header[5];
+	t_chunk.length	= 0;
+	t_chunk.data	= NULL;
+
+	// An empty transfer is a single empty chunk
+	uint8_t t_ok = ( v->size > TWIP_BULK_HEADER ) ? true : this->rx_sink( &t_chunk );
+	uint8_t t_skip = TWIP_BULK_HEADER;
+
+	for( uint8_t i = 0; i < 2 && t_ok && v->size > TWIP_BULK_HEADER; i++ ) {
+		if( t_skip >= v->length[i] ) {
+			t_skip -= v->length[i];
+			continue;
 		}
-		#endif
 
-		#ifdef __INFO5____
-		Serial.print( "tx: " );
-		for( uint8_t j = 0; j < TWIP_HEADER_SIZE + packet[6]; j++ ) {
-			Serial.print( "0x" );
-			Serial.print( packet[j], HEX );
-			Serial.print( " " );
-		} Serial.println();
+		t_chunk.data = v->payload[i] + t_skip;
+		t_chunk.length = v->length[i] - t_skip;
+		t_skip = 0;
+		t_ok = this->rx_sink( &t_chunk );
+		t_chunk.offset += t_chunk.length;
+	}
+
+	if( ! t_ok && t_bulk ) {
+		#ifdef ARDUINO
+		uint8_t t_sreg = SREG;
+		cli();
+		#endif
+		if( t_bulk->sender == v->sender && t_bulk->tag == t_header[1] ) { t_bulk->state = TWIP_BULK_ABORTED; }
+		#ifdef ARDUINO
+		SREG = t_sreg;
 		#endif
+	}
+}
 
-		// Data accounting
-		bytes -= t_this_pkt_len;
+/*
+ * Function: twiprotocol::rx_expand
+ *    Input: uint8_t* data is a compact frame, int bytes its size and uint8_t* frame room for the same
+ *           frame with a regular header.
+ *   Output: Boolean representing: 1 - frame holds the expanded frame, 0 - Bad length, bad CRC-8 or
+ *           frame too long.
+ *
+ * Description: A frame truncated by a NACK doesn't match its length byte and is dropped before the
+ * CRC is even looked at, a CRC-8 alone lets one in 256 through. The expanded header gets its regular
+ * checksum and never has TWIP_CRC set.
+ *
+ */
+uint8_t twiprotocol::rx_expand( uint8_t* data, int bytes, uint8_t* frame ) {
+	uint8_t t_len = data[4];
 
-		// Cleanup
-		free( packet );
-	}
+	if( t_len > TWIP_FRAG_SIZE || bytes != TWIP_COMPACT_SIZE + t_len ) { return false; }
 
-	// Now we can increase packet id for fragmented packets
-	if( packets > 1 ) { this->pkt_id++; }
+	uint8_t t_crc = crc8_update( CRC8_INIT, data, 5 );
+	if( crc8_update( t_crc, data + TWIP_COMPACT_SIZE, t_len ) != data[5] ) { return false; }
 
-	return ret;
+	frame[0] = data[0] & ~TWIP_COMPACT;
+	frame[1] = data[1] & ~TWIP_CRC;
+	frame[2] = data[2];
+	frame[3] = data[3];
+	frame[6] = t_len;
+	memcpy( frame + TWIP_HEADER_SIZE, data + TWIP_COMPACT_SIZE, t_len );
+
+	uint16_t t_checksum = this->checksum( frame[0], frame[1], frame[2], frame[3], frame[6] );
+	frame[4] = t_checksum >> 8;
+	frame[5] = t_checksum;
+
+	return true;
 }
 
 /*
- * Function: twiprotocol::receive
- *    Input: No input.
- *   Output: twippacket structure with header and payload information filled.
+ * Function: twiprotocol::rx_filter
+ *    Input: uint8_t* data is a frame, its header was not validated yet.
+ *   Output: TWIP_DROP_SENDER, TWIP_DROP_DENIED or TWIP_DROP_OPCODE when the frame must be dropped, 0
+ *           otherwise.
  *
- * Description: Fetches the first packet from rx_buffer returning a twipacket structure. The rx queue's
- * policy is FIFO meaning that ascending array index is descending age of packet, to put it on another
- * words the lower index of the rx buffer is always the oldest packet on buffer and it will always be
- * fetched first. It's also important to note the complete flag, that flag will indicate if we were
- * able to return all fragments of the same packet.
+ * Description: A few bitmap lookups on the header, called from the interrupt for every frame while
+ * rx_filtering is set. The library's own opcodes are only subject to the sender filter.
  *
- **** MORE INFORMATION ****
- * A few words about the packet's flag, to start take note that AVR is little endian (LSB).
- * The byte flag is split into three blocks, the first block are the bits 1 and 2, the second block
- * are bits 3 and 4 and the last block are bits 5, 6, 7 and 8. If the first bit is set (TWIP_SOF) then
- * the packet is fragmented, the second bit will always be unset for every fragment of the same packet
- * and it will be set (TWIP_EOF) for the last fragment. The third and fourth bits are currently unused
- * and are internally reserved. The remaining four bits represent the packet's TTL (time-to-live) with
- * a maximum binary value 0x0F, please note that TTL value will not be sequential when increasing (+1).
  */
-twippacket twiprotocol::receive( void ) {
-	twippacket ret;
-	ret.complete = false;
+uint8_t twiprotocol::rx_filter( uint8_t* data ) {
+	uint8_t t_sender = data[0] & 0x7F;
+	uint8_t t_opcode = data[2];
 
-	// Don't do anything if buffer is empty.
-	if( this->rx_buffer.empty() ) { return ret; }
-
-	uint8_t t_count = 0;
-	uint8_t t_total_bytes = 0;
-
-	// Allocate the initial memory block for payload
-	ret.payload = (uint8_t *) malloc( sizeof(uint8_t) );
-
-	// Loop until a complete packet is found or reach the end of the available bytes on buffer.
-	while( ! ret.complete ) {
-		uint8_t t_flag = this->flag_decode( TWIP_FLAG_NFO, this->rx_buffer.peek(2) );
-		uint8_t t_size = this->rx_buffer.read() - TWIP_HEADER_SIZE;
-
-		t_total_bytes += t_size;
-		t_count++;
-
-		if( t_count == 1 ) { // Fetch header only for the first packet
-			ret.sender		= this->rx_buffer.read();
-			ret.flag		= this->rx_buffer.read();
-			ret.opcode		= this->rx_buffer.read();
-			ret.id			= this->rx_buffer.read();
-							  this->rx_buffer.read(); // Ignore checksum bytes
-							  this->rx_buffer.read(); // same here
-			ret.size		= this->rx_buffer.read();
-
-		} else { for( uint8_t i = 0; i < TWIP_HEADER_SIZE; i++ ) {
-				this->rx_buffer.read(); // Ignore everything
-		} }
-
-		// Reallocate the memory block to accommodate the additional payload data
-		uint8_t* np = (uint8_t *) realloc( ret.payload, sizeof(uint8_t) * t_total_bytes );
-		if( np != NULL ) { ret.payload = np; }
-
-		// Actually copy the data from buffer to twippacket's payload
-		for( uint8_t i = 0; i < t_size; i++ ) {
-			ret.payload[ (t_total_bytes - t_size) + i ] = this->rx_buffer.read();
-		}
+	if( this->rx_deny_sender[t_sender >> 3] & (1 << (t_sender & 7)) ) { return TWIP_DROP_SENDER; }
+	if( t_opcode >= TWIP_OP_RESERVED ) { return 0; }
+	if( this->rx_deny_opcode[t_opcode >> 3] & (1 << (t_opcode & 7)) ) { return TWIP_DROP_DENIED; }
+	if( this->rx_strict && ! (this->rx_known[t_opcode >> 3] & (1 << (t_opcode & 7))) ) { return TWIP_DROP_OPCODE; }
 
-		// Decides whether the packet is complete
-		switch( t_flag ) {
-			case TWIP_NOF: ret.complete = true;
-				break;
+	return 0;
+}
 
-			case TWIP_EOF:
-				ret.flag = TWIP_EOF;
-				ret.complete = true;
-				break;
+/*
+ * Function: twiprotocol::rx_reassemble
+ *    Input: uint8_t* data is a validated fragment.
+ *   Output: uint8_t (bool) 1 - Success, 0 - Failure.
+ *
+ * Description: Copies the fragment's payload straight into the reassembly slot of its (sender, id) set,
+ * at the offset given by its fragment index, so fragments may arrive in any order. Fragments sent
+ * without TWIP_SEQ are assumed to arrive in order. Once every fragment up to the last one is there
+ * the slot is handed over to the consumer by writing a two bytes record (TWIP_RX_SLOT, slot index)
+ * into the rx_buffer of its class, so complete packets still come out in arrival order.
+ *
+ * A set is abandoned as soon as a fragment contradicts it (index past the last fragment, short middle
+ * fragment, payload overflow), when its sender starts another packet of the same class, which is how
+ * a lost fragment is detected on a single master, or when it missed TWIP_MAX_TTL fragments belonging
+ * to other sets. An urgent packet may be sent between two fragments of a normal one.
+ * When every slot is in use the new set is dropped, evicting a set still in progress would let more
+ * concurrent senders than slots starve each other.
+ *
+ */
+uint8_t twiprotocol::rx_reassemble( uint8_t* data ) {
+	twipslot* t_slot = NULL;
+	twipslot* t_free = NULL;
+	uint8_t t_eof = ( this->flag_decode( TWIP_FLAG_NFO, data[1] ) == TWIP_EOF );
+
+	for( uint8_t i = 0; i < TWIP_REASM_SLOTS; i++ ) {
+		twipslot* s = &this->rx_slots[i];
+		uint8_t t_state = cb_acquire<uint8_t>( &s->state );
+
+		if( t_state == TWIP_SLOT_FILLING ) {
+			if( s->sender == data[0] && s->id == data[3] ) { t_slot = s; continue; }
+
+			// The sender moved to another packet or the set stopped receiving fragments
+			if( ( s->sender == data[0] && ! ((s->id ^ data[3]) & TWIP_ID_URGENT) ) || ++s->ttl > TWIP_MAX_TTL ) {
+				s->state = TWIP_SLOT_FREE;
+				t_state = TWIP_SLOT_FREE;
+				this->counters.rx_incomplete++;
+				twi_trace( TWI_TRACE_DROP, s->sender, TWIP_DROP_SET, NULL, 0 );
+			}
 		}
 
-		// If at the end of buffer break the cycle
-		if( this->rx_buffer.empty() ) { break; }
+		if( t_state == TWIP_SLOT_FREE && t_free == NULL ) { t_free = s; }
 	}
 
-	// Update header with total bytes read and checksum
-	ret.size = t_total_bytes;
-	ret.checksum = this->checksum( ret.sender, ret.flag, ret.opcode, ret.id, ret.size );
+	if( t_slot == NULL ) {
+		// Fragment of a reliable packet already queued, sent again because its ack was lost
+		if( this->rx_seen( data ) ) {
+			if( t_eof ) { this->counters.rx_duplicates++; }
+			this->rx_acknowledge( data, TWIP_ACK_SEEN );
+			return true;
+		}
 
-	if( ! ret.complete ) { // No complete packet found
-		// Checks if it's possible to restore the packet into buffer
-		if( ret.size + TWIP_HEADER_SIZE < this->rx_buffer.available()
-			&& this->flag_decode(TWIP_FLAG_TTL, ret.flag) < TWIP_MAX_TTL ) {
-			uint8_t t_flag = this->flag_decode( TWIP_FLAG_TTL, ret.flag );
-			t_flag++; // Increase packet's TTL
-
-			this->rx_buffer.write( ret.size + TWIP_HEADER_SIZE );
-			this->rx_buffer.write( ret.sender );
-			this->rx_buffer.write( (t_flag << 4) + this->flag_decode(TWIP_FLAG_NFO, ret.flag) );
-			this->rx_buffer.write( ret.opcode );
-			this->rx_buffer.write( ret.id );
-			this->rx_buffer.write( ret.checksum >> 8 );
-			this->rx_buffer.write( ret.checksum );
-			this->rx_buffer.write( ret.size );
-
-			// Move the payload back to the buffer
-			for( uint8_t i = 0; i < ret.size; i++ ) {
-				this->rx_buffer.write( ret.payload[i] );
-			}
+		// Without an index the last fragment can't open a set, its beginning was lost
+		if( t_eof && ! (data[1] & TWIP_SEQ) ) {
+			this->counters.rx_incomplete++;
+			this->rx_acknowledge( data, TWIP_ACK_MISSING );
+			twi_trace( TWI_TRACE_DROP, data[0], TWIP_DROP_SET, data, TWIP_HEADER_SIZE + data[6] );
+			return false;
+		}
+
+		t_slot = t_free;
+		if( t_slot == NULL ) {
+			this->counters.rx_full++;
+			this->rx_acknowledge( data, TWIP_ACK_FULL );
+			twi_trace( TWI_TRACE_DROP, data[0], TWIP_DROP_SLOT, data, TWIP_HEADER_SIZE + data[6] );
+			return false;
 		}
 
-		// Deallocate the memory block
-		uint8_t* np = (uint8_t *) realloc( ret.payload, sizeof(uint8_t) );
-		if( np != NULL ) { ret.payload = np; }
+		t_slot->sender	= data[0];
+		t_slot->opcode	= data[2];
+		t_slot->id		= data[3];
+		t_slot->size	= 0;
+		t_slot->count	= 0;
+		t_slot->mask	= 0;
+		t_slot->frags	= 0;
+		t_slot->state	= TWIP_SLOT_FILLING;
 	}
 
-	return ret;
+	t_slot->ttl = 0;
+	t_slot->stamp = micros();
+
+	// Until the set completes the sender has to send what it is missing
+	this->rx_acknowledge( data, TWIP_ACK_MISSING );
+
+	uint8_t t_index = ( data[1] & TWIP_SEQ ) ? this->flag_decode( TWIP_FLAG_IDX, data[1] ) : t_slot->frags;
+	uint16_t t_bit = 1 << t_index;
+	uint16_t t_offset = t_index * TWIP_FRAG_SIZE;
+
+	// Retransmitted fragment, already stored
+	if( t_slot->mask & t_bit ) { return true; }
+
+	// Every fragment but the last one is full, the last one must be past every fragment received
+	if( ( ! t_eof && data[6] != TWIP_FRAG_SIZE ) || t_offset + data[6] > TWIP_REASM_SIZE ||
+		( t_slot->count && t_index >= t_slot->count ) || ( t_eof && (t_slot->mask & ~((t_bit << 1) -1)) ) ) {
+		t_slot->state = TWIP_SLOT_FREE;
+		this->counters.rx_incomplete++;
+		twi_trace( TWI_TRACE_DROP, data[0], TWIP_DROP_SET, data, TWIP_HEADER_SIZE + data[6] );
+		return false;
+	}
+
+	memcpy( t_slot->payload + t_offset, data + TWIP_HEADER_SIZE, data[6] );
+	t_slot->mask |= t_bit;
+	t_slot->frags++;
+	this->counters.rx_fragments++;
+	twi_trace( TWI_TRACE_RX, data[0], 0, data, TWIP_HEADER_SIZE + data[6] );
+
+	if( t_eof ) {
+		t_slot->count = t_index +1;
+		t_slot->size = t_offset + data[6];
+	}
+
+	// Wait for the last fragment and for every gap before it to be filled
+	if( t_slot->count == 0 || t_slot->frags != t_slot->count ) { return true; }
+
+	twip_rx_buffer_t* t_ring = this->rx_class( data[3] );
+
+	// The packet is complete, an interrupt handler takes it in place and the slot is free again
+	twipentry* t_entry = this->rx_handler( t_slot->opcode );
+	if( t_entry && t_entry->mode == TWIP_HANDLER_IRQ ) {
+		twipview t_view;
+
+		this->rx_slot_view( t_slot - this->rx_slots, &t_view );
+		t_view.priority = t_ring - this->rx_buffer;
+		this->rx_direct( t_entry, &t_view, data );
+		t_slot->state = TWIP_SLOT_FREE;
+		return true;
+	}
+
+	// Otherwise publish the slot before the record pointing to it
+	if( t_ring->available() < 2 ) {
+		t_slot->state = TWIP_SLOT_FREE;
+		this->counters.rx_full++;
+		this->rx_acknowledge( data, TWIP_ACK_FULL );
+		twi_trace( TWI_TRACE_DROP, data[0], TWIP_DROP_FULL, data, TWIP_HEADER_SIZE + data[6] );
+		return false;
+	}
+	if( t_slot->opcode == TWIP_OP_BULK && ! this->rx_bulk_accept( data, t_slot->payload, t_slot->size ) ) {
+		t_slot->state = TWIP_SLOT_FREE;
+		return false;
+	}
+	this->rx_delivered( data );
+	this->rx_acknowledge( data, TWIP_ACK_OK );
+	cb_publish<uint8_t>( &t_slot->state, TWIP_SLOT_READY );
+
+	t_ring->write( TWIP_RX_SLOT );
+	t_ring->write( t_slot - this->rx_slots );
+	t_ring->commit();
+
+	this->counters.rx_packets++;
+	this->counters.rx_bytes += t_slot->size;
+
+	return true;
 }
 
 /*
- * Function: twiprotocol::available
+ * Function: twiprotocol::rx_seen
+ *    Input: uint8_t* data is a frame which passed the checksum.
+ *   Output: Boolean representing: 1 - Reliable packet already queued, 0 - New or not reliable packet.
+ *
+ */
+uint8_t twiprotocol::rx_seen( uint8_t* data ) {
+	if( ! (data[3] & TWIP_ID_RELIABLE) ) { return false; }
+
+	for( uint8_t i = 0; i < TWIP_DEDUP_SIZE; i++ ) {
+		if( this->rx_dedup[i][0] == data[0] ) { return ( this->rx_dedup[i][1] == data[3] ); }
+	}
+	return false;
+}
+
+/*
+ * Function: twiprotocol::rx_delivered
+ *    Input: uint8_t* data is a frame of the packet just queued.
+ *   Output: No output.
+ *
+ * Description: Remembers the last reliable id queued for every sender, up to TWIP_DEDUP_SIZE senders
+ * replaced round-robin. Ids of a sender only move forward so one entry per sender is enough. The entry
+ * outlives a reset of the sender, whose ids start over, the sender skips an id it gets TWIP_ACK_SEEN for
+ * on the first attempt.
+ *
+ */
+void twiprotocol::rx_delivered( uint8_t* data ) {
+	if( ! (data[3] & TWIP_ID_RELIABLE) ) { return; }
+
+	uint8_t i = 0;
+	while( i < TWIP_DEDUP_SIZE && this->rx_dedup[i][0] != data[0] ) { i++; }
+	if( i == TWIP_DEDUP_SIZE ) {
+		i = this->rx_dedup_next;
+		this->rx_dedup_next = ( i +1 ) % TWIP_DEDUP_SIZE;
+	}
+
+	this->rx_dedup[i][0] = data[0];
+	this->rx_dedup[i][1] = data[3];
+}
+
+/*
+ * Function: twiprotocol::rx_acknowledge
+ *    Input: uint8_t* data is the frame just handled, uint8_t status one of TWIP_ACK_*.
+ *   Output: No output.
+ *
+ * Description: Keeps the status of the last reliable frame for the read send_reliable() does right
+ * after its last fragment, see twiprotocol::rx_reply().
+ *
+ */
+void twiprotocol::rx_acknowledge( uint8_t* data, uint8_t status ) {
+	if( ! (data[3] & TWIP_ID_RELIABLE) ) { return; }
+
+	this->rx_ack[0] = data[0];
+	this->rx_ack[1] = data[3];
+	this->rx_ack[2] = status;
+}
+
+/*
+ * Function: twiprotocol::rx_reply
  *    Input: No input.
- *   Output: Boolean representing: 1 - At least one packets is available, 0 - No packets available.
+ *   Output: No output.
  *
- * Description: Wrapper function to return the total number of packets currently at rx_buffer
+ * Description: Called from the TWI interrupt when a master reads from this node, answers with the
+ * [TWIP_OP_ACK, sender, id, status] record of the last reliable frame received followed by the free
+ * reassembly slots, the free bytes of both rx_buffer, the TWIP_FORMAT_* this node reads and the
+ * fragments held of the packet, while it is incomplete. send_reliable() checks the record is about its
+ * own packet, send() only looks at the credits.
+ *
+ * Sets whose sender went quiet for TWIP_SLOT_TIMEOUT_US are given up here, otherwise a set abandoned
+ * by its sender would hold its slot for good once senders wait for a free one. Reads don't age the
+ * sets like fragments of other sets do, a master polling credits would expire the set of another
+ * one still sending.
  *
  */
-uint8_t twiprotocol::available( void ) { return ! this->rx_buffer.empty(); }
+void twiprotocol::rx_reply( void ) {
+	uint8_t t_reply[TWIP_ACK_SIZE] = { TWIP_OP_ACK, this->rx_ack[0], this->rx_ack[1], this->rx_ack[2], 0, 0, 0,
+		(uint8_t) ( ( this->tx_compact ? TWIP_FORMAT_COMPACT : 0 ) | TWIP_FORMAT_PACKED | TWIP_FORMAT_SACK ), 0, 0 };
+	uint8_t t_slots = 0;
+	uint32_t t_now = micros();
+
+	for( uint8_t i = 0; i < TWIP_REASM_SLOTS; i++ ) {
+		twipslot* s = &this->rx_slots[i];
+
+		if( s->state == TWIP_SLOT_FILLING && t_now - s->stamp > TWIP_SLOT_TIMEOUT_US ) {
+			s->state = TWIP_SLOT_FREE;
+			this->counters.rx_incomplete++;
+			twi_trace( TWI_TRACE_DROP, s->sender, TWIP_DROP_SET, NULL, 0 );
+		}
+		if( s->state == TWIP_SLOT_FREE ) { t_slots++; }
+
+		// Fragments of the packet the record is about
+		if( s->state == TWIP_SLOT_FILLING && s->sender == this->rx_ack[0] && s->id == this->rx_ack[1] ) {
+			t_reply[8] = s->mask >> 8;
+			t_reply[9] = s->mask & 0xFF;
+		}
+	}
+	t_reply[4] = t_slots;
+
+	for( uint8_t i = 0; i < 2; i++ ) {
+		twip_rx_index_t t_free = this->rx_class( i ? TWIP_ID_URGENT : 0 )->available();
+
+		#if TWIP_RX_BUFFER_SIZE > 256
+		if( t_free > 0xFF ) { t_free = 0xFF; }
+		#endif
+		t_reply[5 + i] = t_free;
+	}
+
+	twi_transmit( t_reply, sizeof(t_reply) );
+}
 
 /*
- * Function: twiprotocol::put
- *    Input: data is a pointer to payload to be added to the rx_buffer,
- *           bytes is the total size of payload.
- *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ * Function: twiprotocol::rx_handler
+ *    Input: uint8_t opcode of a packet.
+ *   Output: Entry of the handler attached to the opcode, NULL when there is none.
  *
- * Description: Public method acting as a wrapper to rx_add(), defined because it is a more (I hope)
- * user friendly name; rx_add() is the private method, so no access to it outside the class scope.
+ * Description: The rx_known bitmap answers for the opcodes without a handler, the common case, before
+ * the table is scanned.
  *
  */
-uint8_t twiprotocol::put( uint8_t* data, int bytes ) { return this->rx_add( data, bytes ); }
+twipentry* twiprotocol::rx_handler( uint8_t opcode ) {
+	if( ! (this->rx_known[opcode >> 3] & (1 << (opcode & 7))) ) { return NULL; }
+
+	for( uint8_t i = 0; i < TWIP_HANDLERS; i++ ) {
+		if( this->rx_handlers[i].handler && this->rx_handlers[i].opcode == opcode ) { return &this->rx_handlers[i]; }
+	}
+	return NULL;
+}
 
 /*
- * Function: twip_onreceive
- *    Input: uint8_t* data is the packet's payload to be added to the rx_buffer,
- *           int bytes is the total size of packet's payload.
+ * Function: twiprotocol::rx_direct
+ *    Input: twipentry* entry is the interrupt handler of the packet described by v, uint8_t* data its
+ *           last frame.
  *   Output: No output.
  *
- * Description: Wrapper function called by TWI when TW_SR_STOP is received on the bus. This function
- * MUST be the less cycle intensive possible, meaning that no fancy stuff like Serial.print() nor delay()
- * nor any other crap that could block the TWI bus SHOULD be used here.
+ * Description: Hands a complete packet to its handler from within the TWI interrupt, it is accounted
+ * and acknowledged like a packet queued on rx_buffer.
+ *
+ */
+void twiprotocol::rx_direct( twipentry* entry, twipview* v, uint8_t* data ) {
+	this->counters.rx_packets++;
+	this->counters.rx_bytes += v->size;
+	this->counters.rx_dispatched++;
+	this->rx_delivered( data );
+	this->rx_acknowledge( data, TWIP_ACK_OK );
+
+	entry->handler( v );
+}
+
+/*
+ * Function: twiprotocol::rx_slot_view
+ *    Input: uint8_t slot is the index of a complete reassembly slot, twipview* v the structure to fill.
+ *   Output: No output.
+ *
+ */
+void twiprotocol::rx_slot_view( uint8_t slot, twipview* v ) {
+	twipslot* t_slot = &this->rx_slots[slot];
+
+	v->slot		= slot;
+	v->sender	= t_slot->sender;
+	v->flag		= TWIP_EOF;
+	v->opcode	= t_slot->opcode;
+	v->id		= t_slot->id;
+	v->size		= t_slot->size;
+	v->checksum	= this->checksum( v->sender, v->flag, v->opcode, v->id, v->size );
+
+	// A slot is never split
+	v->payload[0] = t_slot->payload;
+	v->length[0] = v->size;
+	v->payload[1] = NULL;
+	v->length[1] = 0;
+
+	v->complete = true;
+}
+
+/*
+ * Function: twiprotocol::tx_fragments
+ *    Input: uint8_t bytes is the packet's payload size.
+ *   Output: Number of fragments required to send the packet, at least one.
+ *
+ */
+uint8_t twiprotocol::tx_fragments( uint8_t bytes ) {
+	// uint8_t packets is not declared as float on propose, uint8_t bytes excludes header size.
+	uint8_t packets = (bytes / TWIP_FRAG_SIZE) +1;
+	if( bytes % TWIP_FRAG_SIZE == 0 ) { packets--; }
+	if( packets == 0 ) { packets++; } // For packets without payload
+	return packets;
+}
+
+/*
+ * Function: twiprotocol::tx_fragment
+ *    Input: uint8_t* packet is the TWI master buffer, packet's basic info (header), uint8_t bytes is the
+ *           whole packet's payload size and uint8_t index the fragment to build.
+ *   Output: No output.
+ *
+ * Description: Writes the regular header of a fragment in place, the caller copies the payload slice,
+ * packet[6] bytes long, at packet + TWIP_HEADER_SIZE then calls tx_seal(). Frames are not padded, the
+ * receiver only needs the bytes the header announces. TWIP_OP_PACKED packets are expanded inside a
+ * reassembly slot, a single fragment one is sent as the last fragment of a set. Reliable and bulk
+ * fragments always carry the CRC-16, the receiver's ack vouches for their payload; compact frames
+ * have their CRC-8 instead.
+ *
+ */
+void twiprotocol::tx_fragment( uint8_t* packet, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t index ) {
+	uint8_t packets = this->tx_fragments( bytes );
+	uint8_t t_this_pkt_len = bytes - index * TWIP_FRAG_SIZE;
+	if( t_this_pkt_len > TWIP_FRAG_SIZE ) { t_this_pkt_len = TWIP_FRAG_SIZE; }
+
+	// Populate packet's header with basic information
+	packet[0] = this->twi_address;
+	packet[1] = ( packets < 2 && opcode != TWIP_OP_PACKED ) ? TWIP_NOF : TWIP_SOF | TWIP_SEQ | (index << 4);
+	packet[2] = opcode;
+	packet[3] = id;
+	packet[6] = t_this_pkt_len;
+
+	// Last packet change flag's 2nd bit to 1 (AVR architecture is little endian)
+	if( packet[1] != TWIP_NOF && index == packets -1 ) { packet[1] |= TWIP_EOF; }
+	if( TWIP_PAYLOAD_CRC || (id & TWIP_ID_RELIABLE) || opcode == TWIP_OP_BULK ) { packet[1] |= TWIP_CRC; }
+}
+
+/*
+ * Function: twiprotocol::send
+ *    Input: Packet's basic info (header) and payload.
+ *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ *
+ * Description: Fragments the packet if required and send it over the TWI bus, look up flag
+ * meaning on the following table:
+ *
+ *	B00000000 - Packet not fragmented
+ *	B00000001 - Fragmented packet / first fragmented packet of a set
+ *	B00000011 - Last fragmented packet of a set
+ *
+ * This function blocks until the last fragment left the bus, packets of the same or of a higher
+ * priority queued by send_async() are sent first. Success means every fragment was acked on the bus,
+ * not that the receiver kept the packet, use send_reliable() for that. Once batch() was called small
+ * normal packets are only added to the receiver's batch, see twiprotocol::tx_batch_add().
+ *
+ */
+uint8_t twiprotocol::send( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload, uint8_t priority ) {
+	if( this->tx_batch_us && priority == TWIP_PRIO_NORMAL && opcode < TWIP_OP_RESERVED && bytes +2 <= TWIP_BATCH_SIZE ) {
+		return this->tx_batch_add( addr, opcode, bytes, payload );
+	}
+
+	// Packets queued by send_async() go first, a train in progress owns the bus anyway
+	this->flush( priority );
+
+	#if TWIP_FLOW_CONTROL
+	// Frames the receiver has no room for would only waste bus time
+	if( ! this->tx_credit_wait( addr, bytes, priority ) ) {
+		this->counters.tx_throttled++;
+		return false;
+	}
+	#endif
+
+	uint8_t ret = this->tx_packet( addr, opcode, this->pkt_id | ( priority ? TWIP_ID_URGENT : 0 ), bytes, payload, false, NULL );
+
+	// Every fragment of the same packet shares the id
+	this->pkt_id = ( this->pkt_id +1 ) & TWIP_ID_MASK;
+
+	if( ret == 0 ) {
+		this->counters.tx_packets++;
+		this->counters.tx_bytes += bytes;
+		this->tx_credit_take( addr, bytes, priority );
+	}
+
+	return ( ret == 0 );
+}
+
+/*
+ * Function: twiprotocol::send_reliable
+ *    Input: Packet's basic info (header) and payload.
+ *   Output: Boolean representing: 1 - The receiver has the packet, 0 - Failure.
+ *
+ * Description: Blocking send() with end-to-end acknowledgement. The packet gets an id with
+ * TWIP_ID_RELIABLE set and its last fragment is followed, with a repeated start so no other master gets
+ * in between, by a read of the receiver's [TWIP_OP_ACK, sender, id, status] reply. Only the fragments
+ * the receiver is missing are sent again, right away, and the whole packet after a backoff of
+ * TWIP_RETRY_US, doubled every time, when the receiver had no room or the exchange failed; at most
+ * TWIP_RETRIES times. Fragments the receiver already holds are ignored and a packet delivered twice is
+ * only queued once, so retries are harmless. A packet refused by a strict() receiver fails at once.
+ * Receivers running an older version of this library never ack.
+ *
+ */
+uint8_t twiprotocol::send_reliable( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload, uint8_t priority ) {
+	return ( this->tx_reliable( addr, opcode, bytes, payload, priority, true ) == TWIP_ACK_OK );
+}
+
+/*
+ * Function: twiprotocol::tx_reliable
+ *    Input: Packet's basic info (header), payload and uint8_t resend to send the packet again when the
+ *           receiver misses part of it.
+ *   Output: TWIP_ACK_* status of the last reply, TWIP_ACK_FULL when the retries ran out.
+ *
+ * Description: Retry loop of send_reliable(). A fragment lost on the bus doesn't stop the train, the
+ * reply then lists the fragments held and the next round only sends the other ones. Receivers running
+ * an older version don't list them and get the whole packet again. Without resend, as used by
+ * send_bulk(), a packet the receiver holds none of is missing for another reason: an earlier chunk of
+ * the window was lost and the window must be sent again. A first attempt can't be a duplicate: the
+ * receiver answering TWIP_ACK_SEEN remembers the id from before a reset of this node, or from 64
+ * packets ago when they went to other receivers in between, and the packet is sent again at once with
+ * the next id.
+ *
+ */
+uint8_t twiprotocol::tx_reliable( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload, uint8_t priority,
+		uint8_t resend ) {
+	this->flush( priority );
+
+	uint8_t t_id = this->rel_id | TWIP_ID_RELIABLE | ( priority ? TWIP_ID_URGENT : 0 );
+	this->rel_id = ( this->rel_id +1 ) & TWIP_ID_MASK;
+	uint32_t t_wait = TWIP_RETRY_US;
+	uint16_t t_pending = 0;
+	uint8_t t_sent = false;
+
+	for( uint8_t i = 0; i <= TWIP_RETRIES; i++ ) {
+		if( i ) { this->counters.tx_retransmits++; }
+
+		uint8_t t_reply[TWIP_ACK_SIZE];
+		uint8_t ret = this->tx_packet( addr, opcode, t_id, bytes, payload, true, &t_pending );
+		uint8_t t_again = t_sent;
+		t_sent = true;
+
+		// Unless the receiver is gone, its reply tells what it got of the fragments which went through
+		if( ret != 2 && this->tx_reply( addr, t_reply ) && t_reply[1] == this->twi_address && t_reply[2] == t_id ) {
+			uint16_t t_held = (t_reply[8] << 8) + t_reply[9];
+
+			// The credits already account for this packet
+			memcpy( this->tx_credit_peer( addr ) +1, t_reply +4, 4 );
+
+			if( t_reply[3] == TWIP_ACK_OK || ( t_reply[3] == TWIP_ACK_SEEN && t_again ) ) {
+				this->counters.tx_packets++;
+				this->counters.tx_bytes += bytes;
+				return TWIP_ACK_OK;
+			}
+
+			// The receiver took it for a packet of the same id it queued before
+			if( t_reply[3] == TWIP_ACK_SEEN ) {
+				t_id = ( t_id & ~TWIP_ID_MASK ) | this->rel_id;
+				this->rel_id = ( this->rel_id +1 ) & TWIP_ID_MASK;
+				t_pending = 0;
+				t_sent = false;
+				continue;
+			}
+
+			// Fragments were lost on the way, the receiver keeps the others, none held means all
+			if( t_reply[3] == TWIP_ACK_MISSING ) {
+				t_pending = ~t_held;
+				if( resend || t_held ) { continue; }
+				return TWIP_ACK_MISSING;
+			}
+
+			// The receiver dropped whatever it had
+			t_pending = 0;
+
+			// Sending it again won't change the receiver's mind
+			if( t_reply[3] == TWIP_ACK_REFUSED ) { return TWIP_ACK_REFUSED; }
+		}
+
+		delayMicroseconds( t_wait );
+		t_wait <<= 1;
+	}
+
+	return TWIP_ACK_FULL;
+}
+
+/*
+ * Function: twiprotocol::send_bulk
+ *    Input: uint8_t addr is the TWI address of the receiver, uint8_t opcode is handed to its sink along
+ *           with the bytes, uint16_t bytes is the size of the transfer, twipsource source fills every
+ *           chunk.
+ *   Output: Boolean representing: 1 - The receiver's sink has, or will get, every byte, 0 - Failure.
+ *
+ * Description: Blocking transfer of up to 65535 bytes the sketch never has to hold at once. source is
+ * asked for length bytes at offset, as many times as a chunk is sent, and returns false to abort. The
+ * chunks of a window are sent by send(), the last one by send_reliable() without its resend: when the
+ * receiver missed a chunk, or had no room for it, the window is sent again from the last offset it
+ * confirmed, at most TWIP_RETRIES times in a row. Chunks are never compressed and the receiver's filters,
+ * but the sender's one, don't apply: its sink accepts the transfer or aborts it, see sink().
+ *
+ */
+uint8_t twiprotocol::send_bulk( uint8_t addr, uint8_t opcode, uint16_t bytes, twipsource source ) {
+	uint8_t t_chunk[TWIP_BULK_HEADER + TWIP_BULK_CHUNK];
+	uint8_t t_rewinds = 0;
+	uint16_t t_acked = 0;
+	uint16_t t_next = 0;
+
+	t_chunk[0] = opcode;
+	t_chunk[1] = this->tx_bulk_tag++;
+	t_chunk[2] = bytes >> 8;
+	t_chunk[3] = bytes & 0xFF;
+
+	do {
+		uint8_t t_length = ( bytes - t_next > TWIP_BULK_CHUNK ) ? TWIP_BULK_CHUNK : bytes - t_next;
+		t_chunk[4] = t_next >> 8;
+		t_chunk[5] = t_next & 0xFF;
+
+		if( t_length && ! source( t_next, t_chunk + TWIP_BULK_HEADER, t_length ) ) { return false; }
+		t_next += t_length;
+
+		// Window still open, the receiver confirms the chunk closing it
+		if( t_next < bytes && t_next - t_acked < (uint16_t) TWIP_BULK_WINDOW * TWIP_BULK_CHUNK
+			&& this->send( addr, TWIP_OP_BULK, TWIP_BULK_HEADER + t_length, t_chunk ) ) { continue; }
+
+		switch( this->tx_reliable( addr, TWIP_OP_BULK, TWIP_BULK_HEADER + t_length, t_chunk, TWIP_PRIO_NORMAL, false ) ) {
+			case TWIP_ACK_OK:
+				t_acked = t_next;
+				t_rewinds = 0;
+				break;
+
+			case TWIP_ACK_MISSING:
+				if( t_rewinds++ == TWIP_RETRIES ) { return false; }
+				this->counters.tx_bulk_rewinds++;
+				t_next = t_acked;
+				break;
+
+			default:
+				return false;
+		}
+	} while( t_acked < bytes );
+
+	return true;
+}
+
+/*
+ * Function: twiprotocol::sink
+ *    Input: twipsink function gets the bytes of every bulk transfer received, NULL refuses them.
+ *   Output: No output.
+ *
+ * Description: The sink is run from loop(), by dispatch(), available(), receive() and view(), with the
+ * chunks of each transfer in order and without gaps, from offset 0 to total. It returns false to abort
+ * the transfer, which then fails on the sender. Bulk chunks take room on rx_buffer and a reassembly
+ * slot until the sink gets them, the sender waits for it when the window is full.
+ *
+ */
+void twiprotocol::sink( twipsink function ) {
+	#ifdef ARDUINO
+	uint8_t t_sreg = SREG;
+	cli();
+	#endif
+	this->rx_sink = function;
+	#ifdef ARDUINO
+	SREG = t_sreg;
+	#endif
+}
+
+/*
+ * Function: twiprotocol::tx_credit_find
+ *    Input: uint8_t addr is the TWI address of the receiver.
+ *   Output: Pointer to its credit entry, NULL when it has none.
+ *
+ * Description: Only looks the credits up, the interrupt calls it.
+ *
+ */
+uint8_t* twiprotocol::tx_credit_find( uint8_t addr ) {
+	for( uint8_t i = 0; i < TWIP_CREDIT_PEERS; i++ ) {
+		if( this->tx_credit[i][0] == addr ) { return this->tx_credit[i]; }
+	}
+	return NULL;
+}
+
+/*
+ * Function: twiprotocol::tx_credit_peer
+ *    Input: uint8_t addr is the TWI address of the receiver.
+ *   Output: Pointer to its [address, free slots, free normal bytes, free urgent bytes, formats] entry.
+ *
+ * Description: Unknown peers take the entry of the oldest one with no credits, so they get read.
+ *
+ */
+uint8_t* twiprotocol::tx_credit_peer( uint8_t addr ) {
+	uint8_t* t_peer = this->tx_credit_find( addr );
+	if( t_peer ) { return t_peer; }
+
+	t_peer = this->tx_credit[this->tx_credit_next];
+	this->tx_credit_next = ( this->tx_credit_next +1 ) % TWIP_CREDIT_PEERS;
+	memset( t_peer, 0, 5 );
+	t_peer[0] = addr;
+	return t_peer;
+}
+
+/*
+ * Function: twiprotocol::tx_reply
+ *    Input: uint8_t addr is the TWI address of the receiver, uint8_t* reply room for TWIP_ACK_SIZE bytes.
+ *   Output: Boolean representing: 1 - reply holds a TWIP_OP_ACK reply, 0 - The receiver didn't send one.
+ *
+ * Description: Reads the receiver's reply. Receivers running an older version send seven or eight
+ * bytes, the missing formats byte reads as 0 and the fragments held as none (on the AVR the master gets
+ * 0xFF once the slave has nothing left).
+ *
+ */
+uint8_t twiprotocol::tx_reply( uint8_t addr, uint8_t* reply ) {
+	uint8_t t_read = twi_readFrom( addr, reply, TWIP_ACK_SIZE, true );
+
+	if( t_read < 7 || reply[0] != TWIP_OP_ACK ) { return false; }
+	if( t_read < 8 || reply[7] == 0xFF ) { reply[7] = 0; }
+	if( t_read < TWIP_ACK_SIZE || ! (reply[7] & TWIP_FORMAT_SACK) ) { reply[8] = reply[9] = 0; }
+	return true;
+}
+
+/*
+ * Function: twiprotocol::tx_format
+ *    Input: uint8_t addr is the TWI address of the receiver.
+ *   Output: TWIP_FORMAT_* bits to send it, 0 for regular headers and plain payloads.
+ *
+ * Description: Only looks the credits up, the interrupt calls it.
+ *
+ */
+uint8_t twiprotocol::tx_format( uint8_t addr ) {
+	uint8_t t_formats = 0;
+
+	// The CRC-16 is the stronger check
+	if( this->tx_compact && ! TWIP_PAYLOAD_CRC ) { t_formats |= TWIP_FORMAT_COMPACT; }
+	if( this->tx_packing ) { t_formats |= TWIP_FORMAT_PACKED; }
+	if( ! t_formats ) { return 0; }
+
+	uint8_t* t_peer = this->tx_credit_find( addr );
+	return t_peer ? ( t_peer[4] & t_formats ) : 0;
+}
+
+/*
+ * Function: twiprotocol::tx_credit_fits
+ *    Input: uint8_t* peer is a credit entry, uint8_t bytes the payload size and priority the class
+ *           of the packet.
+ *   Output: Boolean representing: 1 - The peer has room for the packet, 0 - It would be dropped.
+ *
+ * Description: A single fragment packet is stored on the rx_buffer of its class with its header and
+ * accounting byte, a fragmented one needs a free slot and the two bytes record pointing to it.
+ *
+ */
+uint8_t twiprotocol::tx_credit_fits( uint8_t* peer, uint8_t bytes, uint8_t priority ) {
+	uint8_t t_free = peer[2 + ( priority ? 1 : 0 )];
+
+	if( bytes <= TWIP_FRAG_SIZE ) { return ( t_free >= TWIP_HEADER_SIZE + bytes +1 ); }
+	return ( t_free >= 2 && peer[1] );
+}
+
+/*
+ * Function: twiprotocol::tx_credit_wait
+ *    Input: uint8_t addr is the TWI address of the receiver, uint8_t bytes the payload size and
+ *           priority the class of the packet.
+ *   Output: Boolean representing: 1 - Send the packet, 0 - The receiver has no room for it.
+ *
+ * Description: Reads the receiver's credits when the ones left from the last read are not enough,
+ * then every TWIP_RETRY_US, doubled every time, until TWIP_CREDIT_WAIT_US elapsed. A receiver which
+ * doesn't answer with a TWIP_OP_ACK reply, absent from the bus, is sent to anyway. Nodes running the
+ * original library must not be read at all, see TWIP_FLOW_CONTROL.
+ *
+ */
+uint8_t twiprotocol::tx_credit_wait( uint8_t addr, uint8_t bytes, uint8_t priority ) {
+	uint8_t* t_peer = this->tx_credit_peer( addr );
+	uint32_t t_start = micros();
+	uint32_t t_wait = TWIP_RETRY_US;
+
+	while( ! this->tx_credit_fits( t_peer, bytes, priority ) ) {
+		uint8_t t_reply[TWIP_ACK_SIZE];
+
+		this->counters.tx_credit_reads++;
+		if( ! this->tx_reply( addr, t_reply ) ) {
+			// Read again only after a few packets
+			memset( t_peer +1, 0xFF, 3 );
+			return true;
+		}
+
+		memcpy( t_peer +1, t_reply +4, 4 );
+		if( this->tx_credit_fits( t_peer, bytes, priority ) ) { break; }
+
+		if( micros() - t_start >= TWIP_CREDIT_WAIT_US ) { return false; }
+
+		delayMicroseconds( t_wait );
+		t_wait <<= 1;
+	}
+
+	return true;
+}
+
+/*
+ * Function: twiprotocol::tx_credit_hold
+ *    Input: No input.
+ *   Output: Boolean representing: 1 - Hold the train, 0 - Start it.
+ *
+ * Description: Called by poll() while nothing is on the bus. When the receiver of the next queued
+ * packet has no room for it as far as known, reads its credits again, then every TWIP_RETRY_US from
+ * poll(). A packet held for TWIP_CREDIT_WAIT_US is dropped, counted as tx_throttled and handed to
+ * onsent() with TWIP_SENT_THROTTLED, like send() refuses it. Receivers which don't answer with a
+ * TWIP_OP_ACK reply are sent to anyway, as in tx_credit_wait().
+ *
+ */
+uint8_t twiprotocol::tx_credit_hold( void ) {
+	uint8_t t_record[4];
+	uint8_t t_class = this->tx_upcoming( t_record, false );
+
+	// A packet already started was taken off the credits, tx_batch_add() took every packet of a batch
+	if( ! t_class || t_record[1] == TWIP_OP_BATCH ) { this->tx_holding = false; return false; }
+
+	uint8_t* t_peer = this->tx_credit_peer( t_record[0] );
+	if( this->tx_credit_fits( t_peer, t_record[3], t_record[2] & TWIP_ID_URGENT ) ) { this->tx_holding = false; return false; }
+
+	uint8_t t_reply[TWIP_ACK_SIZE];
+	this->counters.tx_credit_reads++;
+	if( ! this->tx_reply( t_record[0], t_reply ) ) {
+		memset( t_peer +1, 0xFF, 3 );
+		this->tx_holding = false;
+		return false;
+	}
+
+	memcpy( t_peer +1, t_reply +4, 4 );
+	if( this->tx_credit_fits( t_peer, t_record[3], t_record[2] & TWIP_ID_URGENT ) ) { this->tx_holding = false; return false; }
+
+	if( ! this->tx_holding ) {
+		this->tx_holding = true;
+		this->tx_held = micros();
+	}
+	else if( micros() - this->tx_held >= TWIP_CREDIT_WAIT_US ) {
+		// The next packet gets a wait of its own
+		this->tx_buffer[t_class -1].skip( sizeof(t_record) + t_record[3] );
+		this->tx_holding = false;
+		this->counters.tx_throttled++;
+		if( this->tx_callback ) { this->tx_callback( t_record[0], t_record[1], TWIP_SENT_THROTTLED ); }
+	}
+
+	this->tx_hold = micros();
+	this->tx_backoff = this->tx_holding ? TWIP_RETRY_US : 0;
+	return true;
+}
+
+/*
+ * Function: twiprotocol::tx_credit_take
+ *    Input: uint8_t addr is the TWI address of the receiver, uint8_t bytes the payload size and
+ *           priority the class of the packet.
+ *   Output: No output.
+ *
+ * Description: Takes a packet just sent off the peer's credits, the receiver draining its buffer only
+ * gives them back on the next read. The interrupt calls it, a peer without an entry is left alone
+ * rather than evicting another one.
+ *
+ */
+void twiprotocol::tx_credit_take( uint8_t addr, uint8_t bytes, uint8_t priority ) {
+	uint8_t* t_peer = this->tx_credit_find( addr );
+	if( ! t_peer ) { return; }
+
+	uint8_t* t_free = &t_peer[2 + ( priority ? 1 : 0 )];
+	uint8_t t_used = 2;
+
+	if( bytes <= TWIP_FRAG_SIZE ) { t_used = TWIP_HEADER_SIZE + bytes +1; }
+	else if( t_peer[1] ) { t_peer[1]--; }
+
+	*t_free = ( *t_free > t_used ) ? *t_free - t_used : 0;
+}
+
+/*
+ * Function: twiprotocol::tx_batch_add
+ *    Input: Packet's basic info (header) and payload, the packet fits in a batch.
+ *   Output: Boolean representing: 1 - Packet batched, 0 - The receiver has no room for it.
+ *
+ * Description: Appends the packet to the batch of its receiver as an [opcode, length, payload] record
+ * and returns without touching the bus. A receiver without a batch takes a free entry or the one of
+ * the oldest batch, which is sent first. A batch is queued on tx_buffer as a single TWIP_OP_BATCH
+ * frame once no other packet fits, by poll() once the batch() deadline elapsed or by flush(), and
+ * all its packets share its id. With flow control every packet is taken off the receiver's credits,
+ * the batch is sent before the credits are read again.
+ *
+ */
+uint8_t twiprotocol::tx_batch_add( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload ) {
+	twipbatch* t_batch = NULL;
+
+	for( uint8_t i = 0; i < TWIP_BATCH_PEERS; i++ ) {
+		twipbatch* b = &this->tx_batch[i];
+		if( b->count && b->addr == addr ) { t_batch = b; break; }
+		if( t_batch == NULL || ( t_batch->count && ( ! b->count || (int32_t) (b->since - t_batch->since) < 0 ) ) ) { t_batch = b; }
+	}
+	if( t_batch->count && ( t_batch->addr != addr || t_batch->used + 2 + bytes > TWIP_BATCH_SIZE ) ) {
+		this->tx_batch_send( t_batch );
+	}
+
+	#if TWIP_FLOW_CONTROL
+	if( ! this->tx_credit_fits( this->tx_credit_peer( addr ), bytes, TWIP_PRIO_NORMAL ) ) {
+		// The receiver only counts what reached it
+		this->flush( TWIP_PRIO_NORMAL );
+		if( ! this->tx_credit_wait( addr, bytes, TWIP_PRIO_NORMAL ) ) {
+			this->counters.tx_throttled++;
+			return false;
+		}
+	}
+	#endif
+
+	if( t_batch->count == 0 ) {
+		t_batch->addr = addr;
+		t_batch->id = this->pkt_id;
+		t_batch->used = 0;
+		t_batch->since = micros();
+		this->pkt_id = ( this->pkt_id +1 ) & TWIP_ID_MASK;
+	}
+
+	t_batch->data[t_batch->used++] = opcode;
+	t_batch->data[t_batch->used++] = bytes;
+	if( bytes ) { memcpy( t_batch->data + t_batch->used, payload, bytes ); }
+	t_batch->used += bytes;
+	t_batch->count++;
+
+	this->counters.tx_batched++;
+	this->tx_credit_take( addr, bytes, TWIP_PRIO_NORMAL );
+
+	// Not even an empty packet fits anymore
+	if( t_batch->used +2 > TWIP_BATCH_SIZE ) { this->tx_batch_send( t_batch ); }
+
+	// Starts the batches already queued, sends the expired ones
+	this->poll();
+	return true;
+}
+
+/*
+ * Function: twiprotocol::tx_batch_send
+ *    Input: twipbatch* batch holding at least one packet.
+ *   Output: No output.
+ *
+ * Description: Queues the batch on the normal tx_buffer as a single packet, waiting for room when
+ * needed, and frees its entry.
+ *
+ */
+void twiprotocol::tx_batch_send( twipbatch* batch ) {
+	twip_tx_buffer_t* t_queue = &this->tx_buffer[0];
+
+	// Freed first, poll() sends the expired batches
+	batch->count = 0;
+	while( (uint16_t) batch->used + 4 > t_queue->available() ) {
+		this->poll();
+		delayMicroseconds( TWIP_FRAME_US );
+	}
+
+	t_queue->write( batch->addr );
+	t_queue->write( TWIP_OP_BATCH );
+	t_queue->write( batch->id );
+	t_queue->write( batch->used );
+	t_queue->write( batch->data, batch->used );
+	t_queue->commit();
+}
+
+/*
+ * Function: twiprotocol::tx_batch_flush
+ *    Input: uint8_t expired only sends the batches older than the batch() deadline.
+ *   Output: No output.
+ *
+ */
+void twiprotocol::tx_batch_flush( uint8_t expired ) {
+	for( uint8_t i = 0; i < TWIP_BATCH_PEERS; i++ ) {
+		twipbatch* b = &this->tx_batch[i];
+		if( b->count && ( ! expired || micros() - b->since >= this->tx_batch_us ) ) { this->tx_batch_send( b ); }
+	}
+}
+
+/*
+ * Function: twiprotocol::batch
+ *    Input: uint32_t us is the longest time a packet waits for others in its batch, 0 stops batching.
+ *   Output: No output.
+ *
+ * Description: Turns batching on for send(). Normal packets of at most TWIP_BATCH_SIZE -2 bytes sent to
+ * one of TWIP_BATCH_PEERS receivers share a single TWIP_OP_BATCH frame, paying a two bytes record
+ * instead of a START, an address, a header, padding and a STOP each; receivers split them back into
+ * packets of their own. send() then returns as soon as the packet is batched, like send_async(), and
+ * loop() must call poll() for the deadline to be kept. Only batch to receivers running this version.
+ *
+ */
+void twiprotocol::batch( uint32_t us ) {
+	if( us == 0 ) { this->flush( TWIP_PRIO_NORMAL ); }
+	this->tx_batch_us = us;
+}
+
+/*
+ * Function: twiprotocol::compact
+ *    Input: uint8_t enable sends compact headers to the receivers which read them.
+ *   Output: No output.
+ *
+ * Description: Defaults to TWIP_COMPACT_HEADER. A node which doesn't send compact headers doesn't
+ * advertise them either, frames received compact are read all the same.
+ *
+ */
+void twiprotocol::compact( uint8_t enable ) { this->tx_compact = enable; }
+
+/*
+ * Function: twiprotocol::compress
+ *    Input: uint8_t enable compresses the packets sent to the receivers which expand them.
+ *   Output: No output.
+ *
+ * Description: Defaults to TWIP_COMPRESS. Only packets spanning more than one fragment sent by send()
+ * or send_reliable() are compressed, send_async() queues them as they are. Every node expands packed
+ * packets, which only reach handlers from loop() since they are expanded there, filters and strict()
+ * apply to their opcode once expanded.
+ *
+ */
+void twiprotocol::compress( uint8_t enable ) { this->tx_packing = enable; }
+
+/*
+ * Function: twiprotocol::window
+ *    Input: uint8_t fragments is the number of fragments send_reliable() sends before reading the
+ *           receiver's reply, 0 for all of them.
+ *   Output: No output.
+ *
+ * Description: Defaults to TWIP_WINDOW. Every read costs a TWIP_ACK_SIZE bytes read and a new start,
+ * in exchange the sender stops as soon as the receiver has no room for the packet, instead of sending
+ * the rest of the train in vain, and sends again within the train the fragments the receiver dropped.
+ * Fragments lost on the bus are known without a read.
+ *
+ */
+void twiprotocol::window( uint8_t fragments ) { this->tx_window = fragments; }
+
+/*
+ * Function: twiprotocol::tx_packet
+ *    Input: Packet's basic info (header), payload, uint8_t keep to hold the bus after the last fragment
+ *           and uint16_t* pending the fragments to send, 0 for all of them, NULL for send().
+ *   Output: twi_writeTo() return code of the last fragment written.
+ *
+ * Description: Fragment loop shared by send() and send_reliable(). Without pending it stops at the
+ * first fragment lost. With pending it only stops when the receiver is gone or has no room, every
+ * tx_window fragments it reads the receiver's reply to know, and leaves in *pending the fragments
+ * which didn't go through. Fragments the reply doesn't list as held are sent again before the train
+ * ends, once per call so a receiver dropping them all can't keep the sender going.
+ *
+ */
+uint8_t twiprotocol::tx_packet( uint8_t addr, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t* payload, uint8_t keep,
+	uint16_t* pending ) {
+	// Finds out the number of twip packets required to send payload.
+	uint8_t packets = this->tx_fragments( bytes );
+	uint8_t ret = 0;
+	uint8_t t_format = this->tx_format( addr );
+	uint32_t t_hold = micros();
+
+	// The compressed packet is sent instead when it is smaller
+	if( (t_format & TWIP_FORMAT_PACKED) && packets > 1 && opcode < TWIP_OP_RESERVED &&
+		this->tx_compress( addr, opcode, id, bytes, payload, keep, pending, &ret ) ) { return ret; }
+
+	uint16_t t_all = ( packets < 16 ) ? ( 1 << packets ) -1 : 0xFFFF;
+	uint16_t t_left = pending ? ( *pending & t_all ) : 0;
+	uint16_t t_lost = 0;
+	uint16_t t_sent = 0;
+	uint16_t t_again = 0;
+	uint8_t t_flight = 0;
+	uint8_t t_retry = ( t_left != 0 );
+
+	// A retry only sends what the receiver is missing
+	if( ! t_retry ) { t_left = t_all; }
+
+	// Fragments sent again within the train are behind i, the loop wraps around to them
+	for( uint8_t i = 0; t_left; i = ( i +1 < packets ) ? i +1 : 0 ) {
+		if( ! (t_left & (1 << i)) ) { continue; }
+		t_left &= ~(1 << i);
+		if( t_retry || (t_again & (1 << i)) ) { this->counters.tx_resent++; }
+
+		// The packet is built in place inside the TWI master buffer, no heap allocation is required
+		// and every payload byte is copied only once.
+		uint8_t* packet = twi_getMasterBuffer();
+		this->tx_fragment( packet, opcode, id, bytes, i );
+
+		// Copy the payload slice into packet, payload is NULL for packets without one
+		if( packet[6] ) { memcpy( packet + TWIP_HEADER_SIZE, payload + i * TWIP_FRAG_SIZE, packet[6] ); }
+		uint8_t t_this_pkt_len = this->tx_seal( packet, t_format & TWIP_FORMAT_COMPACT );
+
+		// Keep the bus with a repeated start unless this is the last fragment or the next one would
+		// hold it longer than TWIP_MAX_HOLD_US, other masters can't interleave in the middle of a train
+		// and every fragment but the first skips the TWI_BUS_CHECK idle wait. With keep the last
+		// fragment never ends with a STOP.
+		uint8_t t_stop = ( t_left == 0 ) ? ! keep : ( micros() - t_hold + 2 * TWIP_FRAME_US > TWIP_MAX_HOLD_US );
+
+		// Send the packet over the TWI bus and report return value
+		ret = twi_writeMasterBuffer( addr, t_this_pkt_len, true, t_stop );
+		if( t_stop ) { t_hold = micros(); }
+		this->tx_account( ret );
+
+		#ifdef __INFO2____
+		switch( ret ) {
+			case 0: Serial.print( "tx: " ); Serial.println( t_this_pkt_len ); break;
+			case 1: Serial.println( "Length too long for buffer" ); break;
+			case 2: Serial.println( "Address send, NACK received" ); break;
+			case 3: Serial.println( "Data send, NACK received" ); break;
+			case 5: Serial.println( "Bus busy, timeout" ); break;
+			default: Serial.println( "Other TWI error" ); break;
+		}
+		#endif
+
+		#ifdef __INFO5____
+		Serial.print( "tx: " );
+		for( uint8_t j = 0; j < TWIP_HEADER_SIZE + packet[6]; j++ ) {
+			Serial.print( "0x" );
+			Serial.print( packet[j], HEX );
+			Serial.print( " " );
+		} Serial.println();
+		#endif
+
+		// Once a fragment is lost the set can't be completed, don't waste the bus with the rest of it
+		if( ret != 0 && pending == NULL ) { break; }
+
+		// A data NACK only loses this fragment, the retry sends it
+		if( ret != 0 ) {
+			t_lost |= 1 << i;
+			if( ret != 3 ) { break; }
+			continue;
+		}
+		t_sent |= 1 << i;
+
+		// The receiver has no room for the rest of the packet or won't take it, or dropped some of it
+		if( this->tx_window && t_left && ++t_flight >= this->tx_window ) {
+			uint8_t t_reply[TWIP_ACK_SIZE];
+
+			t_flight = 0;
+			this->counters.tx_window_reads++;
+			if( this->tx_reply( addr, t_reply ) && t_reply[1] == this->twi_address && t_reply[2] == id ) {
+				if( t_reply[3] == TWIP_ACK_FULL || t_reply[3] == TWIP_ACK_REFUSED || t_reply[3] == TWIP_ACK_SEEN ) { break; }
+
+				// None held means the receiver dropped the set, everything sent is missing
+				if( t_reply[3] == TWIP_ACK_MISSING && (t_reply[7] & TWIP_FORMAT_SACK) ) {
+					uint16_t t_missing = t_sent & ~( (t_reply[8] << 8) + t_reply[9] ) & ~t_again;
+					t_sent &= ~t_missing;
+					t_again |= t_missing;
+					t_left |= t_missing;
+				}
+			}
+			t_hold = micros();
+		}
+	}
+
+	if( pending ) { *pending = t_lost | t_left; }
+	return ret;
+}
+
+/*
+ * Function: twiprotocol::tx_compress
+ *    Input: Same as twiprotocol::tx_packet(), uint8_t* ret receives its return code.
+ *   Output: Boolean representing: 1 - The packet was sent compressed, 0 - Nothing was sent.
+ *
+ * Description: Compresses the payload into a free reassembly slot, taken from rx_add() while the packet
+ * is sent, and sends it as a TWIP_OP_PACKED packet carrying [opcode, bytes, stream], with the id of the
+ * original one. Nothing is sent when no slot is free, when the stream doesn't save at least a byte or
+ * when the receiver couldn't expand it in place within a reassembly slot as large as ours. The stream
+ * costs the CPU a single pass over the payload, lz8_pack() keeps no state.
+ *
+ */
+uint8_t twiprotocol::tx_compress( uint8_t addr, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t* payload, uint8_t keep,
+	uint16_t* pending, uint8_t* ret ) {
+	twipslot* t_slot = NULL;
+	uint16_t t_need;
+
+	// The interrupt may be opening a set on the same slot
+	#ifdef ARDUINO
+	uint8_t t_sreg = SREG;
+	cli();
+	#endif
+	for( uint8_t i = 0; i < TWIP_REASM_SLOTS && t_slot == NULL; i++ ) {
+		if( this->rx_slots[i].state == TWIP_SLOT_FREE ) {
+			t_slot = &this->rx_slots[i];
+			t_slot->state = TWIP_SLOT_PACKING;
+		}
+	}
+	#ifdef ARDUINO
+	SREG = t_sreg;
+	#endif
+	if( t_slot == NULL ) { return false; }
+
+	uint8_t* t_packed = t_slot->payload;
+	uint16_t t_room = sizeof(t_slot->payload) -2;
+	uint8_t t_size = lz8_pack( payload, bytes, t_packed +2, ( bytes -3 < t_room ) ? bytes -3 : t_room, &t_need );
+
+	uint8_t t_smaller = ( t_size && t_need <= TWIP_REASM_SIZE + LZ8_MARGIN );
+
+	if( t_smaller ) {
+		t_packed[0] = opcode;
+		t_packed[1] = bytes;
+		*ret = this->tx_packet( addr, TWIP_OP_PACKED, id, t_size +2, t_packed, keep, pending );
+		if( *ret == 0 ) { this->counters.tx_packed++; }
+	}
+
+	cb_publish<uint8_t>( &t_slot->state, TWIP_SLOT_FREE );
+	return t_smaller;
+}
+
+/*
+ * Function: twiprotocol::send_async
+ *    Input: Packet's basic info (header) and payload.
+ *   Output: Boolean representing: 1 - Packet queued, 0 - Not enough room on tx_buffer.
+ *
+ * Description: Non blocking version of twiprotocol::send(), the packet is copied to the tx_buffer of
+ * its class as a [addr, opcode, id, bytes, payload] record and this function returns as soon as its
+ * transfer was started. The TWI interrupt chains the fragments while the bus is held with repeated
+ * starts, hands every packet's outcome to the onsent() callback and the next train is started by
+ * poll(). Packets larger than TWIP_TX_BUFFER_SIZE -5 bytes never fit, send() them instead. Normal
+ * packets batched by send() are queued before. With TWIP_FLOW_CONTROL a train only goes on while the
+ * credits known of the next receiver have room for its packet, see tx_credit_hold().
+ *
+ */
+uint8_t twiprotocol::send_async( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload, uint8_t priority ) {
+	// Packets batched before go first
+	if( priority == TWIP_PRIO_NORMAL ) { this->tx_batch_flush( false ); }
+
+	twip_tx_buffer_t* t_queue = &this->tx_buffer[( priority && TWIP_PRIORITIES > 1 ) ? 1 : 0];
+	if( (uint16_t) bytes + 4 > t_queue->available() ) { this->counters.tx_queue_full++; return false; }
+
+	t_queue->write( addr );
+	t_queue->write( opcode );
+	t_queue->write( this->pkt_id | ( priority ? TWIP_ID_URGENT : 0 ) );
+	this->pkt_id = ( this->pkt_id +1 ) & TWIP_ID_MASK;
+	t_queue->write( bytes );
+	if( bytes ) { t_queue->write( payload, bytes ); }
+	t_queue->commit();
+
+	this->poll();
+	return true;
+}
+
+/*
+ * Function: twiprotocol::poll
+ *    Input: No input.
+ *   Output: Boolean representing: 1 - Packets are still queued, 0 - tx_buffer is empty.
+ *
+ * Description: Starts sending the oldest queued packet when no train is in progress. The interrupt
+ * only chains fragments while it still owns the bus, a train which ended with a STOP (last queued
+ * packet, TWIP_MAX_HOLD_US, an error or a lost arbitration once its backoff elapsed) is resumed from
+ * here, call it from loop(). Batches older than their deadline are queued from here as well.
+ *
+ */
+uint8_t twiprotocol::poll( void ) {
+	uint8_t t_start = false;
+
+	if( this->tx_batch_us ) { this->tx_batch_flush( true ); }
+
+	#if TWIP_FLOW_CONTROL
+	// Only poll() starts a train, nothing is on the bus while tx_busy is clear
+	if( ! this->tx_busy && this->tx_pending( TWIP_PRIO_NORMAL ) && micros() - this->tx_hold >= this->tx_backoff &&
+		this->tx_credit_hold() ) { return true; }
+	#endif
+
+	#ifdef ARDUINO
+	uint8_t t_sreg = SREG;
+	cli();
+	#endif
+	if( ! this->tx_busy && this->tx_pending( TWIP_PRIO_NORMAL ) && micros() - this->tx_hold >= this->tx_backoff ) {
+		this->tx_busy = true;
+		t_start = true;
+	}
+	#ifdef ARDUINO
+	SREG = t_sreg;
+	#endif
+
+	if( t_start ) {
+		this->tx_hold = micros();
+		this->tx_backoff = 0;
+		this->tx_next();
+	}
+
+	return this->tx_pending( TWIP_PRIO_NORMAL );
+}
+
+/*
+ * Function: twiprotocol::flush
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Blocks until every packet queued by send_async() with at least the given priority was
+ * sent and the bus is released, flushing normal packets sends the pending batches as well. A train of
+ * lower priority packets in progress is not interrupted, it ends within TWIP_MAX_HOLD_US. Gives up when
+ * the interrupt doesn't report a fragment within TWI_BUS_TIMEOUT_US, the packet it lost track of is
+ * then dropped, counted as tx_errors and handed to onsent() with status 5 like a bus timeout, so that
+ * poll() can start the next one.
+ *
+ */
+void twiprotocol::flush( uint8_t priority ) {
+	if( priority == TWIP_PRIO_NORMAL ) { this->tx_batch_flush( false ); }
+
+	uint32_t t_busy = micros();
+	while( this->tx_pending( priority ) || this->tx_busy ) {
+		// A train ends within TWIP_MAX_HOLD_US, the interrupt lost track of this one
+		if( ! this->tx_busy ) { t_busy = micros(); }
+		else if( micros() - t_busy >= TWI_BUS_TIMEOUT_US ) {
+			#ifdef ARDUINO
+			uint8_t t_sreg = SREG;
+			cli();
+			#endif
+			if( this->tx_busy ) { this->tx_done( 5 ); }
+			#ifdef ARDUINO
+			SREG = t_sreg;
+			#endif
+			return;
+		}
+
+		if( this->tx_pending( priority ) ) { this->poll(); }
+		delayMicroseconds( TWIP_FRAME_US );
+	}
+}
+
+/*
+ * Function: twiprotocol::tx_pending
+ *    Input: uint8_t priority is the lowest class to look at.
+ *   Output: Boolean representing: 1 - Packets of that class or above are queued, 0 - None.
+ *
+ */
+uint8_t twiprotocol::tx_pending( uint8_t priority ) {
+	for( uint8_t i = ( priority && TWIP_PRIORITIES > 1 ) ? 1 : 0; i < TWIP_PRIORITIES; i++ ) {
+		if( ! this->tx_buffer[i].empty() ) { return true; }
+	}
+	return false;
+}
+
+/*
+ * Function: twiprotocol::onsent
+ *    Input: Function called with the destination address, opcode and twi_writeTo() return code (0 on
+ *           success), or TWIP_SENT_THROTTLED, of every packet sent by send_async(), NULL to detach it.
+ *   Output: No output.
+ *
+ * Description: The callback runs from the TWI interrupt, the same rules as twip_onreceive() apply.
+ *
+ */
+void twiprotocol::onsent( void (*function)(uint8_t, uint8_t, uint8_t) ) { this->tx_callback = function; }
+
+/*
+ * Function: twiprotocol::stats
+ *    Input: twipstats* s receives a snapshot of the node's counters,
+ *           uint8_t reset clears the counters once copied.
+ *   Output: No output.
+ *
+ * Description: The counters are updated from the TWI interrupt, interrupts are disabled while they
+ * are copied so the snapshot is consistent. Any other node can read them remotely by sending a
+ * TWIP_OP_STATS packet without payload.
+ *
+ */
+void twiprotocol::stats( twipstats* s, uint8_t reset ) {
+	#ifdef ARDUINO
+	uint8_t t_sreg = SREG;
+	cli();
+	#endif
+	memcpy( s, &this->counters, sizeof(twipstats) );
+	if( reset ) { memset( &this->counters, 0, sizeof(twipstats) ); }
+	#ifdef ARDUINO
+	SREG = t_sreg;
+	#endif
+}
+
+/*
+ * Function: twiprotocol::tx_seal
+ *    Input: uint8_t* packet is a fragment built by tx_fragment() with its payload in place, uint8_t
+ *           compact turns it into a compact frame.
+ *   Output: Number of bytes to send.
+ *
+ * Description: Checksum is the last thing to be calculated, it may cover the payload. A compact frame
+ * swaps the checksum for the length, the payload moves a byte down and a CRC-8 of the whole frame
+ * follows the length.
+ *
+ */
+uint8_t twiprotocol::tx_seal( uint8_t* packet, uint8_t compact ) {
+	uint8_t t_len = packet[6];
+
+	if( compact ) {
+		packet[0] |= TWIP_COMPACT;
+		packet[1] &= ~TWIP_CRC;
+		packet[4] = t_len;
+		memmove( packet + TWIP_COMPACT_SIZE, packet + TWIP_HEADER_SIZE, t_len );
+
+		uint8_t t_crc = crc8_update( CRC8_INIT, packet, 5 );
+		packet[5] = crc8_update( t_crc, packet + TWIP_COMPACT_SIZE, t_len );
+		return TWIP_COMPACT_SIZE + t_len;
+	}
+
+	uint16_t t_checksum = this->frame_checksum( packet );
+	packet[4] = t_checksum >> 8;
+	packet[5] = t_checksum;
+	return TWIP_HEADER_SIZE + t_len;
+}
+
+/*
+ * Function: twiprotocol::tx_upcoming
+ *    Input: uint8_t* record receives the [addr, opcode, id, bytes] record of the next packet, uint8_t
+ *           last is set when the fragment on the bus is the last one of its packet.
+ *   Output: Class of the packet tx_next() starts next plus one, 0 when it goes on with a packet already
+ *           started or nothing is queued.
+ *
+ * Description: Without tx_busy no fragment is on the bus. Only runs where tx_next() could, see there.
+ *
+ */
+uint8_t twiprotocol::tx_upcoming( uint8_t* record, uint8_t last ) {
+	for( uint8_t i = TWIP_PRIORITIES; i > 0; i-- ) {
+		twip_tx_buffer_t* t_queue = &this->tx_buffer[i -1];
+		twip_tx_index_t t_offset = 0;
+
+		// The packet on the bus goes on, or is behind us once its last fragment left
+		if( this->tx_busy && i -1 == this->tx_class ) {
+			if( ! last ) { return 0; }
+			t_offset = 4 + t_queue->peek( 3 );
+		}
+		else if( this->tx_frag[i -1] ) { return 0; }
+
+		if( t_queue->used() <= t_offset ) { continue; }
+		t_queue->peek( t_offset, record, 4 );
+		return i;
+	}
+	return 0;
+}
+
+/*
+ * Function: twiprotocol::tx_next
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Builds the current fragment of the oldest queued packet of the highest class in the TWI
+ * master buffer and starts its transfer without waiting. An urgent packet queued meanwhile is sent
+ * between two fragments of a normal one, which resumes where it was. Only runs while tx_busy is set,
+ * either from poll() or from the interrupt once the previous fragment was sent, so it has the consumer
+ * side of every tx_buffer to itself.
+ *
+ */
+void twiprotocol::tx_next( void ) {
+	this->tx_class = TWIP_PRIORITIES -1;
+	while( this->tx_class && this->tx_buffer[this->tx_class].empty() ) { this->tx_class--; }
+
+	twip_tx_buffer_t* t_queue = &this->tx_buffer[this->tx_class];
+	uint8_t t_frag = this->tx_frag[this->tx_class];
+	uint8_t t_record[4];
+	t_queue->peek( 0, t_record, sizeof(t_record) );
+
+	uint8_t* packet = twi_getMasterBuffer();
+	this->tx_fragment( packet, t_record[1], t_record[2], t_record[3], t_frag );
+	t_queue->peek( sizeof(t_record) + t_frag * TWIP_FRAG_SIZE, packet + TWIP_HEADER_SIZE, packet[6] );
+	uint8_t t_len = this->tx_seal( packet, this->tx_format( t_record[0] ) & TWIP_FORMAT_COMPACT );
+
+	// The bus is kept across fragments and packets as long as something is queued behind and the
+	// next fragment fits within TWIP_MAX_HOLD_US.
+	uint8_t t_last = ( t_frag +1 == this->tx_fragments( t_record[3] ) );
+	uint8_t t_behind = ( t_queue->used() != sizeof(t_record) + t_record[3] );
+	for( uint8_t i = 0; i < this->tx_class; i++ ) { t_behind |= ! this->tx_buffer[i].empty(); }
+
+	this->tx_stop = ( t_last && ! t_behind ) || ( micros() - this->tx_hold + 2 * TWIP_FRAME_US > TWIP_MAX_HOLD_US );
+
+	#if TWIP_FLOW_CONTROL
+	// A retry after a lost arbitration was already taken off the credits, the packets of a batch when added
+	if( t_frag == 0 && this->tx_retries == 0 && t_record[1] != TWIP_OP_BATCH ) { this->tx_credit_take( t_record[0], t_record[3], t_record[2] & TWIP_ID_URGENT ); }
+
+	// The train ends before a packet its receiver has no room for, as far as known, poll() reads the credits
+	uint8_t t_next[4];
+	if( this->tx_upcoming( t_next, t_last ) && t_next[1] != TWIP_OP_BATCH ) {
+		uint8_t* t_peer = this->tx_credit_find( t_next[0] );
+		if( ! t_peer || ! this->tx_credit_fits( t_peer, t_next[3], t_next[2] & TWIP_ID_URGENT ) ) { this->tx_stop = true; }
+	}
+	#endif
+
+	// A transfer which didn't start, bus not idle after TWI_BUS_TIMEOUT_US, never reaches the interrupt
+	uint8_t ret = twi_writeMasterBuffer( t_record[0], t_len, false, this->tx_stop );
+	if( ret ) { this->tx_done( ret ); }
+}
+
+/*
+ * Function: twiprotocol::tx_account
+ *    Input: uint8_t status is the twi_writeTo() return code of a fragment.
+ *   Output: No output.
+ *
+ * Description: Updates the tx counters with the outcome of a fragment.
+ *
+ */
+void twiprotocol::tx_account( uint8_t status ) {
+	switch( status ) {
+		case 0: this->counters.tx_fragments++; break;
+		case 2:
+		case 3: this->counters.tx_nacks++; break;
+		case 4: this->counters.tx_arb_lost++; break;
+		default: this->counters.tx_errors++; break;
+	}
+}
+
+/*
+ * Function: twiprotocol::tx_done
+ *    Input: uint8_t status is the twi_writeTo() return code of the last fragment.
+ *   Output: No output.
+ *
+ * Description: Called from the TWI interrupt when a fragment started by tx_next() left the bus, or by
+ * tx_next() itself when the transfer couldn't be started. A fragment which lost the arbitration is sent
+ * again by poll() after a twi_backoff() delay, up to TWI_ARB_RETRIES times, any other failure drops the
+ * rest of its packet.
+ *
+ */
+void twiprotocol::tx_done( uint8_t status ) {
+	// Late report of a train flush() gave up on
+	if( ! this->tx_busy ) { return; }
+
+	twip_tx_buffer_t* t_queue = &this->tx_buffer[this->tx_class];
+	uint8_t* t_frag = &this->tx_frag[this->tx_class];
+	uint8_t t_record[4];
+	t_queue->peek( 0, t_record, sizeof(t_record) );
+
+	if( status == 4 && this->tx_retries < TWI_ARB_RETRIES ) {
+		this->tx_hold = micros();
+		this->tx_backoff = twi_backoff( this->tx_retries++ );
+		this->tx_busy = false;
+		return;
+	}
+	this->tx_retries = 0;
+	this->tx_account( status );
+
+	if( status == 0 && *t_frag +1 < this->tx_fragments( t_record[3] ) ) { (*t_frag)++; }
+	else {
+		t_queue->skip( sizeof(t_record) + t_record[3] );
+		*t_frag = 0;
+		if( status == 0 ) {
+			this->counters.tx_packets++;
+			this->counters.tx_bytes += t_record[3];
+		}
+		if( this->tx_callback ) { this->tx_callback( t_record[0], t_record[1], status ); }
+	}
+
+	// Without a repeated start pending the bus is not ours anymore, poll() takes over
+	if( status != 0 || this->tx_stop || ! this->tx_pending( TWIP_PRIO_NORMAL ) ) { this->tx_busy = false; return; }
+
+	this->tx_next();
+}
+
+/*
+ * Function: twiprotocol::rx_service
+ *    Input: No input.
+ *   Output: Number of packets handed to a handler.
+ *
+ * Description: Bottom half of the receive path, consumes the packets found at the head of every
+ * rx_buffer, urgent first, that the sketch shouldn't see: the library's own requests and the packets
+ * whose opcode has a handler, which gets them in place and must not call receive(), view() nor
+ * available(). Bulk chunks go to the sink. Stops at the first packet left for the sketch so each class
+ * stays in order. A TWIP_OP_STATS request is answered with send_async(), in the request's class, the
+ * reply is lost when tx_buffer has no room for it.
+ *
+ */
+uint8_t twiprotocol::rx_service( void ) {
+	uint8_t ret = 0;
+
+	// A handler sending a packet may end up here again
+	if( this->rx_dispatching ) { return 0; }
+	this->rx_dispatching = true;
+
+	for( uint8_t i = TWIP_PRIORITIES; i > 0; i-- ) {
+		twipview t_view;
+
+		while( this->rx_fill( i -1, &t_view ) ) {
+			twipentry* t_entry = this->rx_handler( t_view.opcode );
+
+			if( t_view.opcode == TWIP_OP_STATS && t_view.size == 0 && t_view.slot == TWIP_RX_SLOT ) {
+				this->release( &t_view );
+
+				twipstats t_stats;
+				this->stats( &t_stats );
+				this->send_async( t_view.sender, TWIP_OP_STATS, sizeof(t_stats), (uint8_t *) &t_stats,
+					( t_view.id & TWIP_ID_URGENT ) ? TWIP_PRIO_URGENT : TWIP_PRIO_NORMAL );
+				continue;
+			}
+			if( t_view.opcode == TWIP_OP_BULK ) {
+				this->rx_bulk_sink( &t_view );
+				this->release( &t_view );
+				continue;
+			}
+			if( t_entry == NULL ) { break; }
+
+			t_entry->handler( &t_view );
+			this->release( &t_view );
+			this->counters.rx_dispatched++;
+			ret++;
+		}
+	}
+
+	this->rx_dispatching = false;
+	return ret;
+}
+
+/*
+ * Function: twiprotocol::attach
+ *    Input: uint8_t opcode to handle, twiphandler handler to call with every packet carrying it (NULL
+ *           detaches the current one), uint8_t mode TWIP_HANDLER_DEFERRED or TWIP_HANDLER_IRQ.
+ *   Output: Boolean representing: 1 - Success, 0 - TWIP_HANDLERS opcodes are handled already.
+ *
+ * Description: Deferred handlers are run from loop() by dispatch(), available(), receive() and view(),
+ * the packet is passed in place and released once the handler returns, nothing is copied nor
+ * allocated. Interrupt handlers are run by rx_add() as soon as the packet is complete, from the TWI
+ * buffer or the reassembly slot, and the packet never takes room on rx_buffer; they have the same
+ * constraints as twip_onreceive() and v is only valid until they return.
+ *
+ */
+uint8_t twiprotocol::attach( uint8_t opcode, twiphandler handler, uint8_t mode ) {
+	twipentry* t_entry = NULL;
+
+	for( uint8_t i = 0; i < TWIP_HANDLERS; i++ ) {
+		twipentry* e = &this->rx_handlers[i];
+		if( e->handler && e->opcode == opcode ) { t_entry = e; break; }
+		if( ! e->handler && ! t_entry ) { t_entry = e; }
+	}
+	if( t_entry == NULL ) { return ( handler == NULL ); }
+
+	// The interrupt looks the table up
+	#ifdef ARDUINO
+	uint8_t t_sreg = SREG;
+	cli();
+	#endif
+	t_entry->opcode = opcode;
+	t_entry->mode = mode;
+	t_entry->handler = handler;
+	if( handler ) { this->rx_known[opcode >> 3] |= ( 1 << (opcode & 7) ); }
+	else { this->rx_known[opcode >> 3] &= ~( 1 << (opcode & 7) ); }
+	#ifdef ARDUINO
+	SREG = t_sreg;
+	#endif
+
+	return true;
+}
+
+/*
+ * Function: twiprotocol::strict
+ *    Input: uint8_t enable drops packets whose opcode has no handler.
+ *   Output: No output.
+ *
+ * Description: For nodes handling every opcode with attach(): rx_add() drops the other ones on arrival
+ * so they never take room on rx_buffer nor on a reassembly slot, counted as rx_unknown. Reliable
+ * senders are told with TWIP_ACK_REFUSED. The library's own opcodes are always accepted.
+ *
+ */
+void twiprotocol::strict( uint8_t enable ) {
+	this->rx_strict = enable;
+	this->rx_filters();
+}
+
+/*
+ * Function: twiprotocol::filter_sender
+ *    Input: uint8_t addr is the TWI address of a sender or TWIP_FILTER_ALL, uint8_t accept is true to
+ *           receive its frames again.
+ *   Output: No output.
+ *
+ * Description: rx_add() drops the frames of denied senders on arrival, before computing their checksum,
+ * counted as rx_denied_sender. Reliable senders are told with TWIP_ACK_REFUSED. To only listen to a few
+ * peers deny TWIP_FILTER_ALL then accept them one by one.
+ *
+ */
+void twiprotocol::filter_sender( uint8_t addr, uint8_t accept ) {
+	// The interrupt only reads the map and every byte is stored at once, no need to block it
+	if( addr == TWIP_FILTER_ALL ) { memset( this->rx_deny_sender, accept ? 0x00 : 0xFF, sizeof(this->rx_deny_sender) ); }
+	else if( accept ) { this->rx_deny_sender[(addr & 0x7F) >> 3] &= ~( 1 << (addr & 7) ); }
+	else { this->rx_deny_sender[(addr & 0x7F) >> 3] |= ( 1 << (addr & 7) ); }
+
+	this->rx_filters();
+}
+
+/*
+ * Function: twiprotocol::filter_opcode
+ *    Input: uint8_t opcode to filter or TWIP_FILTER_ALL, uint8_t accept is true to receive it again.
+ *   Output: No output.
+ *
+ * Description: Same as filter_sender() for opcodes, counted as rx_denied_opcode. The library's own
+ * opcodes are always accepted, denying TWIP_FILTER_ALL then accepting a few opcodes is a whitelist.
+ *
+ */
+void twiprotocol::filter_opcode( uint8_t opcode, uint8_t accept ) {
+	if( opcode == TWIP_FILTER_ALL ) { memset( this->rx_deny_opcode, accept ? 0x00 : 0xFF, sizeof(this->rx_deny_opcode) ); }
+	else if( accept ) { this->rx_deny_opcode[opcode >> 3] &= ~( 1 << (opcode & 7) ); }
+	else { this->rx_deny_opcode[opcode >> 3] |= ( 1 << (opcode & 7) ); }
+
+	this->rx_filters();
+}
+
+/*
+ * Function: twiprotocol::rx_filters
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Sets rx_filtering when strict() or any filter is on, so rx_add() skips rx_filter()
+ * altogether on nodes that don't use them.
+ *
+ */
+void twiprotocol::rx_filters( void ) {
+	uint8_t t_any = this->rx_strict;
+
+	for( uint8_t i = 0; i < sizeof(this->rx_deny_sender); i++ ) { t_any |= this->rx_deny_sender[i]; }
+	for( uint8_t i = 0; i < sizeof(this->rx_deny_opcode); i++ ) { t_any |= this->rx_deny_opcode[i]; }
+
+	this->rx_filtering = ( t_any != 0 );
+}
+
+/*
+ * Function: twiprotocol::dispatch
+ *    Input: No input.
+ *   Output: Number of packets handed to a deferred handler.
+ *
+ * Description: Runs the deferred handlers of the packets received so far, call it from loop() when
+ * the sketch doesn't call available().
+ *
+ */
+uint8_t twiprotocol::dispatch( void ) { return this->rx_service(); }
+
+/*
+ * Function: twiprotocol::rx_fill
+ *    Input: uint8_t priority is the class of the rx_buffer to look at, twipview* v the structure to fill.
+ *   Output: Boolean representing: 1 - v describes the oldest packet of the class, 0 - Buffer is empty.
+ *
+ */
+uint8_t twiprotocol::rx_fill( uint8_t priority, twipview* v ) {
+	twip_rx_buffer_t* t_ring = &this->rx_buffer[priority];
+
+	// The first byte is the accounting byte, header follows
+	uint8_t t_header[1 + TWIP_HEADER_SIZE];
+
+	v->complete = false;
+	v->priority = priority;
+	if( ! t_ring->peek( 0, t_header, 2 ) ) { return false; }
+
+	if( t_header[0] == TWIP_RX_SLOT ) { // Reassembled packet
+		if( ! this->rx_unpack( &this->rx_slots[t_header[1]] ) ) {
+			t_ring->skip( 2 );
+			cb_publish<uint8_t>( &this->rx_slots[t_header[1]].state, TWIP_SLOT_FREE );
+			return this->rx_fill( priority, v );
+		}
+		this->rx_slot_view( t_header[1], v );
+		return true;
+	}
+
+	t_ring->peek( 0, t_header, sizeof(t_header) );
+
+	v->slot		= TWIP_RX_SLOT;
+	v->sender	= t_header[1];
+	v->flag		= t_header[2];
+	v->opcode	= t_header[3];
+	v->id		= t_header[4];
+	v->checksum	= (t_header[5] << 8) + t_header[6];
+	v->size		= t_header[7];
+
+	// Split the payload where the buffer wraps around
+	twip_rx_index_t t_contiguous;
+	v->payload[0] = t_ring->span( 1 + TWIP_HEADER_SIZE, &t_contiguous );
+	v->length[0] = ( v->size < t_contiguous ) ? v->size : t_contiguous;
+	v->payload[1] = t_ring->span( 1 + TWIP_HEADER_SIZE + v->length[0], &t_contiguous );
+	v->length[1] = v->size - v->length[0];
+
+	v->complete = true;
+	return true;
+}
+
+/*
+ * Function: twiprotocol::rx_unpack
+ *    Input: twipslot* slot is a complete reassembly slot owned by the consumer.
+ *   Output: Boolean representing: 1 - The slot holds a plain packet, 0 - Drop it.
+ *
+ * Description: Expands a TWIP_OP_PACKED packet in place, from loop(), the slot then holds the packet
+ * as it was before compression and calling it again does nothing. Filters apply to the opcode carried
+ * by the packet, a stream which doesn't expand to the announced size is dropped like a bad checksum.
+ * The packet was acknowledged when it completed.
+ *
+ */
+uint8_t twiprotocol::rx_unpack( twipslot* slot ) {
+	if( slot->opcode != TWIP_OP_PACKED ) { return true; }
+
+	uint8_t t_header[TWIP_HEADER_SIZE] = { slot->sender, TWIP_NOF, slot->payload[0], slot->id, 0, 0, slot->payload[1] };
+	uint8_t t_drop = ( slot->size < 2 || t_header[2] >= TWIP_OP_RESERVED || t_header[6] > TWIP_REASM_SIZE ) ? TWIP_DROP_CHECKSUM : 0;
+
+	if( ! t_drop && this->rx_filtering ) { t_drop = this->rx_filter( t_header ); }
+	if( ! t_drop && ! lz8_unpack( slot->payload, sizeof(slot->payload), slot->payload +2, slot->size -2, t_header[6] ) ) {
+		t_drop = TWIP_DROP_CHECKSUM;
+	}
+
+	if( t_drop ) {
+		switch( t_drop ) {
+			case TWIP_DROP_SENDER: this->counters.rx_denied_sender++; break;
+			case TWIP_DROP_DENIED: this->counters.rx_denied_opcode++; break;
+			case TWIP_DROP_OPCODE: this->counters.rx_unknown++; break;
+			default: this->counters.rx_checksum++; break;
+		}
+		twi_trace( TWI_TRACE_DROP, slot->sender, t_drop, t_header, TWIP_HEADER_SIZE );
+		return false;
+	}
+
+	slot->opcode = t_header[2];
+	slot->size = t_header[6];
+	this->counters.rx_packed++;
+	return true;
+}
+
+/*
+ * Function: twiprotocol::rx_class
+ *    Input: uint8_t id is the id of a received packet.
+ *   Output: rx_buffer of the packet's class.
+ *
+ */
+twip_rx_buffer_t* twiprotocol::rx_class( uint8_t id ) {
+	return &this->rx_buffer[( (id & TWIP_ID_URGENT) && TWIP_PRIORITIES > 1 ) ? 1 : 0];
+}
+
+/*
+ * Function: twiprotocol::rx_head
+ *    Input: uint8_t* priority receives the class of the buffer returned.
+ *   Output: rx_buffer holding the next packet for the sketch, NULL if every one is empty.
+ *
+ * Description: Urgent packets are always handed out first, each class in arrival order.
+ *
+ */
+twip_rx_buffer_t* twiprotocol::rx_head( uint8_t* priority ) {
+	for( uint8_t i = TWIP_PRIORITIES; i > 0; i-- ) {
+		if( ! this->rx_buffer[i -1].empty() ) {
+			*priority = i -1;
+			return &this->rx_buffer[i -1];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: twiprotocol::receive
+ *    Input: No input.
+ *   Output: twippacket structure with header and payload information filled.
+ *
+ * Description: Fetches the first packet from rx_buffer returning a twipacket structure. The rx queue's
+ * policy is FIFO meaning that ascending array index is descending age of packet, to put it on another
+ * words the lower index of the rx buffer is always the oldest packet on buffer and it will always be
+ * fetched first. Urgent packets have their own rx_buffer which is always emptied first, priority tells
+ * the class of the packet. Fragmented packets only reach rx_buffer once reassembled, so the complete
+ * flag is only unset when every buffer is empty. TWIP_OP_PACKED packets are expanded on their way out.
+ *
+ **** MORE INFORMATION ****
+ * A few words about the packet's flag, to start take note that AVR is little endian (LSB).
+ * The byte flag is split into three blocks, the first block are the bits 1 and 2, the second block
+ * are bits 3 and 4 and the last block are bits 5, 6, 7 and 8. If the first bit is set (TWIP_SOF) then
+ * the packet is fragmented, the second bit will always be unset for every fragment of the same packet
+ * and it will be set (TWIP_EOF) for the last fragment. When the third bit (TWIP_SEQ) is set the remaining
+ * four bits hold the fragment's index, the payload of fragment n starts at byte n * (TWI_BUFFER_LENGTH -
+ * TWIP_HEADER_SIZE) of the packet. The fourth bit (TWIP_CRC) tells the checksum covers the payload too,
+ * see twiprotocol::frame_checksum(). Without TWIP_SEQ the remaining four bits are the packet's TTL
+ * (time-to-live), which is always zero nowadays because incomplete sets are aged inside their
+ * reassembly slot instead.
+ */
+twippacket twiprotocol::receive( void ) {
+	twippacket ret;
+	ret.complete = false;
+	ret.payload = NULL;
+	ret.priority = TWIP_PRIO_NORMAL;
+
+	// This function runs on the consumer side of rx_buffer and MUST NOT write to it.
+	uint8_t t_header[1 + TWIP_HEADER_SIZE];
+	this->rx_service();
+
+	// Don't do anything if buffer is empty.
+	twip_rx_buffer_t* t_ring = this->rx_head( &ret.priority );
+	if( t_ring == NULL ) { return ret; }
+	t_ring->peek( 0, t_header, 2 );
+
+	if( t_header[0] == TWIP_RX_SLOT ) { // Reassembled packet, the record only holds the slot index
+		twipslot* t_slot = &this->rx_slots[t_header[1]];
+		t_ring->skip( 2 );
+
+		if( ! this->rx_unpack( t_slot ) ) {
+			cb_publish<uint8_t>( &t_slot->state, TWIP_SLOT_FREE );
+			return this->receive();
+		}
+
+		ret.sender	= t_slot->sender;
+		ret.flag	= TWIP_EOF;
+		ret.opcode	= t_slot->opcode;
+		ret.id		= t_slot->id;
+		ret.size	= t_slot->size;
+
+		ret.payload = (uint8_t *) malloc( sizeof(uint8_t) * (ret.size ? ret.size : 1) );
+		memcpy( ret.payload, t_slot->payload, ret.size );
+
+		// Hand the slot back to rx_add()
+		cb_publish<uint8_t>( &t_slot->state, TWIP_SLOT_FREE );
+	} else {
+		t_ring->read( t_header, sizeof(t_header) );
+
+		ret.sender	= t_header[1];
+		ret.flag	= t_header[2];
+		ret.opcode	= t_header[3];
+		ret.id		= t_header[4];
+		ret.size	= t_header[7];
+
+		ret.payload = (uint8_t *) malloc( sizeof(uint8_t) * (ret.size ? ret.size : 1) );
+		t_ring->read( ret.payload, ret.size );
+	}
+
+	ret.checksum = this->checksum( ret.sender, ret.flag, ret.opcode, ret.id, ret.size );
+	ret.complete = true;
+
+	return ret;
+}
+
+/*
+ * Function: twiprotocol::view
+ *    Input: twipview* v is the structure to be filled.
+ *   Output: Boolean representing: 1 - v describes the oldest packet, 0 - No packet available.
+ *
+ * Description: Zero-copy alternative to twiprotocol::receive(), the header is decoded into v and its
+ * payload pointers reference the packet's bytes inside rx_buffer, or inside its reassembly slot for
+ * fragmented packets, nothing is allocated nor copied. The packet stays where it is, and v stays
+ * valid, until twiprotocol::release() is called, calling view() again before that returns the same
+ * packet.
+ *
+ */
+uint8_t twiprotocol::view( twipview* v ) {
+	uint8_t t_priority;
+
+	v->complete = false;
+	this->rx_service();
+
+	// Don't do anything if buffer is empty.
+	if( this->rx_head( &t_priority ) == NULL ) { return false; }
+	return this->rx_fill( t_priority, v );
+}
+
+/*
+ * Function: twiprotocol::release
+ *    Input: twipview* v is a packet returned by twiprotocol::view().
+ *   Output: No output.
+ *
+ * Description: Removes the viewed packet from rx_buffer, v must not be used afterwards.
+ *
+ */
+void twiprotocol::release( twipview* v ) {
+	if( ! v->complete ) { return; }
+
+	if( v->slot != TWIP_RX_SLOT ) {
+		this->rx_buffer[v->priority].skip( 2 );
+		cb_publish<uint8_t>( &this->rx_slots[v->slot].state, TWIP_SLOT_FREE );
+	}
+	else { this->rx_buffer[v->priority].skip( 1 + TWIP_HEADER_SIZE + v->size ); }
+
+	v->complete = false;
+}
+
+/*
+ * Function: twiprotocol::available
+ *    Input: No input.
+ *   Output: Boolean representing: 1 - At least one packets is available, 0 - No packets available.
+ *
+ * Description: Wrapper function to return the total number of packets currently at rx_buffer
+ *
+ */
+uint8_t twiprotocol::available( void ) {
+	uint8_t t_priority;
+
+	this->rx_service();
+	return ( this->rx_head( &t_priority ) != NULL );
+}
+
+/*
+ * Function: twiprotocol::put
+ *    Input: data is a pointer to payload to be added to the rx_buffer,
+ *           bytes is the total size of payload.
+ *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ *
+ * Description: Public method acting as a wrapper to rx_add(), defined because it is a more (I hope)
+ * user friendly name; rx_add() is the private method, so no access to it outside the class scope.
+ *
+ */
+uint8_t twiprotocol::put( uint8_t* data, int bytes ) { return this->rx_add( data, bytes ); }
+
+/*
+ * Function: twip_onreceive
+ *    Input: uint8_t* data is the packet's payload to be added to the rx_buffer,
+ *           int bytes is the total size of packet's payload.
+ *   Output: No output.
+ *
+ * Description: Wrapper function called by TWI when TW_SR_STOP is received on the bus. This function
+ * MUST be the less cycle intensive possible, meaning that no fancy stuff like Serial.print() nor delay()
+ * nor any other crap that could block the TWI bus SHOULD be used here.
+ *
+ * On host builds the receiving instance is the one attached to the node currently selected on
+ * the simulated bus, see utility/twi_host.c.
+ *
+ */
+#ifdef ARDUINO
+void twip_onreceive( uint8_t* data, int bytes ) { twip.put( data, bytes ); }
+#else
+void twip_onreceive( uint8_t* data, int bytes ) { ((twiprotocol *) twi_host_context())->put( data, bytes ); }
+#endif
+
+/*
+ * Function: twip_ontransmit
+ *    Input: uint8_t status is the twi_writeTo() return code of the fragment.
+ *   Output: No output.
+ *
+ * Description: Wrapper function called by TWI when a fragment sent by twiprotocol::send_async() left
+ * the bus, same constraints as twip_onreceive().
+ *
+ */
+#ifdef ARDUINO
+void twip_ontransmit( uint8_t status ) { twip.tx_done( status ); }
+#else
+void twip_ontransmit( uint8_t status ) { ((twiprotocol *) twi_host_context())->tx_done( status ); }
+#endif
+
+/*
+ * Function: twip_onrequest
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Wrapper function called by TWI when a master reads from this node, same constraints as
+ * twip_onreceive().
  *
  */
-void twip_onreceive( uint8_t* data, int bytes ) { twip.put( data, bytes ); }
\ No newline at end of file
+#ifdef ARDUINO
+void twip_onrequest( void ) { twip.rx_reply(); }
+#else
+void twip_onrequest( void ) { ((twiprotocol *) twi_host_context())->rx_reply(); }
+#endif
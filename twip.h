@@ -20,19 +20,272 @@
 #ifndef __twip_h____
 #define __twip_h____
 
+#ifdef ARDUINO
 #include <Arduino.h>
+#else
+#include "utility/twi_host.h"
+#endif
 #include "utility/cb.h"
+#include "utility/lz8.h"
 
 #define TWIP_MAX_TTL 0x0F
 #define TWIP_HEADER_SIZE 7
+#define TWIP_COMPACT_SIZE 6	// [sender | TWIP_COMPACT, flag, opcode, id, len, CRC-8] then the payload
 #define TWIP_MAX_BUFFER_SIZE 254
 
+// The defaults below take about 1.8 KB, more than an ATmega328 can spare out of its 2 KB. There, and on
+// any part with less RAM, they default to a single class, a half sized rx buffer and a single reassembly
+// slot instead, about half of it. Every knob can still be set on its own.
+#ifndef TWIP_SMALL_RAM
+#if defined(__AVR_ATmega328P__) || ( defined(RAMEND) && RAMEND < 0x900 )
+#define TWIP_SMALL_RAM 1
+#else
+#define TWIP_SMALL_RAM 0
+#endif
+#endif
+
+// Size of the rx buffer in bytes, must be a power of two; above 256 the buffer switches to 16 bit
+// indexes. Every stored fragment uses TWIP_HEADER_SIZE +1 bytes on top of its payload.
+#ifndef TWIP_RX_BUFFER_SIZE
+#if TWIP_SMALL_RAM
+#define TWIP_RX_BUFFER_SIZE 128
+#else
+#define TWIP_RX_BUFFER_SIZE 256
+#endif
+#endif
+
+#if TWIP_RX_BUFFER_SIZE > 256
+typedef uint16_t twip_rx_index_t;
+#else
+typedef uint8_t twip_rx_index_t;
+#endif
+
+// Size of the tx queue used by send_async() in bytes, must be a power of two. Every queued packet
+// uses 4 bytes on top of its payload, a TWIP_OP_STATS reply needs room for 68.
+#ifndef TWIP_TX_BUFFER_SIZE
+#define TWIP_TX_BUFFER_SIZE 128
+#endif
+
+#if TWIP_TX_BUFFER_SIZE > 256
+typedef uint16_t twip_tx_index_t;
+#else
+typedef uint8_t twip_tx_index_t;
+#endif
+
+// Packets are either TWIP_PRIO_NORMAL or TWIP_PRIO_URGENT. Every class has its own rx_buffer and
+// tx_buffer, the urgent ones are always served first; with TWIP_PRIORITIES set to 1 both classes
+// share the same buffers and are served in arrival order, which saves their RAM.
+#ifndef TWIP_PRIORITIES
+#if TWIP_SMALL_RAM
+#define TWIP_PRIORITIES 1
+#else
+#define TWIP_PRIORITIES 2
+#endif
+#endif
+
+#if TWIP_PRIORITIES < 1 || TWIP_PRIORITIES > 2
+#error TWIP_PRIORITIES must be 1 or 2
+#endif
+
+typedef cb<TWIP_RX_BUFFER_SIZE, twip_rx_index_t> twip_rx_buffer_t;
+typedef cb<TWIP_TX_BUFFER_SIZE, twip_tx_index_t> twip_tx_buffer_t;
+
+// Fragmented packets are reassembled aside in one of TWIP_REASM_SLOTS slots keyed on (sender, id),
+// each one able to hold TWIP_REASM_SIZE payload bytes, and only enter rx_buffer once complete.
+#ifndef TWIP_REASM_SLOTS
+#if TWIP_SMALL_RAM
+#define TWIP_REASM_SLOTS 1
+#else
+#define TWIP_REASM_SLOTS 2
+#endif
+#endif
+
+#ifndef TWIP_REASM_SIZE
+#define TWIP_REASM_SIZE TWIP_MAX_BUFFER_SIZE
+#endif
+
+// Fragments of the same packet are sent back to back with repeated starts, holding the bus for at
+// most TWIP_MAX_HOLD_US microseconds before a STOP lets other masters in; 0 sends a STOP after every
+// fragment.
+#ifndef TWIP_MAX_HOLD_US
+#define TWIP_MAX_HOLD_US 10000
+#endif
+
+// Fragments sent with TWIP_PAYLOAD_CRC set to 1 carry a CRC-16/CCITT of their header and payload in
+// place of the header only checksum and have TWIP_CRC set, receivers check both kinds. Nodes built
+// before TWIP_CRC existed drop such fragments.
+#ifndef TWIP_PAYLOAD_CRC
+#define TWIP_PAYLOAD_CRC 0
+#endif
+
+// Frames sent to receivers advertising it in their TWIP_OP_ACK reply use the compact header, [sender |
+// TWIP_COMPACT, flag, opcode, id, len, CRC-8]: a CRC-8 of the whole frame replaces the two checksum bytes,
+// a frame cut short by a NACK no longer matches its length. Every receiver reads both, set it to 0 to
+// only send regular headers; TWIP_PAYLOAD_CRC builds never send them.
+#ifndef TWIP_COMPACT_HEADER
+#define TWIP_COMPACT_HEADER 1
+#endif
+
+// With TWIP_COMPRESS set to 1, or once compress() is called, send() and send_reliable() compress the
+// packets spanning several fragments sent to receivers advertising it in their TWIP_OP_ACK reply, when
+// it saves bytes. Every receiver expands them, within a reassembly slot of TWIP_REASM_SIZE bytes.
+#ifndef TWIP_COMPRESS
+#define TWIP_COMPRESS 0
+#endif
+
+// send_reliable() sends a packet up to TWIP_RETRIES +1 times, backing off TWIP_RETRY_US, doubled on
+// every retry, when the receiver had no room for it.
+#ifndef TWIP_RETRIES
+#define TWIP_RETRIES 3
+#endif
+
+#ifndef TWIP_RETRY_US
+#define TWIP_RETRY_US 2000
+#endif
+
+// send_reliable() keeps up to TWIP_WINDOW fragments of a packet in flight before reading which ones the
+// receiver holds, 0 reads it once after the last fragment only. Either way the retries only send the
+// fragments the receiver is missing, see window().
+#ifndef TWIP_WINDOW
+#define TWIP_WINDOW 0
+#endif
+
+// Number of senders whose last reliable packet id is remembered to drop retransmitted duplicates
+#ifndef TWIP_DEDUP_SIZE
+#define TWIP_DEDUP_SIZE 4
+#endif
+
+// Receivers advertise their free rx_buffer bytes and reassembly slots in the reply read by
+// send_reliable(). With TWIP_FLOW_CONTROL set send() reads it as well, whenever the credits last known
+// for the peer are not enough for the packet, and waits up to TWIP_CREDIT_WAIT_US for room instead of
+// sending frames the peer would drop; poll() holds the packets queued by send_async() the same way.
+// Credits of the last TWIP_CREDIT_PEERS peers are remembered. Every node on the bus must then run this
+// version: the original library attaches no slave transmit callback and resets when it is read.
+#ifndef TWIP_FLOW_CONTROL
+#define TWIP_FLOW_CONTROL 1
+#endif
+
+#ifndef TWIP_CREDIT_WAIT_US
+#define TWIP_CREDIT_WAIT_US 10000
+#endif
+
+// A set in progress is given up, when a reply is read, once its sender sent nothing for
+// TWIP_SLOT_TIMEOUT_US; longer than the backoffs of send_reliable() and the credit waits of send().
+#ifndef TWIP_SLOT_TIMEOUT_US
+#define TWIP_SLOT_TIMEOUT_US 50000
+#endif
+
+#ifndef TWIP_CREDIT_PEERS
+#define TWIP_CREDIT_PEERS 4
+#endif
+
+// Opcodes handled by functions registered with attach(), at most TWIP_HANDLERS of them
+#ifndef TWIP_HANDLERS
+#define TWIP_HANDLERS 8
+#endif
+
+// Once batch() is called small normal packets sent with send() are gathered per receiver, up to
+// TWIP_BATCH_PEERS receivers at once, into a single TWIP_OP_BATCH frame of TWIP_BATCH_SIZE payload
+// bytes at most (no more than TWI_BUFFER_LENGTH - TWIP_HEADER_SIZE).
+#ifndef TWIP_BATCH_PEERS
+#define TWIP_BATCH_PEERS 2
+#endif
+
+#ifndef TWIP_BATCH_SIZE
+#define TWIP_BATCH_SIZE 25
+#endif
+
+// send_bulk() splits a transfer of up to 65535 bytes into chunks of TWIP_BULK_CHUNK bytes at most, every
+// TWIP_BULK_WINDOW chunks it waits for the receiver to confirm it has every byte so far. Receivers keep
+// the progress of the last TWIP_BULK_PEERS transfers, one per sender. A chunk and its TWIP_BULK_HEADER
+// bytes must fit in the receiver's reassembly slot.
+#ifndef TWIP_BULK_CHUNK
+#define TWIP_BULK_CHUNK 128
+#endif
+
+#ifndef TWIP_BULK_WINDOW
+#define TWIP_BULK_WINDOW 4
+#endif
+
+#ifndef TWIP_BULK_PEERS
+#define TWIP_BULK_PEERS 2
+#endif
+
+#define TWIP_BULK_HEADER 6	// [opcode, tag, total, offset], 16 bit values are big endian
+
+#define TWIP_RX_SLOT 0xFF	// rx_buffer accounting byte of a record pointing to a reassembly slot
+
+#define TWIP_SLOT_FREE		0x00	// Slot owned by rx_add()
+#define TWIP_SLOT_FILLING	0x01	// Slot owned by rx_add(), fragments are arriving
+#define TWIP_SLOT_READY		0x02	// Slot owned by receive()/view(), packet is complete
+#define TWIP_SLOT_PACKING	0x03	// Slot owned by send(), holds a compressed payload being sent
+
 #define TWIP_NOF 0x00	// No fragmentation
 #define TWIP_SOF 0x01	// Start of fragmentation
 #define TWIP_EOF 0x03	// End of fragmentation
+#define TWIP_SEQ 0x04	// Fragment index in the upper four bits
+#define TWIP_CRC 0x08	// Checksum covers the payload
+
+#define TWIP_COMPACT 0x80	// Set on the sender byte of compact frames, addresses only use seven bits
 
 #define TWIP_FLAG_NFO 0x00	// Packet's header fragmentation flag
 #define TWIP_FLAG_TTL 0x01	// Packet's header TTL flag
+#define TWIP_FLAG_IDX 0x02	// Packet's header fragment index
+
+// Reasons of the TWI_TRACE_DROP events logged by rx_add()
+#define TWIP_DROP_CHECKSUM	0x01	// Truncated frame or bad checksum
+#define TWIP_DROP_FULL		0x02	// No room on rx_buffer
+#define TWIP_DROP_SLOT		0x03	// No free reassembly slot
+#define TWIP_DROP_SET		0x04	// Fragment set dropped before completion
+#define TWIP_DROP_OPCODE	0x05	// No handler for the opcode, see strict()
+#define TWIP_DROP_SENDER	0x06	// Sender denied by filter_sender()
+#define TWIP_DROP_DENIED	0x07	// Opcode denied by filter_opcode()
+#define TWIP_DROP_BULK		0x08	// Bulk chunk out of sequence, of an unknown or of an aborted transfer
+
+#define TWIP_FILTER_ALL		0xFF	// filter_sender() and filter_opcode() argument applying to every value
+
+// Opcodes from TWIP_OP_RESERVED up are used by the library itself and MUST NOT be used by sketches.
+// A packet with TWIP_OP_STATS and no payload asks the receiving node for its counters, the reply uses
+// the same opcode with the node's twipstats structure as payload.
+#define TWIP_OP_RESERVED	0xF0
+#define TWIP_OP_STATS		0xF0
+#define TWIP_OP_ACK			0xF1	// First byte of the reply read by send_reliable() and send()
+#define TWIP_OP_BATCH		0xF2	// Payload made of [opcode, length, payload] records, see batch()
+#define TWIP_OP_PACKED		0xF3	// Payload made of [opcode, length, utility/lz8.c stream], see compress()
+#define TWIP_OP_BULK		0xF4	// Payload made of a TWIP_BULK_HEADER and the chunk's bytes, see send_bulk()
+
+// [TWIP_OP_ACK, sender, id, status, free reassembly slots, free bytes (at most 255) of the normal and
+// of the urgent rx_buffer, TWIP_FORMAT_* understood, fragments held (big endian bitmap)]; receivers
+// running an older version send the first seven or eight bytes only.
+#define TWIP_ACK_SIZE 10
+
+#define TWIP_FORMAT_COMPACT	0x01	// Compact headers
+#define TWIP_FORMAT_PACKED	0x02	// TWIP_OP_PACKED packets
+#define TWIP_FORMAT_SACK	0x04	// The reply tells which fragments of a packet in progress are held
+
+// Packets sent by send_reliable() have ids with TWIP_ID_RELIABLE set, the other ones never do. Urgent
+// packets have TWIP_ID_URGENT set, the packet counter uses the remaining bits.
+#define TWIP_ID_RELIABLE	0x80
+#define TWIP_ID_URGENT		0x40
+#define TWIP_ID_MASK		0x3F
+
+#define TWIP_PRIO_NORMAL	0
+#define TWIP_PRIO_URGENT	1
+
+#define TWIP_ACK_OK			0x00	// Packet queued
+#define TWIP_ACK_FULL		0x01	// No room on rx_buffer or no free slot, try later
+#define TWIP_ACK_MISSING	0x02	// Fragments are missing, send the packet again
+#define TWIP_ACK_REFUSED	0x03	// The receiver doesn't handle the opcode, don't send it again
+#define TWIP_ACK_SEEN		0x04	// Packet already queued before, a retransmission or a stale id
+
+#define TWIP_SENT_THROTTLED	0x10	// onsent() status of a packet its receiver had no room for, never sent
+
+#define TWIP_BULK_FREE		0x00
+#define TWIP_BULK_RUNNING	0x01	// Chunks are accepted in sequence
+#define TWIP_BULK_ABORTED	0x02	// The sink refused a chunk, the rest of the transfer is refused too
+
+#define TWIP_HANDLER_DEFERRED	0x00	// Handler run from loop() by dispatch(), available(), receive() or view()
+#define TWIP_HANDLER_IRQ		0x01	// Handler run from the TWI interrupt as soon as the packet is complete
 
 struct twippacket {
 	uint8_t  sender;
@@ -42,29 +295,244 @@ struct twippacket {
 	uint16_t checksum;
 	uint8_t  size;
 	uint8_t  complete;
+	uint8_t  priority;
 	uint8_t* payload;
 };
 
+struct twipslot {
+	volatile uint8_t state;
+	uint8_t  sender;
+	uint8_t  opcode;
+	uint8_t  id;
+	uint8_t  ttl;
+	uint32_t stamp;		// micros() of the last fragment stored
+	uint8_t  size;
+	uint8_t  count;		// Number of fragments, 0 until the last one arrives
+	uint8_t  frags;		// Number of fragments received
+	uint16_t mask;		// Bit n set once fragment n is stored
+	uint8_t  payload[TWIP_REASM_SIZE + LZ8_MARGIN];	// The margin is only used to expand packed packets
+};
+
+// A packet still stored in the rx buffer, payload is made of up to two spans because the
+// buffer is circular; payload[1] is only used when length[1] is not zero.
+struct twipview {
+	uint8_t  sender;
+	uint8_t  flag;
+	uint8_t  opcode;
+	uint8_t  id;
+	uint16_t checksum;
+	uint8_t  size;
+	uint8_t  complete;
+	uint8_t* payload[2];
+	uint8_t  length[2];
+	uint8_t  slot;
+	uint8_t  priority;
+};
+
+// Packets waiting for their batch to be sent, count is 0 when the entry is free
+struct twipbatch {
+	uint8_t  addr;
+	uint8_t  id;
+	uint8_t  count;
+	uint8_t  used;
+	uint32_t since;		// micros() when the first packet was added
+	uint8_t  data[TWIP_BATCH_SIZE];
+};
+
+typedef void (*twiphandler)( twipview* v );
+
+// Bytes of a bulk transfer handed to the sink, data is only valid until the sink returns. The transfer is
+// complete once offset + length reaches total.
+struct twipchunk {
+	uint8_t  sender;
+	uint8_t  opcode;
+	uint16_t total;
+	uint16_t offset;
+	uint8_t  length;
+	uint8_t* data;
+};
+
+typedef uint8_t (*twipsink)( twipchunk* c );
+typedef uint8_t (*twipsource)( uint16_t offset, uint8_t* data, uint8_t length );
+
+// Progress of a bulk transfer on the receiver, next is the offset of the next chunk accepted
+struct twipbulk {
+	uint8_t  sender;
+	uint8_t  tag;
+	uint8_t  state;
+	uint16_t total;
+	uint16_t next;
+};
+
+struct twipentry {
+	uint8_t  opcode;
+	uint8_t  mode;		// TWIP_HANDLER_DEFERRED or TWIP_HANDLER_IRQ
+	twiphandler handler;	// NULL when the entry is free
+};
+
+// Always on counters, every field wraps around silently. The layout has no padding on AVR nor on the
+// host so the structure is sent over the bus as is by TWIP_OP_STATS replies, both are little endian.
+struct twipstats {
+	uint32_t tx_bytes;			// Payload bytes of packets sent
+	uint32_t rx_bytes;			// Payload bytes of packets received
+	uint16_t tx_packets;		// Packets whose every fragment was acked
+	uint16_t tx_fragments;		// Fragments acked by the receiver
+	uint16_t tx_nacks;			// Fragments refused by the receiver, address or data NACK
+	uint16_t tx_arb_lost;		// Fragments dropped after losing the arbitration TWI_ARB_RETRIES times
+	uint16_t tx_errors;			// Fragments dropped for a bus timeout or any other TWI error
+	uint16_t tx_queue_full;		// Packets refused by send_async() for lack of room on tx_buffer
+	uint16_t tx_retransmits;	// Packets sent again by send_reliable()
+	uint16_t tx_throttled;		// Packets refused by send(), or dropped by poll(), because the receiver had no room
+	uint16_t tx_credit_reads;	// Credit refreshes read from receivers by send() and poll()
+	uint16_t rx_packets;		// Packets queued on rx_buffer, reassembled ones included
+	uint16_t rx_fragments;		// Fragments stored on a reassembly slot
+	uint16_t rx_checksum;		// Frames dropped by rx_add() because truncated or with a bad checksum, packed packets which don't expand
+	uint16_t rx_full;			// Packets dropped for lack of room on rx_buffer or of a free slot
+	uint16_t rx_incomplete;		// Fragment sets dropped before completion, aged out or inconsistent
+	uint16_t rx_high_water;		// Highest number of bytes ever used on rx_buffer
+	uint16_t rx_duplicates;		// Reliable packets received again after being queued
+	uint16_t rx_unknown;		// Frames dropped by strict() because no handler takes their opcode
+	uint16_t rx_dispatched;		// Packets handed to a handler registered with attach()
+	uint16_t rx_denied_sender;	// Frames dropped by filter_sender()
+	uint16_t rx_denied_opcode;	// Frames dropped by filter_opcode()
+	uint16_t tx_batched;		// Packets sent inside a TWIP_OP_BATCH frame, each frame counts in tx_packets
+	uint16_t rx_batched;		// Packets split out of TWIP_OP_BATCH frames
+	uint16_t tx_packed;			// Packets sent compressed, tx_bytes counts their size before compression
+	uint16_t rx_packed;			// TWIP_OP_PACKED packets expanded, rx_bytes counts their compressed size
+	uint16_t tx_bulk_rewinds;	// Bulk windows sent again from the last offset confirmed
+	uint16_t rx_bulk_dropped;	// Bulk chunks out of sequence, of an unknown or of an aborted transfer
+	uint16_t tx_resent;			// Fragments sent again by send_reliable() because the receiver missed them
+	uint16_t tx_window_reads;	// Replies read by send_reliable() in the middle of a packet, see window()
+};
+
 class twiprotocol {
 	private:
-		cb rx_buffer;
+		twip_rx_buffer_t rx_buffer[TWIP_PRIORITIES];
+		twipslot rx_slots[TWIP_REASM_SLOTS];
+		twip_tx_buffer_t tx_buffer[TWIP_PRIORITIES];
+		volatile uint8_t tx_busy;
+		uint8_t tx_class;		// tx_buffer of the fragment on the bus
+		uint8_t tx_frag[TWIP_PRIORITIES];
+		uint8_t tx_stop;
+		uint8_t tx_retries;
+		uint32_t tx_hold;
+		uint32_t tx_backoff;
+		uint8_t tx_holding;		// The next queued packet waits for credits since tx_held
+		uint32_t tx_held;
+		void (*tx_callback)(uint8_t, uint8_t, uint8_t);
 		uint8_t pkt_id;
+		uint8_t rel_id;
+		uint8_t rx_ack[3];		// Sender, id and TWIP_ACK_* status of the last reliable fragment received
+		uint8_t rx_dedup[TWIP_DEDUP_SIZE][2];
+		uint8_t rx_dedup_next;
+		uint8_t rx_known[32];	// Bit n set when opcode n has a handler
+		twipentry rx_handlers[TWIP_HANDLERS];
+		uint8_t rx_strict;
+		uint8_t rx_deny_sender[16];	// Bit n set when frames from address n are dropped
+		uint8_t rx_deny_opcode[32];	// Bit n set when frames with opcode n are dropped
+		uint8_t rx_filtering;		// Any bit set on the maps above, or strict()
+		uint8_t rx_dispatching;
+		uint8_t tx_credit[TWIP_CREDIT_PEERS][5];	// Address, free slots, free bytes of both rx_buffer and formats of a peer
+		uint8_t tx_credit_next;
+		twipbatch tx_batch[TWIP_BATCH_PEERS];
+		uint32_t tx_batch_us;	// Deadline of a batch, 0 when batching is off
+		uint8_t tx_compact;		// Send and advertise compact headers
+		uint8_t tx_packing;		// Compress large packets
+		uint8_t tx_window;		// Fragments sent by send_reliable() before reading the receiver's reply, 0 for all
+		uint8_t tx_bulk_tag;
+		twipbulk rx_bulk[TWIP_BULK_PEERS];
+		uint8_t rx_bulk_next;
+		twipsink rx_sink;
 		uint8_t twi_address;
+		twipstats counters;
 
 		uint8_t		rx_add( uint8_t* data, int bytes );
+		uint8_t		rx_reassemble( uint8_t* data );
+		uint8_t		rx_expand( uint8_t* data, int bytes, uint8_t* frame );
+		uint8_t		rx_store( uint8_t* header, uint8_t* payload );
+		uint8_t		rx_unbatch( uint8_t* data );
+		uint8_t		rx_unpack( twipslot* slot );
+		uint8_t		rx_bulk_accept( uint8_t* header, uint8_t* chunk, uint8_t size );
+		void		rx_bulk_sink( twipview* v );
+		twip_rx_buffer_t* rx_class( uint8_t id );
+		twip_rx_buffer_t* rx_head( uint8_t* priority );
+		uint8_t		rx_seen( uint8_t* data );
+		void		rx_delivered( uint8_t* data );
+		void		rx_acknowledge( uint8_t* data, uint8_t status );
+		void		rx_reply( void );
+		uint8_t		rx_filter( uint8_t* data );
+		void		rx_filters( void );
+		twipentry*	rx_handler( uint8_t opcode );
+		void		rx_direct( twipentry* entry, twipview* v, uint8_t* data );
+		uint8_t		rx_fill( uint8_t priority, twipview* v );
+		void		rx_slot_view( uint8_t slot, twipview* v );
+		uint8_t		tx_fragments( uint8_t bytes );
+		void		tx_fragment( uint8_t* packet, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t index );
+		uint8_t		tx_packet( uint8_t addr, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t* payload, uint8_t keep,
+						uint16_t* pending );
+		uint8_t		tx_compress( uint8_t addr, uint8_t opcode, uint8_t id, uint8_t bytes, uint8_t* payload, uint8_t keep,
+						uint16_t* pending, uint8_t* ret );
+		void		tx_next( void );
+		uint8_t		tx_pending( uint8_t priority );
+		uint8_t		tx_upcoming( uint8_t* record, uint8_t last );
+		uint8_t*	tx_credit_find( uint8_t addr );
+		uint8_t*	tx_credit_peer( uint8_t addr );
+		uint8_t		tx_credit_hold( void );
+		uint8_t		tx_credit_fits( uint8_t* peer, uint8_t bytes, uint8_t priority );
+		uint8_t		tx_credit_wait( uint8_t addr, uint8_t bytes, uint8_t priority );
+		void		tx_credit_take( uint8_t addr, uint8_t bytes, uint8_t priority );
+		uint8_t		tx_reply( uint8_t addr, uint8_t* reply );
+		uint8_t		tx_reliable( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload, uint8_t priority,
+						uint8_t resend );
+		uint8_t		tx_format( uint8_t addr );
+		uint8_t		tx_batch_add( uint8_t addr, uint8_t opcode, uint8_t bytes, uint8_t* payload );
+		void		tx_batch_send( twipbatch* batch );
+		void		tx_batch_flush( uint8_t expired );
+		void		tx_done( uint8_t status );
+		void		tx_account( uint8_t status );
+		uint8_t		rx_service( void );
 		uint8_t		flag_decode( uint8_t type, uint8_t flag );
 		uint16_t	checksum( uint8_t sender, uint8_t flag, uint8_t opcode, uint8_t id, uint8_t len );
+		uint16_t	frame_checksum( uint8_t* frame );
+		uint8_t		tx_seal( uint8_t* packet, uint8_t compact );
 
 	public:
 		twiprotocol( uint8_t addr );
 
 		twippacket	receive( void );
+		uint8_t		view( twipview* v );
+		void		release( twipview* v );
 		uint8_t		available( void );
 		uint8_t		put( uint8_t* data, int bytes );
-		uint8_t		send( uint8_t addr, uint8_t opcode, uint8_t bytes = 0, uint8_t* payload = NULL );
+		uint8_t		send( uint8_t addr, uint8_t opcode, uint8_t bytes = 0, uint8_t* payload = NULL,
+						uint8_t priority = TWIP_PRIO_NORMAL );
+		uint8_t		send_reliable( uint8_t addr, uint8_t opcode, uint8_t bytes = 0, uint8_t* payload = NULL,
+						uint8_t priority = TWIP_PRIO_NORMAL );
+		uint8_t		send_async( uint8_t addr, uint8_t opcode, uint8_t bytes = 0, uint8_t* payload = NULL,
+						uint8_t priority = TWIP_PRIO_NORMAL );
+		uint8_t		send_bulk( uint8_t addr, uint8_t opcode, uint16_t bytes, twipsource source );
+		void		sink( twipsink function );
+		uint8_t		poll( void );
+		void		flush( uint8_t priority = TWIP_PRIO_NORMAL );
+		void		onsent( void (*function)(uint8_t, uint8_t, uint8_t) );
+		void		batch( uint32_t us );
+		void		compact( uint8_t enable );
+		void		compress( uint8_t enable );
+		void		window( uint8_t fragments );
+		void		stats( twipstats* s, uint8_t reset = false );
+		uint8_t		attach( uint8_t opcode, twiphandler handler, uint8_t mode = TWIP_HANDLER_DEFERRED );
+		void		strict( uint8_t enable = true );
+		void		filter_sender( uint8_t addr, uint8_t accept );
+		void		filter_opcode( uint8_t opcode, uint8_t accept );
+		uint8_t		dispatch( void );
+
+	friend void twip_ontransmit( uint8_t status );
+	friend void twip_onrequest( void );
 };
 
 extern twiprotocol twip;
 void twip_onreceive( uint8_t* data, int bytes );
+void twip_ontransmit( uint8_t status );
+void twip_onrequest( void );
 
 #endif
\ No newline at end of file
@@ -20,23 +20,297 @@
 #ifndef __cb_h____
 #define __cb_h____
 
+#ifdef ARDUINO
 #include <Arduino.h>
+#else
+#include "twi_host.h"
+#endif
 
+/*
+ * cb<N, T> is a circular buffer of N bytes, N must be a power of two so every index advance is a mask
+ * instead of a modulo, T is the index type: uint8_t up to 256 bytes, uint16_t above that. Storage is
+ * part of the object, nothing is allocated at runtime. One byte is kept free to tell full from empty
+ * so N -1 bytes can actually be stored.
+ *
+ * The buffer is safe to share between exactly one producer and one consumer running concurrently,
+ * typically the TWI interrupt and loop() or two threads on host builds, without any locking:
+ *
+ *	producer: write(), available(), commit(), rollback()
+ *	consumer: read(), peek(), span(), skip(), empty(), used()
+ *
+ * Bytes written by the producer are kept private until commit() publishes all of them at once, so
+ * the consumer never observes a partially written record. Each side only ever stores its own index
+ * and the stores are ordered after the data accesses they guard by cb_publish().
+ */
+
+// Index load with acquire semantics, 8 bit accesses are atomic on AVR so a compiler barrier is enough
+// for them, wider indexes are read with interrupts disabled.
+template <typename T> static inline T cb_acquire( volatile T* index ) {
+	#ifdef ARDUINO
+	T ret;
+	if( sizeof(T) == 1 ) { ret = *index; }
+	else { uint8_t t_sreg = SREG; cli(); ret = *index; SREG = t_sreg; }
+	__asm__ __volatile__( "" ::: "memory" );
+	return ret;
+	#else
+	return __atomic_load_n( index, __ATOMIC_ACQUIRE );
+	#endif
+}
+
+// Index store with release semantics
+template <typename T> static inline void cb_publish( volatile T* index, T value ) {
+	#ifdef ARDUINO
+	__asm__ __volatile__( "" ::: "memory" );
+	if( sizeof(T) == 1 ) { *index = value; }
+	else { uint8_t t_sreg = SREG; cli(); *index = value; SREG = t_sreg; }
+	#else
+	__atomic_store_n( index, value, __ATOMIC_RELEASE );
+	#endif
+}
+
+template <uint16_t N, typename T = uint8_t>
 class cb {
 	private:
-		uint8_t  cb_size;
-		uint8_t  cb_start;
-		uint8_t  cb_end;
-		uint8_t* cb_buffer;
+		// Compile time checks: N is a power of two and T can index it
+		typedef char cb_size_is_power_of_two[ (N & (N -1)) == 0 ? 1 : -1 ];
+		typedef char cb_index_is_wide_enough[ (N -1) <= (T) ~0 ? 1 : -1 ];
+
+		volatile T cb_start;	// Read pointer, owned by the consumer
+		volatile T cb_end;		// Published write pointer, owned by the producer
+		T cb_head;				// Pending write pointer, private to the producer
+		uint8_t cb_buffer[N];
 
 	public:
-		~cb( void );
+		cb( void ) { this->init(); }
+
+		void init( void );
 		uint8_t read( void );
 		uint8_t empty( void );
-		uint8_t available( void );
-		uint8_t init( uint8_t size );
+		T available( void );
+		T used( void );
 		uint8_t write( uint8_t byte );
-		uint8_t peek( uint8_t offset );
+		uint8_t write( const uint8_t* data, T bytes );
+		uint8_t read( uint8_t* data, T bytes );
+		uint8_t peek( T offset, uint8_t* data, T bytes );
+		void commit( void );
+		void rollback( void );
+		uint8_t peek( T offset );
+		uint8_t* span( T offset, T* len );
+		void skip( T bytes );
 };
 
-#endif
\ No newline at end of file
+/*
+ * Function: cb::init
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Empties the buffer, neither side may be using it at the time.
+ *
+ */
+template <uint16_t N, typename T> void cb<N, T>::init( void ) {
+	this->cb_start  = 0;	// Read pointer
+	this->cb_end    = 0;	// Write pointer
+	this->cb_head   = 0;	// Pending write pointer
+}
+
+/*
+ * Function: cb::read
+ *    Input: No input.
+ *   Output: Returns the first byte in the buffer.
+ *
+ * Description: Reads the oldest byte on buffer, removes it from buffer and return it to caller.
+ * Consumer side, the caller must know the buffer is not empty.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::read( void ) {
+	uint8_t ret = this->cb_buffer[ this->cb_start ];
+	cb_publish<T>( &this->cb_start, (this->cb_start +1) & (N -1) );
+	return ret;
+}
+
+/*
+ * Function: cb::write
+ *    Input: uint8_t byte to be written into the buffer.
+ *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ *
+ * Description: Write a byte into the end of buffer. Producer side, the byte is not visible to the
+ * consumer until cb::commit() is called.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::write( uint8_t byte ) {
+	// Refuse to overwrite data if buffer is full
+	if( ((this->cb_head +1) & (N -1)) == cb_acquire<T>( &this->cb_start ) ) { return false; }
+
+	// Write data to buffer and update the pending write pointer
+	this->cb_buffer[ this->cb_head ] = byte;
+	this->cb_head = (this->cb_head +1) & (N -1);
+
+	return true;
+}
+
+/*
+ * Function: cb::write
+ *    Input: const uint8_t* data is the block to be written into the buffer,
+ *           T bytes is the size of the block.
+ *   Output: Boolean representing: 1 - Success, 0 - Failure.
+ *
+ * Description: Bulk version of cb::write, the whole block is written or nothing at all. The copy is
+ * done in at most two memcpy() calls, one up to the end of the underlying array and one from its start.
+ * Producer side, the block is not visible to the consumer until cb::commit() is called.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::write( const uint8_t* data, T bytes ) {
+	if( bytes > this->available() ) { return false; }
+
+	uint16_t t_first = N - this->cb_head;
+	if( t_first > bytes ) { t_first = bytes; }
+
+	memcpy( &this->cb_buffer[ this->cb_head ], data, t_first );
+	memcpy( this->cb_buffer, data + t_first, bytes - t_first );
+	this->cb_head = (this->cb_head + bytes) & (N -1);
+
+	return true;
+}
+
+/*
+ * Function: cb::commit
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Publishes every byte written since the last commit to the consumer at once.
+ *
+ */
+template <uint16_t N, typename T> void cb<N, T>::commit( void ) {
+	cb_publish<T>( &this->cb_end, this->cb_head );
+}
+
+/*
+ * Function: cb::rollback
+ *    Input: No input.
+ *   Output: No output.
+ *
+ * Description: Discards every byte written since the last commit.
+ *
+ */
+template <uint16_t N, typename T> void cb<N, T>::rollback( void ) {
+	this->cb_head = this->cb_end;
+}
+
+/*
+ * Function: cb::peek
+ *    Input: T offset is the number of bytes to skip
+ *   Output: Returns the n byte in the buffer.
+ *
+ * Description: This function is very similiar to cb::read with the exception that the read byte will
+ * not be removed from buffer thus the name "peek". Consumer side.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::peek( T offset ) {
+	return this->cb_buffer[ (this->cb_start + offset) & (N -1) ];
+}
+
+/*
+ * Function: cb::peek
+ *    Input: T offset is the number of bytes to skip,
+ *           uint8_t* data is where the bytes will be copied to, T bytes is how many to copy.
+ *   Output: Boolean representing: 1 - Success, 0 - Not enough bytes on buffer.
+ *
+ * Description: Bulk version of cb::peek, copies in at most two memcpy() calls. Consumer side.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::peek( T offset, uint8_t* data, T bytes ) {
+	if( (uint32_t) offset + bytes > this->used() ) { return false; }
+
+	T t_pos = (this->cb_start + offset) & (N -1);
+	uint16_t t_first = N - t_pos;
+	if( t_first > bytes ) { t_first = bytes; }
+
+	memcpy( data, &this->cb_buffer[ t_pos ], t_first );
+	memcpy( data + t_first, this->cb_buffer, bytes - t_first );
+
+	return true;
+}
+
+/*
+ * Function: cb::read
+ *    Input: uint8_t* data is where the bytes will be copied to, T bytes is how many to read.
+ *   Output: Boolean representing: 1 - Success, 0 - Not enough bytes on buffer.
+ *
+ * Description: Bulk version of cb::read, all or nothing. Consumer side.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::read( uint8_t* data, T bytes ) {
+	if( ! this->peek( 0, data, bytes ) ) { return false; }
+
+	this->skip( bytes );
+	return true;
+}
+
+/*
+ * Function: cb::span
+ *    Input: T offset is the number of bytes to skip,
+ *           T* len receives the number of contiguous bytes available from the returned pointer.
+ *   Output: Pointer to the n byte in the buffer.
+ *
+ * Description: Gives direct access to the buffer memory so data can be used in place without copying
+ * it. The bytes past the end of the underlying array wrap to its start, *len tells the caller where
+ * that happens; the caller is expected to know how many bytes are actually stored.
+ *
+ */
+template <uint16_t N, typename T> uint8_t* cb<N, T>::span( T offset, T* len ) {
+	T t_pos = (this->cb_start + offset) & (N -1);
+	*len = N - t_pos;
+	return &this->cb_buffer[ t_pos ];
+}
+
+/*
+ * Function: cb::skip
+ *    Input: T bytes is the number of bytes to discard.
+ *   Output: No output.
+ *
+ * Description: Removes the oldest bytes from buffer without reading them, used to release data
+ * previously accessed in place with cb::span. Consumer side.
+ *
+ */
+template <uint16_t N, typename T> void cb<N, T>::skip( T bytes ) {
+	cb_publish<T>( &this->cb_start, (this->cb_start + bytes) & (N -1) );
+}
+
+/*
+ * Function: cb::empty
+ *    Input: No input.
+ *   Output: Boolean representing: 1 - Buffer is empty, 0 - Buffer is not empty.
+ *
+ * Description: Consumer side, only committed bytes are taken into account.
+ *
+ */
+template <uint16_t N, typename T> uint8_t cb<N, T>::empty( void ) {
+	return (this->cb_start == cb_acquire<T>( &this->cb_end )) ? true : false;
+}
+
+/*
+ * Function: cb::available
+ *    Input: No input.
+ *   Output: Number of bytes that can still be written.
+ *
+ * Description: Producer side, bytes written but not yet committed are already accounted as used.
+ *
+ */
+template <uint16_t N, typename T> T cb<N, T>::available( void ) {
+	T t_used = (this->cb_head - cb_acquire<T>( &this->cb_start )) & (N -1);
+	return ( (N -1) - t_used );
+}
+
+/*
+ * Function: cb::used
+ *    Input: No input.
+ *   Output: Number of committed bytes waiting to be read.
+ *
+ * Description: Consumer side counterpart of cb::available.
+ *
+ */
+template <uint16_t N, typename T> T cb<N, T>::used( void ) {
+	return (cb_acquire<T>( &this->cb_end ) - this->cb_start) & (N -1);
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+  crc8.c - CRC-8/SMBUS protecting TWI Protocol compact frames
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <inttypes.h>
+
+#ifdef ARDUINO
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(address) (*(address))
+#endif
+
+#include "crc8.h"
+
+// CRC-8/SMBUS: polynomial 0x07, MSB first, no reflection, no final xor. crc8_update() of "123456789"
+// starting from CRC8_INIT is 0xF4.
+//
+// The AVR walks one byte at a time through a 256 bytes table kept in flash, hosts slice by 8 like
+// crc16_update() does.
+
+static const uint8_t crc8_table[256] PROGMEM = {
+  0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+  0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+  0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+  0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+  0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+  0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+  0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+  0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+  0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+  0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+  0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+  0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+  0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+  0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+  0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+  0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
+
+/*
+ * Function crc8_update_table
+ * Desc     bytewise table driven CRC
+ * Input    crc: CRC of the previous bytes, CRC8_INIT to start
+ *          data: bytes to add
+ *          length: number of bytes
+ * Output   updated CRC
+ */
+static uint8_t crc8_update_table(uint8_t crc, const uint8_t* data, uint16_t length)
+{
+  while(length--){
+    crc = pgm_read_byte(&crc8_table[crc ^ *data++]);
+  }
+  return crc;
+}
+
+#ifdef ARDUINO
+
+uint8_t crc8_update(uint8_t crc, const uint8_t* data, uint16_t length)
+{
+  return crc8_update_table(crc, data, length);
+}
+
+#else
+
+static uint8_t crc8_slices[8][256];
+static uint8_t crc8_ready;
+
+/*
+ * Function crc8_init
+ * Desc     builds the slicing tables, table k gives the CRC of a byte followed
+ *          by k zero bytes
+ * Input    none
+ * Output   none
+ */
+static void crc8_init(void)
+{
+  uint16_t i;
+  uint8_t k;
+
+  for(i = 0; i < 256; ++i){
+    crc8_slices[0][i] = crc8_table[i];
+  }
+  for(k = 1; k < 8; ++k){
+    for(i = 0; i < 256; ++i){
+      crc8_slices[k][i] = crc8_table[crc8_slices[k - 1][i]];
+    }
+  }
+  crc8_ready = 1;
+}
+
+/*
+ * Function crc8_update
+ * Desc     slicing by 8 CRC, same result as crc8_update_table
+ * Input    crc: CRC of the previous bytes, CRC8_INIT to start
+ *          data: bytes to add
+ *          length: number of bytes
+ * Output   updated CRC
+ */
+uint8_t crc8_update(uint8_t crc, const uint8_t* data, uint16_t length)
+{
+  if(!crc8_ready){
+    crc8_init();
+  }
+
+  while(length >= 8){
+    crc = crc8_slices[7][crc ^ data[0]] ^ crc8_slices[6][data[1]] ^
+          crc8_slices[5][data[2]] ^ crc8_slices[4][data[3]] ^
+          crc8_slices[3][data[4]] ^ crc8_slices[2][data[5]] ^
+          crc8_slices[1][data[6]] ^ crc8_slices[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+
+  return crc8_update_table(crc, data, length);
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+  crc8.h - CRC-8/SMBUS protecting TWI Protocol compact frames
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef crc8_h
+#define crc8_h
+
+  #include <inttypes.h>
+
+  #define CRC8_INIT 0x00
+
+  #ifdef __cplusplus
+  extern "C" {
+  #endif
+
+  uint8_t crc8_update(uint8_t, const uint8_t*, uint16_t);
+
+  #ifdef __cplusplus
+  }
+  #endif
+
+#endif
@@ -0,0 +1,240 @@
+/*
+  lz8.c - Byte oriented LZ77 compression of TWI Protocol packed payloads
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "lz8.h"
+
+// The stream is a sequence of tokens, each one starting with a control byte:
+//
+//   0x00 - 0x7F  control +1 literal bytes follow
+//   0x80 - 0xFF  (control & 0x7F) +3 bytes are copied from distance +1 bytes back in the output, the
+//                distance is the byte following the control one
+//
+// A match may overlap its own output, a distance of 0 repeats the last byte. Packets are at most 254
+// bytes long so a single byte reaches back to their start, nothing but the output is needed to expand
+// them and lz8_unpack() does it in place. Past its highest point the output only loses ground on the
+// input to literal tokens, every one but the first follows a match which gained at least a byte and a
+// single run may be split, hence LZ8_MARGIN.
+
+#define LZ8_MIN_MATCH 3
+#define LZ8_MAX_MATCH (0x7F + LZ8_MIN_MATCH)
+#define LZ8_MAX_LITERALS 0x80
+
+struct lz8_out {
+  uint8_t* dst;
+  uint8_t room;
+  uint8_t used;       // stream bytes written
+  uint8_t done;       // input bytes they expand to
+  uint16_t need;      // buffer size required to expand the stream in place
+};
+
+/*
+ * Function lz8_hash
+ * Desc     hashes the three bytes a match must start with
+ * Input    data: first byte
+ * Output   index in the position table
+ */
+static uint8_t lz8_hash(const uint8_t* data)
+{
+  return (uint8_t) ((data[0] << 3) ^ (data[1] << 1) ^ data[2] ^ (data[0] >> 3)) & (LZ8_HASH_SIZE - 1);
+}
+
+/*
+ * Function lz8_token
+ * Desc     appends a token, then accounts for the room lz8_unpack() needs: the
+ *          stream sits at the end of the buffer and the output must not catch
+ *          up with the bytes still to be read
+ * Input    out: stream being written
+ *          head: control byte, followed by the distance for a match
+ *          size: head size
+ *          literals: literal bytes, NULL for a match
+ *          count: bytes the token expands to
+ * Output   1 - appended, 0 - the stream doesn't fit
+ */
+static uint8_t lz8_token(struct lz8_out* out, const uint8_t* head, uint8_t size, const uint8_t* literals, uint8_t count)
+{
+  uint8_t length = size + (literals ? count : 0);
+
+  if(length > out->room - out->used){
+    return 0;
+  }
+  memcpy(out->dst + out->used, head, size);
+  if(literals){
+    memcpy(out->dst + out->used + size, literals, count);
+  }
+  out->used += length;
+  out->done += count;
+
+  // Bytes written so far plus stream bytes left, the latter are only known at the end
+  if(out->done > out->used && out->done - out->used > out->need){
+    out->need = out->done - out->used;
+  }
+  return 1;
+}
+
+/*
+ * Function lz8_literals
+ * Desc     appends literal tokens for the bytes without a match
+ * Input    out: stream being written
+ *          data: first byte
+ *          count: number of bytes
+ * Output   1 - appended, 0 - the stream doesn't fit
+ */
+static uint8_t lz8_literals(struct lz8_out* out, const uint8_t* data, uint8_t count)
+{
+  while(count){
+    uint8_t run = (count < LZ8_MAX_LITERALS) ? count : LZ8_MAX_LITERALS;
+    uint8_t control = run - 1;
+
+    if(!lz8_token(out, &control, 1, data, run)){
+      return 0;
+    }
+    data += run;
+    count -= run;
+  }
+  return 1;
+}
+
+/*
+ * Function lz8_pack
+ * Desc     greedy compression, a match is looked up in a table holding the last
+ *          position of every hash
+ * Input    src: bytes to compress
+ *          bytes: number of bytes, at most 254
+ *          dst: stream
+ *          room: size of dst
+ *          need: receives the buffer size lz8_unpack() requires, at least bytes
+ * Output   stream size, 0 when it doesn't fit in room
+ */
+uint8_t lz8_pack(const uint8_t* src, uint8_t bytes, uint8_t* dst, uint8_t room, uint16_t* need)
+{
+  uint8_t table[LZ8_HASH_SIZE];
+  struct lz8_out out;
+  uint8_t start = 0;
+  uint8_t p = 0;
+
+  out.dst = dst;
+  out.room = room;
+  out.used = 0;
+  out.done = 0;
+  out.need = 0;
+
+  // Positions never reach 0xFF
+  memset(table, 0xFF, sizeof(table));
+
+  while(p + LZ8_MIN_MATCH <= bytes){
+    uint8_t* slot = &table[lz8_hash(src + p)];
+    uint8_t from = *slot;
+    uint8_t length = 0;
+    uint8_t head[2];
+
+    *slot = p;
+    if(from != 0xFF && src[from] == src[p] && src[from + 1] == src[p + 1] && src[from + 2] == src[p + 2]){
+      length = LZ8_MIN_MATCH;
+      while(p + length < bytes && length < LZ8_MAX_MATCH && src[from + length] == src[p + length]){
+        length++;
+      }
+    }
+    if(!length){
+      p++;
+      continue;
+    }
+
+    head[0] = 0x80 | (length - LZ8_MIN_MATCH);
+    head[1] = p - from - 1;
+    if(!lz8_literals(&out, src + start, p - start) || !lz8_token(&out, head, 2, NULL, length)){
+      return 0;
+    }
+
+    // Positions inside the match are remembered as well, runs find themselves
+    start = p + length;
+    while(++p < start){
+      if(p + LZ8_MIN_MATCH <= bytes){
+        table[lz8_hash(src + p)] = p;
+      }
+    }
+  }
+
+  if(!lz8_literals(&out, src + start, bytes - start)){
+    return 0;
+  }
+
+  *need = out.used + out.need;
+  if(*need < bytes){
+    *need = bytes;
+  }
+  return out.used;
+}
+
+/*
+ * Function lz8_unpack
+ * Desc     moves the stream to the end of the buffer then expands it from the
+ *          start, a token which would overwrite stream bytes not read yet or
+ *          reach out of the output fails
+ * Input    buffer: receives the expanded bytes
+ *          room: size of buffer
+ *          packed: stream, anywhere inside buffer
+ *          length: stream size
+ *          bytes: expanded size
+ * Output   1 - buffer holds bytes bytes, 0 - corrupted stream or buffer too small
+ */
+uint8_t lz8_unpack(uint8_t* buffer, uint16_t room, const uint8_t* packed, uint8_t length, uint8_t bytes)
+{
+  uint8_t* end = buffer + room;
+  uint8_t* in;
+  uint8_t* out = buffer;
+  uint8_t* last = buffer + bytes;
+
+  if(length > room || bytes > room){
+    return 0;
+  }
+  in = end - length;
+  memmove(in, packed, length);
+
+  // The output never passes the input, so literals are moved forward safely
+  while(in < end){
+    uint8_t control = *in++;
+    uint8_t count;
+
+    if(control < 0x80){
+      count = control + 1;
+      if(count > end - in || count > last - out){
+        return 0;
+      }
+      memmove(out, in, count);
+      in += count;
+      out += count;
+    }else{
+      const uint8_t* from;
+
+      count = (control & 0x7F) + LZ8_MIN_MATCH;
+      if(in == end || *in >= out - buffer || count > last - out || count > in + 1 - out){
+        return 0;
+      }
+      from = out - *in++ - 1;
+      while(count--){
+        *out++ = *from++;
+      }
+    }
+  }
+
+  return out == last;
+}
@@ -0,0 +1,44 @@
+/*
+  lz8.h - Byte oriented LZ77 compression of TWI Protocol packed payloads
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef lz8_h
+#define lz8_h
+
+  #include <inttypes.h>
+
+  // Positions remembered by lz8_pack() to find matches, a power of two; every one takes a byte of stack
+  #ifndef LZ8_HASH_SIZE
+  #define LZ8_HASH_SIZE 64
+  #endif
+
+  // Bytes past the expanded size lz8_unpack() may need when the stream is shorter than its input
+  #define LZ8_MARGIN 2
+
+  #ifdef __cplusplus
+  extern "C" {
+  #endif
+
+  uint8_t lz8_pack(const uint8_t*, uint8_t, uint8_t*, uint8_t, uint16_t*);
+  uint8_t lz8_unpack(uint8_t*, uint16_t, const uint8_t*, uint8_t, uint8_t);
+
+  #ifdef __cplusplus
+  }
+  #endif
+
+#endif
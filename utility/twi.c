@@ -20,6 +20,8 @@
   Modified 2012 by Joao Brazio <joao@brazio.org> to improve master-to-master communication
 */
 
+#ifdef ARDUINO
+
 #include <math.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -43,9 +45,11 @@ static volatile uint8_t twi_state;
 static volatile uint8_t twi_slarw;
 static volatile uint8_t twi_sendStop;			// should the transaction end with a stop
 static volatile uint8_t twi_inRepStart;			// in the middle of a repeated start
+static volatile uint8_t twi_masterAsync;		// report the end of the write to twi_onMasterTransmit
 
 static void (*twi_onSlaveTransmit)(void);
 static void (*twi_onSlaveReceive)(uint8_t*, int);
+static void (*twi_onMasterTransmit)(uint8_t);
 
 static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
 static volatile uint8_t twi_masterBufferIndex;
@@ -60,6 +64,17 @@ static volatile uint8_t twi_rxBufferIndex;
 
 static volatile uint8_t twi_error;
 
+// SDA and SCL input registers, read directly instead of going through digitalRead()
+static volatile uint8_t* twi_sdaIn;
+static volatile uint8_t* twi_sclIn;
+static uint8_t twi_sdaMask;
+static uint8_t twi_sclMask;
+
+static uint16_t twi_seed = 0xACE1;
+static struct twi_bus_stats twi_stats;
+
+static uint8_t twi_startWrite(uint8_t, uint8_t, uint8_t, uint8_t);
+
 /*
  * Function twi_init
  * Desc     readys twi pins and sets twi bitrate
@@ -77,6 +92,11 @@ void twi_init(void)
   digitalWrite(SDA, 1);
   digitalWrite(SCL, 1);
 
+  twi_sdaIn = portInputRegister(digitalPinToPort(SDA));
+  twi_sclIn = portInputRegister(digitalPinToPort(SCL));
+  twi_sdaMask = digitalPinToBitMask(SDA);
+  twi_sclMask = digitalPinToBitMask(SCL);
+
   // initialize twi prescaler and bit rate
   cbi(TWSR, TWPS0);
   cbi(TWSR, TWPS1);
@@ -101,6 +121,20 @@ void twi_setAddress(uint8_t address)
 {
   // set twi slave address (skip over TWGCE bit)
   TWAR = address << 1;
+
+  // masters backing off after an arbitration loss must not draw the same delays
+  twi_seed ^= (uint16_t) address << 8 | address;
+}
+
+/*
+ * Function twi_getAddress
+ * Desc     returns the slave address set by twi_setAddress
+ * Input    none
+ * Output   7bit i2c device address
+ */
+uint8_t twi_getAddress(void)
+{
+  return TWAR >> 1;
 }
 
 /*
@@ -126,6 +160,7 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
   while(TWI_READY != twi_state){
     continue;
   }
+  twi_masterAsync = false;
   twi_state = TWI_MRX;
   twi_sendStop = sendStop;
   // reset error state (0xFF.. no error occured)
@@ -189,11 +224,202 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
  *          2 .. address send, NACK received
  *          3 .. data send, NACK received
  *          4 .. other twi error (lost bus arbitration, bus error, ..)
+ *          5 .. bus not idle after TWI_BUS_TIMEOUT_US
  */
 uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait, uint8_t sendStop)
 {
   uint8_t i;
+  uint8_t* buffer;
 
+  // ensure data will fit into buffer
+  if(TWI_BUFFER_LENGTH < length){
+    return 1;
+  }
+
+  // copy data to twi buffer
+  buffer = twi_getMasterBuffer();
+  for(i = 0; i < length; ++i){
+    buffer[i] = data[i];
+  }
+
+  return twi_writeMasterBuffer(address, length, wait, sendStop);
+}
+
+/*
+ * Function twi_getMasterBuffer
+ * Desc     waits for any master operation in progress to finish and hands
+ *          out the master buffer so the caller can build a frame in place
+ * Input    none
+ * Output   pointer to TWI_BUFFER_LENGTH bytes, valid until twi_writeMasterBuffer
+ */
+uint8_t* twi_getMasterBuffer(void)
+{
+  while(TWI_READY != twi_state){
+    continue;
+  }
+  return twi_masterBuffer;
+}
+
+/*
+ * Function twi_writeMasterBuffer
+ * Desc     same as twi_writeTo but sends what the caller already wrote into
+ *          the buffer returned by twi_getMasterBuffer, saving one copy. A
+ *          blocking write losing the arbitration is retried after a backoff
+ * Input    address: 7bit i2c device address
+ *          length: number of bytes in buffer
+ *          wait: boolean indicating to wait for write or not, when false the
+ *                outcome is reported to the master tx event from the ISR
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ * Output   same as twi_writeTo
+ *          5 .. bus not idle after TWI_BUS_TIMEOUT_US
+ */
+uint8_t twi_writeMasterBuffer(uint8_t address, uint8_t length, uint8_t wait, uint8_t sendStop)
+{
+  uint8_t attempt = 0;
+  uint8_t ret;
+  uint32_t start, backoff;
+
+  for(;;){
+    ret = twi_startWrite(address, length, wait, sendStop);
+    if(ret != 4 || !wait || attempt >= TWI_ARB_RETRIES){
+      return ret;
+    }
+
+    twi_stats.arb_retries++;
+    backoff = twi_backoff(attempt++);
+    start = micros();
+    while(micros() - start < backoff){
+      continue;
+    }
+  }
+}
+
+/*
+ * Function twi_backoff
+ * Desc     randomized exponential backoff after an arbitration loss
+ * Input    attempt: number of retries already done
+ * Output   delay in microseconds, up to TWI_BACKOFF_US << attempt
+ */
+uint32_t twi_backoff(uint8_t attempt)
+{
+  // xorshift16, enough to tell two masters apart
+  twi_seed ^= twi_seed << 7;
+  twi_seed ^= twi_seed >> 9;
+  twi_seed ^= twi_seed << 8;
+
+  return ((uint32_t) TWI_BACKOFF_US << attempt) * twi_seed >> 16;
+}
+
+/*
+ * Function twi_getBusStats
+ * Desc     copies the bus idle detector counters
+ * Input    stats: destination structure
+ * Output   none
+ */
+void twi_getBusStats(struct twi_bus_stats* stats)
+{
+  uint8_t sreg = SREG;
+  cli();
+  *stats = twi_stats;
+  SREG = sreg;
+}
+
+/*
+ * Function twi_lines
+ * Desc     samples SDA and SCL straight from the port input registers
+ * Input    none
+ * Output   bit 0 set when SDA is high, bit 1 set when SCL is high
+ */
+static inline uint8_t twi_lines(void)
+{
+  return ((*twi_sdaIn & twi_sdaMask) ? 1 : 0) | ((*twi_sclIn & twi_sclMask) ? 2 : 0);
+}
+
+/*
+ * Function twi_recover
+ * Desc     clocks SCL, up to nine times, until the slave holding SDA low
+ *          releases it then sends a STOP, the TWI hardware is off meanwhile
+ * Input    none
+ * Output   none
+ */
+static void twi_recover(void)
+{
+  uint8_t i;
+
+  TWCR = 0;
+  twi_stats.recoveries++;
+  twi_trace(TWI_TRACE_BUS, 0, TWI_TRACE_BUS_RECOVER, NULL, 0);
+
+  // open drain: driven low as an output, released high by the pullup as an input
+  for(i = 0; i < 9 && !(twi_lines() & 1); ++i){
+    digitalWrite(SCL, LOW);
+    pinMode(SCL, OUTPUT);
+    delayMicroseconds(500000L / TWI_FREQ);
+    pinMode(SCL, INPUT);
+    digitalWrite(SCL, HIGH);
+    delayMicroseconds(500000L / TWI_FREQ);
+  }
+
+  digitalWrite(SDA, LOW);
+  pinMode(SDA, OUTPUT);
+  delayMicroseconds(500000L / TWI_FREQ);
+  pinMode(SDA, INPUT);
+  digitalWrite(SDA, HIGH);
+
+  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+}
+
+/*
+ * Function twi_waitIdle
+ * Desc     waits for SDA and SCL to stay high for TWI_BUS_IDLE_US, a bus
+ *          stuck by a slave is recovered on the way
+ * Input    none
+ * Output   0 .. bus idle
+ *          5 .. bus still busy after TWI_BUS_TIMEOUT_US
+ */
+static uint8_t twi_waitIdle(void)
+{
+  uint32_t start = micros();
+  uint32_t busy = start;
+  uint32_t stuck = start;
+  uint32_t now;
+  uint8_t lines;
+  uint8_t ret = 0;
+
+  for(;;){
+    now = micros();
+    lines = twi_lines();
+
+    if(lines != 3 || twi_state != TWI_READY){ busy = now; }
+    else if(now - busy >= TWI_BUS_IDLE_US){ break; }
+
+    if(lines != 2){ stuck = now; }
+    else if(now - stuck >= TWI_BUS_STUCK_US){ twi_recover(); stuck = micros(); }
+
+    if(now - start >= TWI_BUS_TIMEOUT_US){
+      twi_stats.timeouts++;
+      ret = 5;
+      break;
+    }
+  }
+
+  now -= start;
+  twi_stats.wait_us += now;
+  if(now > twi_stats.wait_max_us){
+    twi_stats.wait_max_us = now;
+  }
+
+  return ret;
+}
+
+/*
+ * Function twi_startWrite
+ * Desc     a single twi_writeMasterBuffer attempt
+ * Input    same as twi_writeMasterBuffer
+ * Output   same as twi_writeMasterBuffer
+ */
+static uint8_t twi_startWrite(uint8_t address, uint8_t length, uint8_t wait, uint8_t sendStop)
+{
   // ensure data will fit into buffer
   if(TWI_BUFFER_LENGTH < length){
     return 1;
@@ -201,14 +427,14 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
 
 	#ifdef TWI_BUS_CHECK
 	// Check if the TWI bus is not in use before transmitting data.
-	// It's possible to revert to the old twi.c method by undefining TWI_BUS_CHECKS.
+	// It's possible to revert to the old twi.c method by undefining TWI_BUS_CHECK.
 
 	if( ! twi_inRepStart ) {
-		uint8_t t_countdown = TWI_BUS_CHECK;
-		while( t_countdown > 0 ) {
-			if( digitalRead(SDA) == LOW || digitalRead(SCL) == LOW || twi_state != TWI_READY ) { t_countdown = TWI_BUS_CHECK; }
-			else { t_countdown--; }
-	}; } else {
+		if( twi_waitIdle() ) {
+			twi_trace( TWI_TRACE_TX, address, 5, twi_masterBuffer, length );
+			return 5;
+		}
+	} else {
 		// On a repeated-start situation we cannot check for SDA and SCL being LOW
 		// because they'll always be low.. we are controlling the bus !
 		while( TWI_READY != twi_state ) { continue; }
@@ -220,6 +446,7 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
 
   twi_state = TWI_MTX;
   twi_sendStop = sendStop;
+  twi_masterAsync = ! wait;
   // reset error state (0xFF.. no error occured)
   twi_error = 0xFF;
 
@@ -227,11 +454,6 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
   twi_masterBufferIndex = 0;
   twi_masterBufferLength = length;
 
-  // copy data to twi buffer
-  for(i = 0; i < length; ++i){
-    twi_masterBuffer[i] = data[i];
-  }
-
   // build sla+w, slave device address + w bit
   twi_slarw = TW_WRITE;
   twi_slarw |= address << 1;
@@ -324,6 +546,52 @@ void twi_attachSlaveTxEvent( void (*function)(void) )
   twi_onSlaveTransmit = function;
 }
 
+/*
+ * Function twi_attachMasterTxEvent
+ * Desc     sets function called from the ISR when a write started with
+ *          wait set to false ends, it gets the twi_writeTo return code. When
+ *          the write ended with a repeated start the bus is still ours and
+ *          the function may chain the next write right away
+ * Input    function: callback function to use
+ * Output   none
+ */
+void twi_attachMasterTxEvent( void (*function)(uint8_t) )
+{
+  twi_onMasterTransmit = function;
+}
+
+/*
+ * Function twi_masterTxDone
+ * Desc     reports the end of an asynchronous write
+ * Input    status: twi_writeTo return code
+ * Output   none
+ */
+static void twi_masterTxDone(uint8_t status)
+{
+  if(twi_masterAsync){
+    twi_masterAsync = false;
+    if(twi_onMasterTransmit){
+      twi_onMasterTransmit(status);
+    }
+  }
+}
+
+/*
+ * Function twi_masterLost
+ * Desc     ends a write cut short by a lost arbitration or a bus error, the
+ *          interface may already be addressed as a slave by the winner
+ * Input    error: TW_STATUS the blocking twi_writeTo turns into its return code
+ * Output   none
+ */
+static void twi_masterLost(uint8_t error)
+{
+  if(TWI_MTX == twi_state){
+    twi_error = error;
+    twi_trace( TWI_TRACE_TX, twi_slarw >> 1, 4, twi_masterBuffer, twi_masterBufferLength );
+  }
+  twi_masterTxDone( 4 );
+}
+
 /*
  * Function twi_reply
  * Desc     sends byte or readys receive line
@@ -400,20 +668,28 @@ SIGNAL(TWI_vect)
 					TWCR = _BV(TWINT) | _BV(TWSTA)| _BV(TWEN);	// don't enable the interrupt. We'll generate the start, but we
 					twi_state = TWI_READY;						// avoid handling the interrupt until we're in the next transaction,
 				}												// at the point where we would normally issue the start.
+				twi_trace( TWI_TRACE_TX, twi_slarw >> 1, 0, twi_masterBuffer, twi_masterBufferLength );
+				twi_masterTxDone( 0 );
 			}
 			break;
 		case TW_MT_SLA_NACK: // address sent, nack received
 			twi_error = TW_MT_SLA_NACK;
 			twi_stop();
+			twi_trace( TWI_TRACE_TX, twi_slarw >> 1, 2, twi_masterBuffer, twi_masterBufferLength );
+			twi_masterTxDone( 2 );
 			break;
 		case TW_MT_DATA_NACK: // data sent, nack received
 			twi_error = TW_MT_DATA_NACK;
 			twi_stop();
+			twi_trace( TWI_TRACE_TX, twi_slarw >> 1, 3, twi_masterBuffer, twi_masterBufferLength );
+			twi_masterTxDone( 3 );
 			break;
 
 		case TW_MT_ARB_LOST: // lost bus arbitration
 			twi_error = TW_MT_ARB_LOST;
 			twi_releaseBus();
+			twi_trace( TWI_TRACE_TX, twi_slarw >> 1, 4, twi_masterBuffer, twi_masterBufferLength );
+			twi_masterTxDone( 4 );
 			break;
 
 		// Master Receiver
@@ -443,10 +719,11 @@ SIGNAL(TWI_vect)
 		// TW_MR_ARB_LOST handled by TW_MT_ARB_LOST case
 
 		// Slave Receiver
-		case TW_SR_SLA_ACK:				// addressed, returned ack
-		case TW_SR_GCALL_ACK:			// addressed generally, returned ack
 		case TW_SR_ARB_LOST_SLA_ACK:	// lost arbitration, returned ack
 		case TW_SR_ARB_LOST_GCALL_ACK:	// lost arbitration, returned ack
+			twi_masterLost( TW_MT_ARB_LOST );	// the write never gets to TW_MT_ARB_LOST, fall
+		case TW_SR_SLA_ACK:				// addressed, returned ack
+		case TW_SR_GCALL_ACK:			// addressed generally, returned ack
 			twi_state = TWI_SRX;		// enter slave receiver mode
 			twi_rxBufferIndex = 0;		// indicate that rx buffer can be overwritten and ack
 			twi_reply( 1 );
@@ -476,8 +753,9 @@ SIGNAL(TWI_vect)
 			break;
 
 		// Slave Transmitter
-		case TW_ST_SLA_ACK:					// addressed, returned ack
 		case TW_ST_ARB_LOST_SLA_ACK:		// arbitration lost, returned ack
+			twi_masterLost( TW_MT_ARB_LOST );	// the write never gets to TW_MT_ARB_LOST, fall
+		case TW_ST_SLA_ACK:					// addressed, returned ack
 			twi_state = TWI_STX;			// enter slave transmitter mode
 			twi_txBufferIndex = 0;			// ready the tx buffer index for iteration
 			twi_txBufferLength = 0;			// set tx buffer length to be zero, to verify if user changes it
@@ -506,8 +784,12 @@ SIGNAL(TWI_vect)
 			break;
 
 		case TW_BUS_ERROR:	// bus error, illegal stop/start
+			twi_masterLost( TW_BUS_ERROR );
 			twi_error = TW_BUS_ERROR;
 			twi_stop();
+			twi_trace( TWI_TRACE_BUS, 0, TWI_TRACE_BUS_ERROR, NULL, 0 );
 			break;
 	}
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -38,18 +38,94 @@
   #define TWI_SRX   3
   #define TWI_STX   4
 
-  #define TWI_BUS_CHECK 4
+  // Wait for an idle bus before every START, undefine to only wait for the TWI hardware
+  #define TWI_BUS_CHECK
+
+  // The bus is idle once SDA and SCL stayed high for TWI_BUS_IDLE_US
+  #ifndef TWI_BUS_IDLE_US
+  #define TWI_BUS_IDLE_US (2 * 1000000L / TWI_FREQ +1)
+  #endif
+
+  // SDA held low with SCL high for TWI_BUS_STUCK_US means a slave lost track of the transfer, SCL is
+  // clocked until it lets SDA go
+  #ifndef TWI_BUS_STUCK_US
+  #define TWI_BUS_STUCK_US 1000
+  #endif
+
+  // A write gives up with error 5 when the bus is not idle after TWI_BUS_TIMEOUT_US
+  #ifndef TWI_BUS_TIMEOUT_US
+  #define TWI_BUS_TIMEOUT_US 25000
+  #endif
+
+  // A blocking write losing the arbitration is retried up to TWI_ARB_RETRIES times after a random
+  // backoff of up to TWI_BACKOFF_US, doubled on every retry
+  #ifndef TWI_ARB_RETRIES
+  #define TWI_ARB_RETRIES 3
+  #endif
+
+  #ifndef TWI_BACKOFF_US
+  #define TWI_BACKOFF_US 200
+  #endif
+
+  // Number of events kept by the trace ring, a power of two up to 256, once full the oldest events
+  // are overwritten. 0 compiles the trace out
+  #ifndef TWI_TRACE_SIZE
+  #define TWI_TRACE_SIZE 0
+  #endif
+
+  #define TWI_TRACE_TX    0x01  // frame written as master, info is the twi_writeTo return code
+  #define TWI_TRACE_RX    0x02  // frame accepted by the slave receive callback
+  #define TWI_TRACE_DROP  0x03  // frame dropped by the slave receive callback, info is its reason
+  #define TWI_TRACE_BUS   0x04  // bus condition, info is one of TWI_TRACE_BUS_*
+  #define TWI_TRACE_LOST  0x05  // info events were overwritten before being read
+
+  #define TWI_TRACE_BUS_ERROR   0x01  // illegal START or STOP
+  #define TWI_TRACE_BUS_RECOVER 0x02  // SDA stuck low, SCL clocked until released
+
+  #define TWI_TRACE_FRAME 7     // frame bytes kept by every event
+
+  // 16 bytes, no padding, multi byte fields are little endian on the AVR and on usual hosts
+  struct twi_trace_record {
+    uint32_t time;                      // micros() of the logging node
+    uint8_t event;
+    uint8_t node;                       // address of the logging node
+    uint8_t peer;                       // destination of a TX, sender of an RX, 0 if unknown
+    uint8_t info;
+    uint8_t length;                     // frame length
+    uint8_t frame[TWI_TRACE_FRAME];     // first frame bytes, zero padded
+  };
+
+  struct twi_bus_stats {
+    uint32_t wait_us;       // time spent waiting for an idle bus
+    uint32_t wait_max_us;   // longest single wait
+    uint16_t timeouts;      // writes given up with error 5
+    uint16_t recoveries;    // stuck bus recoveries
+    uint16_t arb_retries;   // blocking writes retried after losing the arbitration
+  };
 
   void twi_init(void);
   void twi_setAddress(uint8_t);
   uint8_t twi_readFrom(uint8_t, uint8_t*, uint8_t, uint8_t);
   uint8_t twi_writeTo(uint8_t, uint8_t*, uint8_t, uint8_t, uint8_t);
+  uint8_t* twi_getMasterBuffer(void);
+  uint8_t twi_writeMasterBuffer(uint8_t, uint8_t, uint8_t, uint8_t);
   uint8_t twi_transmit(const uint8_t*, uint8_t);
   void twi_attachSlaveRxEvent( void (*)(uint8_t*, int) );
   void twi_attachSlaveTxEvent( void (*)(void) );
+  void twi_attachMasterTxEvent( void (*)(uint8_t) );
   void twi_reply(uint8_t);
   void twi_stop(void);
   void twi_releaseBus(void);
+  uint32_t twi_backoff(uint8_t);
+  void twi_getBusStats(struct twi_bus_stats*);
+  uint8_t twi_getAddress(void);
+  uint8_t twi_readTrace(struct twi_trace_record*);
+
+  #if TWI_TRACE_SIZE
+  void twi_trace(uint8_t, uint8_t, uint8_t, const uint8_t*, uint8_t);
+  #else
+  #define twi_trace(event, peer, info, frame, length)
+  #endif
 
 #endif
 
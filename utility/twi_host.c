@@ -0,0 +1,891 @@
+/*
+  twi_host.c - Simulated TWI/I2C bus for host (non Arduino) builds
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARDUINO
+
+#include "twi_host.h"
+#include "twi.h"
+
+// The simulated bus implements the twi.h API for up to TWI_HOST_MAX_NODES nodes living in the same
+// process. Every twi_* call acts on behalf of the currently selected node (see twi_host_select) and
+// transactions are executed synchronously: the slave receive callback of the addressed node is run,
+// with that node selected, before twi_writeTo() returns. Time is virtual, each transaction moves the
+// clock forward by the number of bit times it would take on a real bus clocked at TWI_FREQ.
+//
+// Writes started with wait set to false by a node with a master tx event attached are the exception:
+// like on the AVR the call returns at once and the transaction runs, followed by the event, once time
+// passes (twi_host_advance, delay) or the node asks for its master buffer again.
+
+struct twi_host_node {
+  uint8_t used;
+  uint8_t online;
+  uint8_t address;
+  uint8_t state;
+  void* context;
+
+  void (*onSlaveTransmit)(void);
+  void (*onSlaveReceive)(uint8_t*, int);
+  void (*onMasterTransmit)(uint8_t);
+  uint8_t pending;                  // asynchronous write waiting to be run
+  uint8_t pendingAddress;
+  uint8_t pendingLength;
+  uint8_t pendingStop;
+
+  uint8_t masterBuffer[TWI_BUFFER_LENGTH];
+  uint8_t rxBuffer[TWI_BUFFER_LENGTH];
+  uint8_t txBuffer[TWI_BUFFER_LENGTH];
+  uint8_t txBufferLength;
+};
+
+static struct twi_host_node twi_nodes[TWI_HOST_MAX_NODES];
+static uint8_t twi_current;
+static int16_t twi_owner = -1;      // node holding the bus after a transaction without stop
+
+static uint64_t twi_clock_ns;
+static struct twi_host_stats twi_stats;
+static struct twi_bus_stats twi_bus;
+static uint16_t twi_backoff_seed = 0xACE1;
+
+static void (*twi_monitor)(uint8_t, const uint8_t*, uint8_t);
+static void (*twi_idle)(void);
+static uint8_t twi_idling;
+
+static void twi_host_run(uint8_t node);
+static void twi_host_idle(void);
+static void twi_host_flush(uint64_t until);
+
+static uint16_t twi_arb_permille;
+static uint16_t twi_nack_permille;
+static uint16_t twi_noise_permille;
+static uint16_t twi_addressed_permille;
+static uint8_t twi_rival;           // the last arbitration was lost to a master reading this node
+static uint64_t twi_busy_ns;        // another device holds the bus until then
+static uint32_t twi_seed = 1;
+
+/*
+ * Function twi_host_random
+ * Desc     xorshift32 pseudo random generator, deterministic for a given seed
+ * Input    none
+ * Output   next random value
+ */
+static uint32_t twi_host_random(void)
+{
+  twi_seed ^= twi_seed << 13;
+  twi_seed ^= twi_seed >> 17;
+  twi_seed ^= twi_seed << 5;
+  return twi_seed;
+}
+
+/*
+ * Function twi_host_clock
+ * Desc     moves the virtual clock forward by a number of SCL periods
+ * Input    bits: number of bit times the bus was busy
+ * Output   none
+ */
+static void twi_host_clock(uint32_t bits)
+{
+  uint64_t ns = ((uint64_t) bits * 1000000000ULL) / TWI_FREQ;
+  twi_clock_ns += ns;
+  twi_stats.bus_us += (uint32_t) (ns / 1000);
+  twi_host_idle();
+}
+
+/*
+ * Function twi_host_find
+ * Desc     looks up an online node by its slave address
+ * Input    address: 7bit i2c device address
+ * Output   node index or -1 if no node answers to address
+ */
+static int16_t twi_host_find(uint8_t address)
+{
+  uint8_t i;
+  for(i = 0; i < TWI_HOST_MAX_NODES; ++i){
+    if(twi_nodes[i].used && twi_nodes[i].online && twi_nodes[i].address == address && i != twi_current){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Function twi_host_acquire
+ * Desc     common start of a master transaction: START condition plus arbitration
+ * Input    none
+ * Output   0 .. bus acquired
+ *          4 .. lost bus arbitration
+ */
+static uint8_t twi_host_acquire(void)
+{
+  // Another master is in the middle of a repeated start sequence, on a real bus we would
+  // lose the arbitration against it.
+  if(twi_owner >= 0 && twi_owner != twi_current){
+    twi_stats.arb_lost++;
+    return 4;
+  }
+
+  if(twi_owner != twi_current){
+    twi_clock_ns += TWI_HOST_IDLE_US * 1000ULL;
+    twi_bus.wait_us += TWI_HOST_IDLE_US;
+    if(twi_bus.wait_max_us < TWI_HOST_IDLE_US){
+      twi_bus.wait_max_us = TWI_HOST_IDLE_US;
+    }
+  }
+
+  twi_stats.transactions++;
+  if(twi_arb_permille && (twi_host_random() % 1000) < twi_arb_permille){
+    twi_host_clock(1 + 9);
+    twi_stats.arb_lost++;
+    twi_owner = -1;
+    twi_rival = twi_addressed_permille && (twi_host_random() % 1000) < twi_addressed_permille;
+    return 4;
+  }
+
+  return 0;
+}
+
+/*
+ * Function twi_host_addressed
+ * Desc     ends a lost arbitration the way twi_host_setAddressed asked: the winner
+ *          reads the selected node, which runs its slave transmit callback once the
+ *          master side got its error, like TW_ST_ARB_LOST_SLA_ACK on the AVR
+ * Input    none
+ * Output   none
+ */
+static void twi_host_addressed(void)
+{
+  struct twi_host_node* node = &twi_nodes[twi_current];
+
+  if(!twi_rival){
+    return;
+  }
+  twi_rival = false;
+  twi_stats.addressed++;
+
+  node->state = TWI_STX;
+  node->txBufferLength = 0;
+  if(node->onSlaveTransmit){
+    node->onSlaveTransmit();
+  }
+  node->state = TWI_READY;
+  twi_host_clock(9 * (node->txBufferLength ? node->txBufferLength : 1));
+}
+
+/*
+ * Function twi_host_release
+ * Desc     common end of a master transaction
+ * Input    sendStop: boolean indicating whether or not a stop was sent
+ * Output   none
+ */
+static void twi_host_release(uint8_t sendStop)
+{
+  if(sendStop){
+    twi_host_clock(1);
+    twi_stats.stops++;
+    twi_owner = -1;
+  }else{
+    twi_owner = twi_current;
+  }
+  twi_nodes[twi_current].state = TWI_READY;
+}
+
+/*
+ * Function twi_host_reset
+ * Desc     forgets every node, fault settings, statistics and resets the clock
+ * Input    none
+ * Output   none
+ */
+void twi_host_reset(void)
+{
+  memset(twi_nodes, 0, sizeof(twi_nodes));
+  memset(&twi_stats, 0, sizeof(twi_stats));
+  memset(&twi_bus, 0, sizeof(twi_bus));
+  twi_backoff_seed = 0xACE1;
+  twi_current = 0;
+  twi_owner = -1;
+  twi_clock_ns = 0;
+  twi_arb_permille = 0;
+  twi_nack_permille = 0;
+  twi_noise_permille = 0;
+  twi_addressed_permille = 0;
+  twi_rival = false;
+  twi_busy_ns = 0;
+  twi_seed = 1;
+  twi_monitor = 0;
+  twi_idle = 0;
+  twi_idling = 0;
+}
+
+/*
+ * Function twi_host_select
+ * Desc     selects the node every following twi_* call will act on behalf of
+ * Input    node: index between 0 and TWI_HOST_MAX_NODES -1
+ * Output   none
+ */
+void twi_host_select(uint8_t node)
+{
+  if(node < TWI_HOST_MAX_NODES){
+    twi_current = node;
+  }
+}
+
+/*
+ * Function twi_host_node
+ * Desc     returns the currently selected node
+ * Input    none
+ * Output   node index
+ */
+uint8_t twi_host_node(void)
+{
+  return twi_current;
+}
+
+/*
+ * Function twi_host_setContext
+ * Desc     attaches an opaque pointer to the selected node, used by upper layers
+ *          to find their own instance from within the slave callbacks
+ * Input    context: any pointer
+ * Output   none
+ */
+void twi_host_setContext(void* context)
+{
+  twi_nodes[twi_current].context = context;
+}
+
+/*
+ * Function twi_host_context
+ * Desc     returns the opaque pointer attached to the selected node
+ * Input    none
+ * Output   context pointer
+ */
+void* twi_host_context(void)
+{
+  return twi_nodes[twi_current].context;
+}
+
+/*
+ * Function twi_host_setOnline
+ * Desc     connects or disconnects a node from the bus, an offline node NACKs its address
+ * Input    node: node index
+ *          online: boolean
+ * Output   none
+ */
+void twi_host_setOnline(uint8_t node, uint8_t online)
+{
+  if(node < TWI_HOST_MAX_NODES){
+    twi_nodes[node].online = online;
+  }
+}
+
+/*
+ * Function twi_host_setFaults
+ * Desc     configures random fault injection
+ * Input    arb: probability (per thousand transactions) of losing arbitration
+ *          nack: probability (per thousand transactions) of a data byte being NACKed
+ *          seed: random generator seed, the same seed replays the same faults
+ * Output   none
+ */
+void twi_host_setFaults(uint16_t arb, uint16_t nack, uint32_t seed)
+{
+  twi_arb_permille = arb;
+  twi_nack_permille = nack;
+  twi_seed = seed ? seed : 1;
+}
+
+/*
+ * Function twi_host_setNoise
+ * Desc     configures silent corruption, the master never knows: the slave acks
+ *          every byte of the frame but gets one of them with a bit flipped
+ * Input    noise: probability (per thousand written frames) of a frame being hit,
+ *          drawn from the generator seeded by twi_host_setFaults
+ * Output   none
+ */
+void twi_host_setNoise(uint16_t noise)
+{
+  twi_noise_permille = noise;
+}
+
+/*
+ * Function twi_host_setAddressed
+ * Desc     makes the master winning an arbitration go on reading the loser, its
+ *          slave transmit callback then runs right after the failed transfer
+ * Input    addressed: probability (per thousand lost arbitrations), drawn from the
+ *          generator seeded by twi_host_setFaults
+ * Output   none
+ */
+void twi_host_setAddressed(uint16_t addressed)
+{
+  twi_addressed_permille = addressed;
+}
+
+/*
+ * Function twi_host_setBusy
+ * Desc     makes a device outside the simulation hold the bus, writes started
+ *          meanwhile wait for it like the AVR's TWI_BUS_CHECK does and give up
+ *          with error 5 after TWI_BUS_TIMEOUT_US
+ * Input    us: microseconds from now, 0 releases the bus
+ * Output   none
+ */
+void twi_host_setBusy(uint32_t us)
+{
+  twi_busy_ns = us ? twi_clock_ns + (uint64_t) us * 1000ULL : 0;
+}
+
+/*
+ * Function twi_host_waitIdle
+ * Desc     waits for the bus held by twi_host_setBusy, the master holding it
+ *          with a repeated start doesn't wait
+ * Input    none
+ * Output   0 .. bus idle
+ *          5 .. bus not idle after TWI_BUS_TIMEOUT_US
+ */
+static uint8_t twi_host_waitIdle(void)
+{
+  uint64_t limit = twi_clock_ns + TWI_BUS_TIMEOUT_US * 1000ULL;
+  uint32_t waited;
+  uint8_t ret = 0;
+
+  if(twi_owner == twi_current || twi_busy_ns <= twi_clock_ns){
+    return 0;
+  }
+
+  if(twi_busy_ns > limit){
+    twi_bus.timeouts++;
+    ret = 5;
+  }else{
+    limit = twi_busy_ns;
+  }
+
+  waited = (uint32_t) ((limit - twi_clock_ns) / 1000ULL);
+  twi_bus.wait_us += waited;
+  if(twi_bus.wait_max_us < waited){
+    twi_bus.wait_max_us = waited;
+  }
+  twi_clock_ns = limit;
+
+  return ret;
+}
+
+/*
+ * Function twi_host_advance
+ * Desc     moves the virtual clock forward, asynchronous writes started
+ *          meanwhile run concurrently
+ * Input    us: microseconds
+ * Output   none
+ */
+void twi_host_advance(uint32_t us)
+{
+  uint64_t until = twi_clock_ns + (uint64_t) us * 1000ULL;
+
+  twi_host_flush(until);
+  if(twi_clock_ns < until){
+    twi_clock_ns = until;
+  }
+  twi_host_idle();
+}
+
+/*
+ * Function twi_host_getStats
+ * Desc     copies the bus statistics
+ * Input    stats: destination structure
+ * Output   none
+ */
+void twi_host_getStats(struct twi_host_stats* stats)
+{
+  *stats = twi_stats;
+}
+
+/*
+ * Function twi_host_setMonitor
+ * Desc     sets a function called with every frame written on the bus, after the
+ *          slave acked it and before the slave receive callback runs
+ * Input    function: callback receiving the destination address, data and length
+ * Output   none
+ */
+void twi_host_setMonitor( void (*function)(uint8_t, const uint8_t*, uint8_t) )
+{
+  twi_monitor = function;
+}
+
+/*
+ * Function twi_host_idle
+ * Desc     runs the idle function, the node selected before is selected again
+ * Input    none
+ * Output   none
+ */
+static void twi_host_idle(void)
+{
+  uint8_t node = twi_current;
+
+  if(!twi_idle || twi_idling){
+    return;
+  }
+
+  twi_idling = 1;
+  twi_idle();
+  twi_idling = 0;
+  twi_current = node;
+}
+
+/*
+ * Function twi_host_setIdle
+ * Desc     sets a function called whenever the clock moves, on the bus or in
+ *          delay(), standing in for the loop() of the nodes not running; it may
+ *          select any node but must not use the bus, it is not called again
+ *          until it returns
+ * Input    function: callback, NULL removes it
+ * Output   none
+ */
+void twi_host_setIdle( void (*function)(void) )
+{
+  twi_idle = function;
+}
+
+uint32_t micros(void) { return (uint32_t) (twi_clock_ns / 1000ULL); }
+uint32_t millis(void) { return (uint32_t) (twi_clock_ns / 1000000ULL); }
+void delay(uint32_t ms) { twi_host_advance(ms * 1000UL); }
+void delayMicroseconds(uint32_t us) { twi_host_advance(us); }
+
+/*
+ * Function twi_init
+ * Desc     attaches the selected node to the bus
+ * Input    none
+ * Output   none
+ */
+void twi_init(void)
+{
+  twi_nodes[twi_current].used = true;
+  twi_nodes[twi_current].online = true;
+  twi_nodes[twi_current].state = TWI_READY;
+}
+
+/*
+ * Function twi_setAddress
+ * Desc     sets slave address of the selected node
+ * Input    address: 7bit i2c device address
+ * Output   none
+ */
+void twi_setAddress(uint8_t address)
+{
+  twi_nodes[twi_current].address = address;
+}
+
+/*
+ * Function twi_getAddress
+ * Desc     returns the slave address of the selected node
+ * Input    none
+ * Output   7bit i2c device address
+ */
+uint8_t twi_getAddress(void)
+{
+  return twi_nodes[twi_current].address;
+}
+
+/*
+ * Function twi_readFrom
+ * Desc     reads a series of bytes from another node, its slave transmit callback
+ *          is run to fill the reply
+ * Input    address: 7bit i2c device address
+ *          data: pointer to byte array
+ *          length: number of bytes to read into array
+ *          sendStop: Boolean indicating whether to send a stop at the end
+ * Output   number of bytes read
+ */
+uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sendStop)
+{
+  struct twi_host_node* slave;
+  uint8_t master = twi_current;
+  int16_t target;
+
+  if(TWI_BUFFER_LENGTH < length){
+    return 0;
+  }
+
+  if(twi_host_acquire()){
+    twi_host_addressed();
+    return 0;
+  }
+
+  twi_host_clock(1 + 9);
+  target = twi_host_find(address);
+  if(target < 0){
+    twi_stats.nacks++;
+    twi_host_release(true);
+    return 0;
+  }
+
+  slave = &twi_nodes[target];
+  slave->state = TWI_STX;
+  slave->txBufferLength = 0;
+  if(slave->onSlaveTransmit){
+    twi_current = target;
+    slave->onSlaveTransmit();
+    twi_current = master;
+  }
+  if(0 == slave->txBufferLength){
+    slave->txBufferLength = 1;
+    slave->txBuffer[0] = 0x00;
+  }
+  slave->state = TWI_READY;
+
+  if(slave->txBufferLength < length){
+    length = slave->txBufferLength;
+  }
+  memcpy(data, slave->txBuffer, length);
+
+  twi_host_clock(9 * length);
+  twi_stats.bytes += length;
+  twi_host_release(sendStop);
+
+  return length;
+}
+
+/*
+ * Function twi_writeTo
+ * Desc     writes a series of bytes to another node, its slave receive callback
+ *          is run before returning
+ * Input    address: 7bit i2c device address
+ *          data: pointer to byte array
+ *          length: number of bytes in array
+ *          wait: see twi_writeMasterBuffer
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ * Output   0 .. success
+ *          1 .. length to long for buffer
+ *          2 .. address send, NACK received
+ *          3 .. data send, NACK received
+ *          4 .. other twi error (lost bus arbitration, bus error, ..)
+ */
+uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait, uint8_t sendStop)
+{
+  if(TWI_BUFFER_LENGTH < length){
+    return 1;
+  }
+
+  memcpy(twi_getMasterBuffer(), data, length);
+  return twi_writeMasterBuffer(address, length, wait, sendStop);
+}
+
+/*
+ * Function twi_getMasterBuffer
+ * Desc     hands out the selected node master buffer so the caller can build a frame in place
+ * Input    none
+ * Output   pointer to TWI_BUFFER_LENGTH bytes, valid until twi_writeMasterBuffer
+ */
+uint8_t* twi_getMasterBuffer(void)
+{
+  while(twi_nodes[twi_current].pending){
+    twi_host_run(twi_current);
+  }
+  return twi_nodes[twi_current].masterBuffer;
+}
+
+/*
+ * Function twi_host_write
+ * Desc     runs a master write transaction on the simulated bus
+ * Input    address: 7bit i2c device address
+ *          length: number of bytes in the master buffer
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ * Output   same as twi_writeTo
+ */
+static uint8_t twi_host_write(uint8_t address, uint8_t length, uint8_t sendStop)
+{
+  struct twi_host_node* slave;
+  uint8_t* data = twi_nodes[twi_current].masterBuffer;
+  uint8_t master = twi_current;
+  uint8_t received = length;
+  uint8_t ret = 0;
+  int16_t target;
+
+  if(TWI_BUFFER_LENGTH < length){
+    return 1;
+  }
+
+  ret = twi_host_acquire();
+  if(ret){
+    twi_trace(TWI_TRACE_TX, address, ret, data, length);
+    return ret;
+  }
+
+  twi_host_clock(1 + 9);
+  target = twi_host_find(address);
+  if(target < 0){
+    twi_stats.nacks++;
+    twi_host_release(true);
+    twi_trace(TWI_TRACE_TX, address, 2, data, length);
+    return 2;
+  }
+
+  // A data NACK truncates the frame, the slave still sees a STOP and hands over what it got
+  if(length && twi_nack_permille && (twi_host_random() % 1000) < twi_nack_permille){
+    received = twi_host_random() % length;
+    twi_stats.nacks++;
+    sendStop = true;
+    ret = 3;
+  }
+
+  slave = &twi_nodes[target];
+  memcpy(slave->rxBuffer, data, received);
+
+  // Only the slave sees it, the monitor and the trace get the frame as sent
+  if(received && twi_noise_permille && (twi_host_random() % 1000) < twi_noise_permille){
+    slave->rxBuffer[twi_host_random() % received] ^= 1 << (twi_host_random() % 8);
+    twi_stats.corrupted++;
+  }
+  twi_host_clock(9 * (received + (ret ? 1 : 0)));
+  twi_stats.bytes += received;
+  twi_host_release(sendStop);
+
+  twi_trace(TWI_TRACE_TX, address, ret, data, length);
+
+  if(twi_monitor){
+    twi_monitor(address, data, received);
+  }
+
+  if(slave->onSlaveReceive){
+    twi_current = target;
+    slave->state = TWI_SRX;
+    slave->onSlaveReceive(slave->rxBuffer, received);
+    slave->state = TWI_READY;
+    twi_current = master;
+  }
+
+  return ret;
+}
+
+/*
+ * Function twi_host_run
+ * Desc     runs the asynchronous write of a node and reports it to the
+ *          node's master tx event
+ * Input    node: node index
+ * Output   none
+ */
+static void twi_host_run(uint8_t node)
+{
+  struct twi_host_node* n = &twi_nodes[node];
+  uint8_t previous = twi_current;
+  uint8_t ret;
+
+  n->pending = false;
+  twi_current = node;
+  ret = twi_host_write(n->pendingAddress, n->pendingLength, n->pendingStop);
+  n->onMasterTransmit(ret);
+  twi_host_addressed();
+  twi_current = previous;
+}
+
+/*
+ * Function twi_host_flush
+ * Desc     runs asynchronous writes, including the ones chained by master
+ *          tx events, as long as they start before a point in time
+ * Input    until: virtual clock limit in nanoseconds
+ * Output   none
+ */
+static void twi_host_flush(uint64_t until)
+{
+  uint8_t i, found;
+
+  do{
+    found = false;
+    for(i = 0; i < TWI_HOST_MAX_NODES; ++i){
+      if(twi_nodes[i].pending && twi_clock_ns < until){
+        twi_host_run(i);
+        found = true;
+      }
+    }
+  }while(found);
+}
+
+/*
+ * Function twi_writeMasterBuffer
+ * Desc     same as twi_writeTo but sends what the caller already wrote into
+ *          the buffer returned by twi_getMasterBuffer
+ * Input    address: 7bit i2c device address
+ *          length: number of bytes in buffer
+ *          wait: when false and a master tx event is attached the write is
+ *                deferred and its outcome reported to the event, otherwise a
+ *                write losing the arbitration is retried after a backoff
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ * Output   same as twi_writeTo, 0 when reported to the master tx event
+ */
+uint8_t twi_writeMasterBuffer(uint8_t address, uint8_t length, uint8_t wait, uint8_t sendStop)
+{
+  struct twi_host_node* node = &twi_nodes[twi_current];
+
+  uint8_t attempt = 0;
+  uint8_t ret;
+
+  // Like on the AVR the idle check runs before an asynchronous write is started
+  ret = twi_host_waitIdle();
+  if(ret){
+    twi_trace(TWI_TRACE_TX, address, ret, node->masterBuffer, length);
+    return ret;
+  }
+
+  if(!wait && node->onMasterTransmit){
+    node->pending = true;
+    node->pendingAddress = address;
+    node->pendingLength = length;
+    node->pendingStop = sendStop;
+    node->state = TWI_MTX;
+    return 0;
+  }
+
+  // A blocking write losing the arbitration is retried after a backoff, like on the AVR
+  for(;;){
+    ret = twi_host_write(address, length, sendStop);
+    twi_host_addressed();
+    if(ret != 4 || attempt >= TWI_ARB_RETRIES){
+      return ret;
+    }
+
+    twi_bus.arb_retries++;
+    twi_clock_ns += twi_backoff(attempt++) * 1000ULL;
+  }
+}
+
+/*
+ * Function twi_backoff
+ * Desc     randomized exponential backoff after an arbitration loss
+ * Input    attempt: number of retries already done
+ * Output   delay in microseconds, up to TWI_BACKOFF_US << attempt
+ */
+uint32_t twi_backoff(uint8_t attempt)
+{
+  twi_backoff_seed ^= twi_backoff_seed << 7;
+  twi_backoff_seed ^= twi_backoff_seed >> 9;
+  twi_backoff_seed ^= twi_backoff_seed << 8;
+
+  return ((uint32_t) TWI_BACKOFF_US << attempt) * twi_backoff_seed >> 16;
+}
+
+/*
+ * Function twi_getBusStats
+ * Desc     copies the bus idle detector counters, the simulated bus never
+ *          gets stuck so recoveries stay at zero
+ * Input    stats: destination structure
+ * Output   none
+ */
+void twi_getBusStats(struct twi_bus_stats* stats)
+{
+  *stats = twi_bus;
+}
+
+/*
+ * Function twi_transmit
+ * Desc     fills slave tx buffer with data
+ *          must be called in slave tx event callback
+ * Input    data: pointer to byte array
+ *          length: number of bytes in array
+ * Output   1 length too long for buffer
+ *          2 not slave transmitter
+ *          0 ok
+ */
+uint8_t twi_transmit(const uint8_t* data, uint8_t length)
+{
+  struct twi_host_node* node = &twi_nodes[twi_current];
+
+  if(TWI_BUFFER_LENGTH < length){
+    return 1;
+  }
+
+  if(TWI_STX != node->state){
+    return 2;
+  }
+
+  node->txBufferLength = length;
+  memcpy(node->txBuffer, data, length);
+
+  return 0;
+}
+
+/*
+ * Function twi_attachSlaveRxEvent
+ * Desc     sets function called before a slave read operation
+ * Input    function: callback function to use
+ * Output   none
+ */
+void twi_attachSlaveRxEvent( void (*function)(uint8_t*, int) )
+{
+  twi_nodes[twi_current].onSlaveReceive = function;
+}
+
+/*
+ * Function twi_attachSlaveTxEvent
+ * Desc     sets function called before a slave write operation
+ * Input    function: callback function to use
+ * Output   none
+ */
+void twi_attachSlaveTxEvent( void (*function)(void) )
+{
+  twi_nodes[twi_current].onSlaveTransmit = function;
+}
+
+/*
+ * Function twi_attachMasterTxEvent
+ * Desc     sets function called when a write started with wait set to false
+ *          ends, it gets the twi_writeTo return code
+ * Input    function: callback function to use
+ * Output   none
+ */
+void twi_attachMasterTxEvent( void (*function)(uint8_t) )
+{
+  twi_nodes[twi_current].onMasterTransmit = function;
+}
+
+/*
+ * Function twi_reply
+ * Desc     no-op, acknowledges are implicit on the simulated bus
+ * Input    ack: byte indicating to ack or to nack
+ * Output   none
+ */
+void twi_reply(uint8_t ack)
+{
+  (void) ack;
+}
+
+/*
+ * Function twi_stop
+ * Desc     relinquishes bus master status
+ * Input    none
+ * Output   none
+ */
+void twi_stop(void)
+{
+  if(twi_owner == twi_current){
+    twi_host_clock(1);
+    twi_stats.stops++;
+    twi_owner = -1;
+  }
+  twi_nodes[twi_current].state = TWI_READY;
+}
+
+/*
+ * Function twi_releaseBus
+ * Desc     releases bus control
+ * Input    none
+ * Output   none
+ */
+void twi_releaseBus(void)
+{
+  if(twi_owner == twi_current){
+    twi_owner = -1;
+  }
+  twi_nodes[twi_current].state = TWI_READY;
+}
+
+#endif
@@ -0,0 +1,88 @@
+/*
+  twi_host.h - Simulated TWI/I2C bus for host (non Arduino) builds
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef twi_host_h
+#define twi_host_h
+
+  // When ARDUINO is not defined the library is being built on a host (Linux, OSX..) and
+  // this header replaces <Arduino.h>: it provides the handful of core symbols used by the
+  // library plus the API to drive the simulated bus implemented in twi_host.c.
+
+  #include <stdlib.h>
+  #include <string.h>
+  #include <inttypes.h>
+
+  #ifndef TWI_HOST_MAX_NODES
+  #define TWI_HOST_MAX_NODES 8
+  #endif
+
+  // Bus free time after a STOP plus the TWI_BUS_CHECK idle polling done by twi.c before a new
+  // START, repeated starts skip it
+  #ifndef TWI_HOST_IDLE_US
+  #define TWI_HOST_IDLE_US 35
+  #endif
+
+  #ifndef __cplusplus
+  #ifndef true
+  #define true  1
+  #define false 0
+  #endif
+  #endif
+
+  #ifdef __cplusplus
+  extern "C" {
+  #endif
+
+  struct twi_host_stats {
+    uint32_t transactions;  // number of START conditions (including repeated starts)
+    uint32_t stops;         // number of STOP conditions
+    uint32_t bytes;         // data bytes acked by a slave, address bytes excluded
+    uint32_t nacks;         // address and data NACKs
+    uint32_t arb_lost;      // lost bus arbitrations
+    uint32_t bus_us;        // time the bus was not idle
+    uint32_t corrupted;     // frames the slave acked but got with a bit flipped
+    uint32_t addressed;     // arbitrations lost to a master which then read the loser
+  };
+
+  // Arduino core replacements, time is virtual and only moves with bus activity or delay()
+  uint32_t millis(void);
+  uint32_t micros(void);
+  void delay(uint32_t);
+  void delayMicroseconds(uint32_t);
+
+  void twi_host_reset(void);
+  void twi_host_select(uint8_t);
+  uint8_t twi_host_node(void);
+  void twi_host_setContext(void*);
+  void* twi_host_context(void);
+  void twi_host_setOnline(uint8_t, uint8_t);
+  void twi_host_setFaults(uint16_t, uint16_t, uint32_t);
+  void twi_host_setNoise(uint16_t);
+  void twi_host_setAddressed(uint16_t);
+  void twi_host_setBusy(uint32_t);
+  void twi_host_advance(uint32_t);
+  void twi_host_getStats(struct twi_host_stats*);
+  void twi_host_setMonitor(void (*)(uint8_t, const uint8_t*, uint8_t));
+  void twi_host_setIdle(void (*)(void));
+
+  #ifdef __cplusplus
+  }
+  #endif
+
+#endif
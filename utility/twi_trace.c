@@ -0,0 +1,135 @@
+/*
+  twi_trace.c - Event trace ring shared by the AVR and the simulated TWI drivers
+  Copyright (c) 2012 Joao Brazio <joao@brazio.org>, all rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef ARDUINO
+#include <avr/interrupt.h>
+#include "Arduino.h"
+#else
+#include "twi_host.h"
+#endif
+
+#include "twi.h"
+
+// Events are logged from the TWI interrupt and from loop(), every access to the ring is done with
+// interrupts disabled. Records are dumped as is, extras/trace2pcap turns them into a pcap file.
+
+#if TWI_TRACE_SIZE
+
+typedef char twi_trace_size_is_valid[((TWI_TRACE_SIZE & (TWI_TRACE_SIZE -1)) == 0 && TWI_TRACE_SIZE <= 256) ? 1 : -1];
+typedef char twi_trace_record_is_packed[(sizeof(struct twi_trace_record) == 16) ? 1 : -1];
+
+static struct twi_trace_record twi_traceRing[TWI_TRACE_SIZE];
+static uint16_t twi_traceHead;    // next record to be written
+static uint16_t twi_traceCount;   // records not read yet
+static uint16_t twi_traceLost;    // records overwritten before being read
+
+/*
+ * Function twi_trace
+ * Desc     logs an event, overwriting the oldest one when the ring is full
+ * Input    event: one of TWI_TRACE_*
+ *          peer: address of the other node, 0 if unknown
+ *          info: event specific value
+ *          frame: frame bytes, may be NULL when length is 0
+ *          length: frame length
+ * Output   none
+ */
+void twi_trace(uint8_t event, uint8_t peer, uint8_t info, const uint8_t* frame, uint8_t length)
+{
+  struct twi_trace_record* record;
+  uint8_t bytes = (length < TWI_TRACE_FRAME) ? length : TWI_TRACE_FRAME;
+  #ifdef ARDUINO
+  uint8_t sreg = SREG;
+  cli();
+  #endif
+
+  record = &twi_traceRing[twi_traceHead];
+  twi_traceHead = (twi_traceHead + 1) & (TWI_TRACE_SIZE - 1);
+  if(twi_traceCount < TWI_TRACE_SIZE){
+    twi_traceCount++;
+  }else{
+    twi_traceLost++;
+  }
+
+  record->time = micros();
+  record->event = event;
+  record->node = twi_getAddress();
+  record->peer = peer;
+  record->info = info;
+  record->length = length;
+  memset(record->frame, 0, TWI_TRACE_FRAME);
+  if(bytes){
+    memcpy(record->frame, frame, bytes);
+  }
+
+  #ifdef ARDUINO
+  SREG = sreg;
+  #endif
+}
+
+/*
+ * Function twi_readTrace
+ * Desc     fetches the oldest event, after an overflow a TWI_TRACE_LOST event
+ *          stamped with the time of the oldest event left comes first
+ * Input    record: destination structure
+ * Output   1 .. record filled
+ *          0 .. no event logged
+ */
+uint8_t twi_readTrace(struct twi_trace_record* record)
+{
+  uint8_t ret = false;
+  uint16_t tail;
+  #ifdef ARDUINO
+  uint8_t sreg = SREG;
+  cli();
+  #endif
+
+  if(twi_traceCount){
+    tail = (twi_traceHead - twi_traceCount) & (TWI_TRACE_SIZE - 1);
+    if(twi_traceLost){
+      memset(record, 0, sizeof(*record));
+      record->time = twi_traceRing[tail].time;
+      record->event = TWI_TRACE_LOST;
+      record->node = twi_getAddress();
+      record->info = (twi_traceLost < 0xFF) ? twi_traceLost : 0xFF;
+      twi_traceLost = 0;
+    }else{
+      *record = twi_traceRing[tail];
+      twi_traceCount--;
+    }
+    ret = true;
+  }
+
+  #ifdef ARDUINO
+  SREG = sreg;
+  #endif
+  return ret;
+}
+
+#else
+
+uint8_t twi_readTrace(struct twi_trace_record* record)
+{
+  (void) record;
+  return false;
+}
+
+#endif